@@ -0,0 +1,609 @@
+/*
+ * bench measures logger throughput and per-call latency.
+ *
+ * Every combination of the lists given on the command line is run
+ * against each output and reported as one line: records/s, bytes/s and
+ * the p50/p99/p99.9/max latency of a single log call, taken from a
+ * log-linear (HDR style) histogram with 32 sub-buckets per power of two.
+ * The latency includes building the fields, since the log macros
+ * evaluate their arguments inside the call.
+ *
+ *   ./bench [-t threads] [-n records] [-w workloads] [-b behaviours]
+ *           [-f fields] [-s string lengths] [-d depths] [-o outputs]
+ *           [-S dom|stream|binary] [-a async capacity] [-m none|thread|cpu]
+ *           [-i write|uring] [-g segment MB] [-r recorder MB] [-p shared MB]
+ *           [-R rotate MB] [-B block KB]
+ *
+ * Lists are comma separated, e.g. -t 1,4,16,64 -w object,nested.
+ * Workloads: object (flat log_object), array (flat log_array), nested
+ * (object()/array() trees), schema (the object records through
+ * log_schema), prepared (the nested tree as a prepared record built
+ * once per thread, with only a counter next to it changing per call).
+ * Behaviours: keep (LOG_KEEP, the tree is built per call and handed
+ * over) and copy (LOG_COPY, one tree per thread logged on every call,
+ * by reference with jansson 2.13 or later and as a deep copy before);
+ * they only differ for nested. -m writes one shard file per thread or
+ * per CPU instead of one file; outputs under /dev/ other than /dev/shm/
+ * are skipped then. -i picks how the async writer writes (-a), with
+ * writev() or through an io_uring. -g
+ * writes memory mapped segments of that many MB, with the same
+ * restriction on outputs as -m. -r keeps the records in a flight
+ * recorder of that many MB instead, which is never dumped, so nothing
+ * is written and -a is ignored. -p writes through a shared ring of that
+ * many MB and its collector thread, and ignores -a as well. -R rotates
+ * the file every that many MB, keeping one sealed file, with the same
+ * restriction on outputs as -m. -B writes compressed blocks of that many
+ * KB and their index, with the same restriction again, and can't be
+ * used with -S binary.
+ */
+#include <stdio.h>
+#include <getopt.h>
+#include <glob.h>
+
+#include "logger.h"
+
+#define BENCH_MAX_LIST 16
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+enum { W_OBJECT, W_ARRAY, W_NESTED, W_SCHEMA, W_PREPARED };
+
+static const char *workload_names[] = { "object", "array", "nested", "schema", "prepared" };
+
+static const char *behave_names[] = { "keep", "copy" };
+
+static const char *shard_names[] = { "none", "thread", "cpu" };
+
+static int shard_mode = LOG_SHARD_NONE;
+
+static size_t segment_size = 0;
+
+static size_t recorder_size = 0;
+
+static size_t shared_size = 0;
+
+static size_t rotate_size = 0;
+
+static size_t block_size = 0;
+
+struct list_t {
+    int v[BENCH_MAX_LIST];
+    int n;
+};
+
+struct bench_cfg_t {
+    int threads;
+    long records;
+    int workload;
+    int behave;
+    int fields;
+    int strlen;
+    int depth;
+};
+
+struct bench_thread_t {
+    pthread_t tid;
+    const struct bench_cfg_t *cfg;
+    pthread_barrier_t *start;
+    uint64_t hist[HIST_BUCKETS];
+    uint64_t max;
+    uint64_t bytes;
+    uint64_t failed;
+};
+
+static const char *keys[] = {
+    "k0", "k1", "k2", "k3", "k4", "k5", "k6", "k7",
+    "k8", "k9", "k10", "k11", "k12", "k13", "k14", "k15"
+};
+
+static uint64_t
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int
+hist_index(uint64_t v)
+{
+    if (v < HIST_SUB)
+        return (int)v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
+}
+
+/**
+ * hist_value returns the highest value that falls in bucket i.
+ */
+static uint64_t
+hist_value(int i)
+{
+    if (i < HIST_SUB)
+        return (uint64_t)i;
+    int shift = i / HIST_SUB - 1;
+    uint64_t low = (uint64_t)(HIST_SUB + i % HIST_SUB) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+static uint64_t
+hist_percentile(const uint64_t *hist, uint64_t total, double p)
+{
+    uint64_t rank = (uint64_t)(p / 100.0 * (double)total);
+    uint64_t seen = 0;
+
+    if (rank >= total)
+        rank = total - 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank)
+            return hist_value(i);
+    }
+    return 0;
+}
+
+/**
+ * The flat workloads need the field count at compile time, so 1, 4 and
+ * 16 fields are spelled out and -f only takes those.
+ * Fields cycle through int, string and double.
+ */
+#define FIELD(i) (i % 3 == 0 ? object_int(keys[i], i) : i % 3 == 1 ? \
+        object_string(keys[i], str) : object_double(keys[i], i + 0.5))
+#define FIELD4(i) FIELD(i), FIELD(i + 1), FIELD(i + 2), FIELD(i + 3)
+
+#define AF(i) (i % 3 == 0 ? array_int(i) : i % 3 == 1 ? \
+        array_string(str) : array_double(i + 0.5))
+#define AF4(i) AF(i), AF(i + 1), AF(i + 2), AF(i + 3)
+
+static int
+log_flat_object(int fields, const char *str)
+{
+    if (fields >= 16)
+        return log_object(LOG_KEEP, FIELD4(0), FIELD4(4), FIELD4(8), FIELD4(12));
+    if (fields >= 4)
+        return log_object(LOG_KEEP, FIELD4(0));
+    return log_object(LOG_KEEP, FIELD(0));
+}
+
+static int
+log_flat_array(int fields, const char *str)
+{
+    if (fields >= 16)
+        return log_array(LOG_KEEP, AF4(0), AF4(4), AF4(8), AF4(12));
+    if (fields >= 4)
+        return log_array(LOG_KEEP, AF4(0));
+    return log_array(LOG_KEEP, AF(0));
+}
+
+/**
+ * schemas holds the layouts of the 1, 4 and 16 field object records,
+ * with the same keys and types as FIELD.
+ */
+static struct log_schema_t *schemas[3];
+
+static void
+schemas_init()
+{
+    static const int counts[3] = { 1, 4, 16 };
+    struct log_schema_field_t f[16];
+
+    for (int i = 0; i < 16; i++) {
+        f[i].key = keys[i];
+        f[i].type = i % 3 == 0 ? LOG_INT : i % 3 == 1 ? LOG_STRING : LOG_REAL;
+    }
+    for (int i = 0; i < 3; i++)
+        schemas[i] = log_schema_new(f, (size_t)counts[i]);
+}
+
+static int
+log_flat_schema(int fields, const char *str)
+{
+    if (fields >= 16)
+        return log_schema(schemas[2], schema_int(0), schema_string(str), schema_real(2.5),
+            schema_int(3), schema_string(str), schema_real(5.5), schema_int(6),
+            schema_string(str), schema_real(8.5), schema_int(9), schema_string(str),
+            schema_real(11.5), schema_int(12), schema_string(str), schema_real(14.5),
+            schema_int(15));
+    if (fields >= 4)
+        return log_schema(schemas[1], schema_int(0), schema_string(str), schema_real(2.5),
+            schema_int(3));
+    return log_schema(schemas[0], schema_int(0));
+}
+
+/**
+ * nested builds a tree depth levels deep, alternating object() and
+ * array() levels, with a string leaf at the bottom.
+ */
+static JSON_STRUCT
+nested(int depth, const char *str)
+{
+    if (depth <= 0)
+        return object(LOG_KEEP, object_string("msg", str), object_int("count", 2));
+    if (depth % 2)
+        return array(LOG_KEEP, array_int(depth), array_object(nested(depth - 1, str)));
+    return object(LOG_KEEP, object_int("depth", depth),
+        object_object("child", nested(depth - 1, str)));
+}
+
+/**
+ * nested_prep builds the same tree as nested under parent as a
+ * prepared record.
+ */
+static void
+nested_prep(struct log_prep_t *parent, const char *key, int depth, const char *str)
+{
+    struct log_prep_t *n;
+
+    if (depth <= 0) {
+        n = log_prep_add(parent, key, LOG_OBJECT);
+        log_prep_set_string(log_prep_add(n, "msg", LOG_STRING), str);
+        log_prep_set_int(log_prep_add(n, "count", LOG_INT), 2);
+    } else if (depth % 2) {
+        n = log_prep_add(parent, key, LOG_ARRAY);
+        log_prep_set_int(log_prep_add(n, NULL, LOG_INT), depth);
+        nested_prep(n, NULL, depth - 1, str);
+    } else {
+        n = log_prep_add(parent, key, LOG_OBJECT);
+        log_prep_set_int(log_prep_add(n, "depth", LOG_INT), depth);
+        nested_prep(n, "child", depth - 1, str);
+    }
+}
+
+static void *
+bench_thread(void *arg)
+{
+    struct bench_thread_t *t = (struct bench_thread_t *)arg;
+    const struct bench_cfg_t *cfg = t->cfg;
+    JSON_STRUCT tree = NULL;
+    struct log_prep_t *prep = NULL, *counter = NULL;
+    char *str = (char *)malloc((size_t)cfg->strlen + 1);
+
+    memset(str, 'x', (size_t)cfg->strlen);
+    str[cfg->strlen] = '\0';
+    if (cfg->workload == W_NESTED && cfg->behave == LOG_COPY)
+        tree = nested(cfg->depth, str);
+    if (cfg->workload == W_PREPARED) {
+        prep = log_prep_object();
+        nested_prep(prep, "tree", cfg->depth, str);
+        counter = log_prep_add(prep, "i", LOG_INT);
+    }
+
+    pthread_barrier_wait(t->start);
+    for (long i = 0; i < cfg->records; i++) {
+        int wc;
+        uint64_t start = now_ns();
+        switch (cfg->workload) {
+            case W_OBJECT:
+                wc = log_flat_object(cfg->fields, str);
+                break;
+            case W_ARRAY:
+                wc = log_flat_array(cfg->fields, str);
+                break;
+            case W_SCHEMA:
+                wc = log_flat_schema(cfg->fields, str);
+                break;
+            case W_PREPARED:
+                log_prep_set_int(counter, (int)i);
+                wc = log_prepared(prep);
+                break;
+            default:
+                if (cfg->behave == LOG_COPY)
+                    wc = log_object(LOG_COPY, object_object("tree", tree));
+                else
+                    wc = log_object(LOG_KEEP,
+                        object_object("tree", nested(cfg->depth, str)));
+                break;
+        }
+        uint64_t d = now_ns() - start;
+        t->hist[hist_index(d)]++;
+        if (d > t->max)
+            t->max = d;
+        if (wc > LOG_FAIL)
+            t->bytes += (uint64_t)wc;
+        else
+            t->failed++;
+    }
+
+    if (tree != NULL)
+        JSON_DECREF(tree);
+    log_prep_free(prep);
+    free(str);
+    return NULL;
+}
+
+static int
+run(const char *output, const struct bench_cfg_t *cfg, int async_cap)
+{
+    struct bench_thread_t *t;
+    pthread_barrier_t start;
+    static uint64_t hist[HIST_BUCKETS];
+    uint64_t bytes = 0, failed = 0, max = 0;
+    uint64_t total = (uint64_t)cfg->threads * (uint64_t)cfg->records;
+    unsigned int shards = 0;
+    int rc;
+
+    if (shard_mode != LOG_SHARD_NONE || segment_size || rotate_size || block_size) {
+        if (strncmp(output, "/dev/", 5) == 0 && strncmp(output, "/dev/shm/", 9) != 0)
+            return 0;
+    }
+    if (recorder_size) {
+        rc = log_init_recorder(output, recorder_size, NULL);
+    } else if (shared_size) {
+        rc = log_init_shared(output, shared_size);
+    } else if (segment_size) {
+        rc = log_init_segments(output, segment_size);
+    } else if (rotate_size) {
+        unlink(output);
+        rc = log_init_rotating(output, rotate_size, 0, 1);
+    } else if (block_size) {
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "%s.idx", output);
+        unlink(output);
+        unlink(name);
+        rc = log_init_blocks(output, block_size);
+    } else if (shard_mode != LOG_SHARD_NONE) {
+        shards = shard_mode == LOG_SHARD_THREAD ?
+            (unsigned int)cfg->threads : (unsigned int)sysconf(_SC_NPROCESSORS_CONF);
+        rc = log_init_shards(output, shard_mode, shards);
+    } else {
+        if (strncmp(output, "/dev/", 5) != 0 || strncmp(output, "/dev/shm/", 9) == 0)
+            unlink(output);
+        rc = log_init(output);
+    }
+    if (rc != LOG_OPEN) {
+        fprintf(stderr, "bench: unable to open %s\n", output);
+        return -1;
+    }
+    if (async_cap > 0 && !recorder_size && !shared_size && log_async_start((size_t)async_cap, LOG_ASYNC_BLOCK) != LOG_OPEN) {
+        fprintf(stderr, "bench: unable to start async writer\n");
+        log_close();
+        return -1;
+    }
+
+    t = (struct bench_thread_t *)calloc((size_t)cfg->threads, sizeof(*t));
+    pthread_barrier_init(&start, NULL, (unsigned)cfg->threads + 1);
+    for (int i = 0; i < cfg->threads; i++) {
+        t[i].cfg = cfg;
+        t[i].start = &start;
+        pthread_create(&t[i].tid, NULL, bench_thread, &t[i]);
+    }
+    pthread_barrier_wait(&start);
+    uint64_t begin = now_ns();
+    for (int i = 0; i < cfg->threads; i++)
+        pthread_join(t[i].tid, NULL);
+    log_close();
+    double secs = (double)(now_ns() - begin) / 1e9;
+
+    memset(hist, 0, sizeof(hist));
+    for (int i = 0; i < cfg->threads; i++) {
+        for (int j = 0; j < HIST_BUCKETS; j++)
+            hist[j] += t[i].hist[j];
+        bytes += t[i].bytes;
+        failed += t[i].failed;
+        if (t[i].max > max)
+            max = t[i].max;
+    }
+
+    printf("%-28s %-6s %-4s %3d %3d %5d %3d %12.0f %9.1f %7llu %7llu %7llu %9llu",
+        output, workload_names[cfg->workload], behave_names[cfg->behave],
+        cfg->threads, cfg->fields, cfg->strlen, cfg->depth,
+        (double)total / secs, (double)bytes / secs / 1e6,
+        (unsigned long long)hist_percentile(hist, total, 50.0),
+        (unsigned long long)hist_percentile(hist, total, 99.0),
+        (unsigned long long)hist_percentile(hist, total, 99.9),
+        (unsigned long long)max);
+    if (failed)
+        printf(" (%llu failed)", (unsigned long long)failed);
+    printf("\n");
+    fflush(stdout);
+
+    pthread_barrier_destroy(&start);
+    free(t);
+    if (strncmp(output, "/dev/", 5) != 0 || strncmp(output, "/dev/shm/", 9) == 0)
+        unlink(output);
+    for (unsigned int i = 0; i < shards; i++) {
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "%s.%u", output, i);
+        unlink(name);
+    }
+    for (unsigned int i = 0; segment_size; i++) {
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "%s.%06u", output, i);
+        if (unlink(name) != 0)
+            break;
+    }
+    if (block_size) {
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "%s.idx", output);
+        unlink(name);
+    }
+    if (rotate_size) {
+        char pattern[PATH_MAX];
+        glob_t sealed;
+        snprintf(pattern, sizeof(pattern), "%s.*", output);
+        if (glob(pattern, 0, NULL, &sealed) == 0) {
+            for (size_t i = 0; i < sealed.gl_pathc; i++)
+                unlink(sealed.gl_pathv[i]);
+            globfree(&sealed);
+        }
+    }
+    return 0;
+}
+
+static int
+parse_list(const char *arg, struct list_t *l, const char *const *names, int nnames)
+{
+    char *copy = strdup(arg), *save = NULL;
+
+    l->n = 0;
+    for (char *tok = strtok_r(copy, ",", &save); tok != NULL && l->n < BENCH_MAX_LIST;
+            tok = strtok_r(NULL, ",", &save)) {
+        int i;
+        for (i = 0; i < nnames; i++) {
+            if (strcmp(tok, names[i]) == 0)
+                break;
+        }
+        if (names != NULL && i == nnames) {
+            fprintf(stderr, "bench: unknown value %s\n", tok);
+            free(copy);
+            return -1;
+        }
+        l->v[l->n++] = names != NULL ? i : atoi(tok);
+    }
+    free(copy);
+    return 0;
+}
+
+static void
+usage()
+{
+    fprintf(stderr,
+        "usage: bench [-t threads] [-n records] [-w object,array,nested,schema,\n"
+        "             prepared] [-b keep,copy] [-f fields] [-s strlen]\n"
+        "             [-d depth] [-o outputs] [-S dom|stream|binary] [-a async capacity]\n"
+        "             [-m none|thread|cpu] [-i write|uring] [-g segment MB]\n"
+        "             [-r recorder MB] [-p shared MB] [-R rotate MB] [-B block KB]\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct list_t threads = { { 1, 4, 16, 64 }, 4 };
+    struct list_t workloads = { { W_OBJECT, W_ARRAY, W_NESTED }, 3 };
+    struct list_t behaves = { { LOG_KEEP, LOG_COPY }, 2 };
+    struct list_t fields = { { 1, 4, 16 }, 3 };
+    struct list_t strlens = { { 16 }, 1 };
+    struct list_t depths = { { 4 }, 1 };
+    const char *outputs[BENCH_MAX_LIST] = {
+        "/dev/null", "/dev/shm/liblogger-bench.log", "bench.log"
+    };
+    int noutputs = 3;
+    long records = 20000;
+    int async_cap = 0;
+    int binary = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:n:w:b:f:s:d:o:S:a:m:i:g:r:p:R:B:h")) != -1) {
+        int rc = 0;
+        switch (opt) {
+            case 't':
+                rc = parse_list(optarg, &threads, NULL, 0);
+                break;
+            case 'n':
+                records = atol(optarg);
+                break;
+            case 'w':
+                rc = parse_list(optarg, &workloads, workload_names, 5);
+                break;
+            case 'b':
+                rc = parse_list(optarg, &behaves, behave_names, 2);
+                break;
+            case 'f':
+                rc = parse_list(optarg, &fields, NULL, 0);
+                for (int i = 0; rc == 0 && i < fields.n; i++) {
+                    if (fields.v[i] != 1 && fields.v[i] != 4 && fields.v[i] != 16) {
+                        fprintf(stderr, "bench: -f takes 1, 4 or 16 fields, not %d\n", fields.v[i]);
+                        rc = -1;
+                    }
+                }
+                break;
+            case 's':
+                rc = parse_list(optarg, &strlens, NULL, 0);
+                break;
+            case 'd':
+                rc = parse_list(optarg, &depths, NULL, 0);
+                break;
+            case 'o':
+                noutputs = 0;
+                for (char *tok = strtok(optarg, ","); tok != NULL && noutputs < BENCH_MAX_LIST;
+                        tok = strtok(NULL, ","))
+                    outputs[noutputs++] = tok;
+                break;
+            case 'S':
+                if (strcmp(optarg, "stream") == 0)
+                    log_set_serializer(LOG_SERIALIZE_STREAM);
+                else if (strcmp(optarg, "dom") == 0)
+                    log_set_serializer(LOG_SERIALIZE_DOM);
+                else if ((binary = strcmp(optarg, "binary") == 0))
+                    log_set_serializer(LOG_SERIALIZE_BINARY);
+                else
+                    usage();
+                break;
+            case 'a':
+                async_cap = atoi(optarg);
+                break;
+            case 'g':
+                segment_size = (size_t)atol(optarg) << 20;
+                break;
+            case 'r':
+                recorder_size = (size_t)atol(optarg) << 20;
+                break;
+            case 'p':
+                shared_size = (size_t)atol(optarg) << 20;
+                break;
+            case 'R':
+                rotate_size = (size_t)atol(optarg) << 20;
+                break;
+            case 'B':
+                block_size = (size_t)atol(optarg) << 10;
+                break;
+            case 'i':
+                if (strcmp(optarg, "uring") == 0)
+                    log_set_io_backend(LOG_IO_URING);
+                else if (strcmp(optarg, "write") == 0)
+                    log_set_io_backend(LOG_IO_WRITE);
+                else
+                    usage();
+                break;
+            case 'm': {
+                struct list_t l;
+                if ((rc = parse_list(optarg, &l, shard_names, 3)) == 0 && l.n > 0)
+                    shard_mode = l.v[0];
+                break;
+            }
+            default:
+                usage();
+        }
+        if (rc != 0)
+            usage();
+    }
+    if (binary && block_size) {
+        fprintf(stderr, "bench: -B writes JSON lines, it can't take -S binary\n");
+        usage();
+    }
+    schemas_init();
+
+    printf("%-28s %-6s %-4s %3s %3s %5s %3s %12s %9s %7s %7s %7s %9s\n",
+        "output", "work", "mode", "thr", "fld", "str", "dep",
+        "records/s", "MB/s", "p50ns", "p99ns", "p999ns", "maxns");
+
+    for (int o = 0; o < noutputs; o++)
+    for (int w = 0; w < workloads.n; w++)
+    for (int b = 0; b < behaves.n; b++)
+    for (int th = 0; th < threads.n; th++)
+    for (int f = 0; f < fields.n; f++)
+    for (int s = 0; s < strlens.n; s++)
+    for (int d = 0; d < depths.n; d++) {
+        struct bench_cfg_t cfg;
+        int is_tree = workloads.v[w] == W_NESTED || workloads.v[w] == W_PREPARED;
+
+        /* keep and copy only differ for nested, field count only for flat */
+        if (workloads.v[w] != W_NESTED && b > 0)
+            continue;
+        if (is_tree ? f > 0 : d > 0)
+            continue;
+        cfg.threads = threads.v[th];
+        cfg.records = records;
+        cfg.workload = workloads.v[w];
+        cfg.behave = behaves.v[b];
+        cfg.fields = is_tree ? 0 : fields.v[f];
+        cfg.strlen = strlens.v[s];
+        cfg.depth = is_tree ? depths.v[d] : 0;
+        if (run(outputs[o], &cfg, async_cap) != 0)
+            return 1;
+    }
+    return 0;
+}
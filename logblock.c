@@ -0,0 +1,390 @@
+/*
+ * logblock reads back the block files written by loggers set up with
+ * log_init_blocks.
+ *
+ *   ./logblock [-j jobs] [-f from] [-t to] [-o output] file
+ *   ./logblock -l [-f from] [-t to] file
+ *
+ * e.g. ./logblock -f 2026-10-18T09:00:00Z -t 2026-10-18T09:05:00Z app.log
+ *      ./logblock -f 1760778000 app.log
+ *
+ * Blocks are found through the index, file.idx, or by walking the file
+ * if there is none. Only the blocks whose time range meets [from, to]
+ * are read, jobs threads (one per CPU by default) inflating them while
+ * they are written out in file order, and only the records in the range
+ * are kept from them. Records without a timestamp, such as log_array
+ * ones, go with the record before them. from and to are RFC 3339 times
+ * or integers in any of the units of log_timestamp_types. -l lists the
+ * blocks instead. A damaged block is reported
+ * on stderr and skipped.
+ */
+#include <stdio.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+
+struct block_job_t {
+    struct log_blk_idx_t e;
+    char *data;
+    int state;
+};
+
+struct block_read_t {
+    int fd;
+    const char *name;
+    struct block_job_t *jobs;
+    size_t njobs;
+    size_t next;
+    size_t written;
+    size_t window;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+enum {
+    BLOCK_WAITING,
+    BLOCK_DONE,
+    BLOCK_DAMAGED
+};
+
+/**
+ * block_list collects the blocks of the file fd whose time range meets
+ * [from, to]. The index is read first and the file walked from where
+ * the index stops.
+ */
+static struct block_job_t *
+block_list(int fd, const char *name, int64_t from, int64_t to, size_t *count)
+{
+    struct block_job_t *jobs = NULL;
+    struct log_blk_idx_t e;
+    size_t n = 0, cap = 0;
+    uint64_t off = 0, end;
+    char *idx_name = (char *)malloc(strlen(name) + sizeof(".idx"));
+    struct stat st;
+    FILE *idx;
+    int keep = 0;
+
+    if (idx_name == NULL || fstat(fd, &st) != 0) {
+        perror(name);
+        exit(1);
+    }
+    end = (uint64_t)st.st_size;
+    sprintf(idx_name, "%s.idx", name);
+    idx = fopen(idx_name, "r");
+    free(idx_name);
+
+    for (;;) {
+        if (idx != NULL && fread(&e, sizeof(e), 1, idx) == 1 && log_blk_valid(&e.head) &&
+                e.offset >= off && e.offset + sizeof(e.head) + e.head.len <= end) {
+            off = e.offset + sizeof(e.head) + e.head.len;
+        } else {
+            if (idx != NULL) {
+                fclose(idx);
+                idx = NULL;
+            }
+            if ((off = log_blk_find(fd, off, end, &e.head)) == end)
+                break;
+            e.offset = off;
+            off += sizeof(e.head) + e.head.len;
+        }
+        /* blocks without timestamps go with the block before them */
+        if (e.head.first <= e.head.last)
+            keep = e.head.last >= from && e.head.first <= to;
+        else if (n == 0 && from == INT64_MIN)
+            keep = 1;
+        if (!keep)
+            continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            if ((jobs = (struct block_job_t *)realloc(jobs, cap * sizeof(struct block_job_t))) == NULL) {
+                perror("logblock");
+                exit(1);
+            }
+        }
+        memset(&jobs[n], 0, sizeof(struct block_job_t));
+        jobs[n++].e = e;
+    }
+    *count = n;
+    return jobs;
+}
+
+/**
+ * block_inflate reads the block of job and leaves its records in
+ * job->data. Returns BLOCK_DONE, or BLOCK_DAMAGED if the block does not
+ * inflate to what its header says.
+ */
+static int
+block_inflate(int fd, struct block_job_t *job, char *in)
+{
+    const struct log_blk_head_t *h = &job->e.head;
+    char *raw = (char *)malloc(h->raw_len);
+
+    if (raw == NULL) {
+        perror("logblock");
+        exit(1);
+    }
+    job->data = raw;
+    if (pread(fd, in, h->len, (off_t)(job->e.offset + sizeof(*h))) != (ssize_t)h->len)
+        return BLOCK_DAMAGED;
+    if (h->codec == LOG_BLK_STORED) {
+        memcpy(raw, in, h->len);
+    } else {
+#ifdef HAVE_ZLIB
+        z_stream zs;
+        int zst;
+
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, -15) != Z_OK)
+            return BLOCK_DAMAGED;
+        zs.next_in = (Bytef *)in;
+        zs.avail_in = h->len;
+        zs.next_out = (Bytef *)raw;
+        zs.avail_out = h->raw_len;
+        zst = inflate(&zs, Z_FINISH);
+        inflateEnd(&zs);
+        if (zst != Z_STREAM_END || zs.total_out != h->raw_len)
+            return BLOCK_DAMAGED;
+#else
+        return BLOCK_DAMAGED;
+#endif
+    }
+#ifdef HAVE_ZLIB
+    if (h->check != 0 && h->check != (uint32_t)crc32(0, (const Bytef *)raw, h->raw_len))
+        return BLOCK_DAMAGED;
+#endif
+    return BLOCK_DONE;
+}
+
+/**
+ * block_worker inflates the next block nobody has taken yet, staying
+ * at most window blocks ahead of the ones written out.
+ */
+static void *
+block_worker(void *arg)
+{
+    struct block_read_t *rd = (struct block_read_t *)arg;
+    char *in = NULL;
+    size_t in_cap = 0;
+
+    pthread_mutex_lock(&rd->lock);
+    for (;;) {
+        while (rd->next < rd->njobs && rd->next >= rd->written + rd->window)
+            pthread_cond_wait(&rd->cond, &rd->lock);
+        if (rd->next >= rd->njobs)
+            break;
+        struct block_job_t *job = &rd->jobs[rd->next++];
+        pthread_mutex_unlock(&rd->lock);
+
+        if (job->e.head.len > in_cap) {
+            in_cap = job->e.head.len;
+            if ((in = (char *)realloc(in, in_cap)) == NULL) {
+                perror("logblock");
+                exit(1);
+            }
+        }
+        int state = block_inflate(rd->fd, job, in);
+
+        pthread_mutex_lock(&rd->lock);
+        job->state = state;
+        pthread_cond_broadcast(&rd->cond);
+    }
+    pthread_mutex_unlock(&rd->lock);
+    free(in);
+    return NULL;
+}
+
+/**
+ * block_line returns the length of the record starting at p, n bytes
+ * being left.
+ */
+static size_t
+block_line(const char *p, size_t n)
+{
+    const char *nl = (const char *)memchr(p, '\n', n);
+    return nl ? (size_t)(nl - p) + 1 : n;
+}
+
+/**
+ * block_write writes out the records of a block that are in [from, to].
+ * *keep carries whether the last record was, for the ones without a
+ * timestamp that follow it.
+ */
+static int
+block_write(FILE *out, const struct block_job_t *job, int64_t from, int64_t to, int *keep)
+{
+    const struct log_blk_head_t *h = &job->e.head;
+    size_t off = 0;
+
+    if (h->first <= h->last && h->first >= from && h->last <= to) {
+        *keep = 1;
+        return fwrite(job->data, 1, h->raw_len, out) == h->raw_len ? 0 : -1;
+    }
+    while (off < h->raw_len) {
+        size_t len = block_line(job->data + off, h->raw_len - off);
+        int64_t ns;
+        if (log_blk_stamp(job->data + off, len, &ns) == 0)
+            *keep = ns >= from && ns <= to;
+        if (*keep && fwrite(job->data + off, 1, len, out) != len)
+            return -1;
+        off += len;
+    }
+    return 0;
+}
+
+static void
+block_time(char *buf, size_t size, int64_t ns)
+{
+    time_t sec = (time_t)(ns / 1000000000LL - (ns % 1000000000LL < 0));
+    struct tm tm;
+    size_t n;
+
+    gmtime_r(&sec, &tm);
+    n = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf + n, size - n, ".%06ldZ", (long)((ns % 1000000000LL + 1000000000LL) % 1000000000LL / 1000));
+}
+
+static void
+block_print(FILE *out, const struct block_job_t *jobs, size_t n)
+{
+    char first[48], last[48];
+
+    for (size_t i = 0; i < n; i++) {
+        const struct log_blk_idx_t *e = &jobs[i].e;
+        if (e->head.first <= e->head.last) {
+            block_time(first, sizeof(first), e->head.first);
+            block_time(last, sizeof(last), e->head.last);
+        } else {
+            strcpy(first, "-");
+            strcpy(last, "-");
+        }
+        fprintf(out, "%llu %s %s %u records %u/%u bytes\n", (unsigned long long)e->offset,
+                first, last, e->head.records, e->head.len, e->head.raw_len);
+    }
+}
+
+static int64_t
+block_arg(const char *arg)
+{
+    int64_t ns;
+
+    if (log_blk_ts_value(arg, arg + strlen(arg), &ns) != 0) {
+        fprintf(stderr, "logblock: %s: not a time\n", arg);
+        exit(2);
+    }
+    return ns;
+}
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: logblock [-j jobs] [-f from] [-t to] [-o output] file\n"
+                    "       logblock -l [-f from] [-t to] file\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct block_read_t rd;
+    pthread_t *threads;
+    FILE *out = stdout;
+    int64_t from = INT64_MIN, to = INT64_MAX;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt, list = 0, keep = 0, st = 0;
+
+    while ((opt = getopt(argc, argv, "f:t:j:o:lh")) != -1) {
+        switch (opt) {
+            case 'f':
+                from = block_arg(optarg);
+                break;
+            case 't':
+                to = block_arg(optarg);
+                break;
+            case 'j':
+                if ((jobs = atol(optarg)) <= 0)
+                    usage();
+                break;
+            case 'o':
+                if ((out = fopen(optarg, "w")) == NULL) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            case 'l':
+                list = 1;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc - 1)
+        usage();
+    if (jobs <= 0)
+        jobs = 1;
+
+    memset(&rd, 0, sizeof(rd));
+    rd.name = argv[optind];
+    if ((rd.fd = open(rd.name, O_RDONLY)) < 0) {
+        perror(rd.name);
+        return 1;
+    }
+    rd.jobs = block_list(rd.fd, rd.name, from, to, &rd.njobs);
+    if (list) {
+        block_print(out, rd.jobs, rd.njobs);
+        free(rd.jobs);
+        return fclose(out) == 0 ? 0 : 1;
+    }
+
+    rd.window = 2 * (size_t)jobs;
+    pthread_mutex_init(&rd.lock, NULL);
+    pthread_cond_init(&rd.cond, NULL);
+    if ((threads = (pthread_t *)calloc((size_t)jobs, sizeof(pthread_t))) == NULL) {
+        perror("logblock");
+        return 1;
+    }
+    for (long i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, block_worker, &rd) != 0) {
+            perror("logblock");
+            return 1;
+        }
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+    for (size_t i = 0; i < rd.njobs; i++) {
+        struct block_job_t *job = &rd.jobs[i];
+
+        pthread_mutex_lock(&rd.lock);
+        while (job->state == BLOCK_WAITING)
+            pthread_cond_wait(&rd.cond, &rd.lock);
+        pthread_mutex_unlock(&rd.lock);
+
+        if (job->state == BLOCK_DAMAGED) {
+            fprintf(stderr, "%s: block at %llu is damaged\n", rd.name,
+                    (unsigned long long)job->e.offset);
+            st = 1;
+        } else if (block_write(out, job, from, to, &keep) != 0) {
+            perror("logblock");
+            return 1;
+        }
+        free(job->data);
+        job->data = NULL;
+
+        pthread_mutex_lock(&rd.lock);
+        rd.written++;
+        pthread_cond_broadcast(&rd.cond);
+        pthread_mutex_unlock(&rd.lock);
+    }
+
+    for (long i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(rd.jobs);
+    close(rd.fd);
+    if (fclose(out) != 0) {
+        perror("logblock");
+        return 1;
+    }
+    return st;
+}
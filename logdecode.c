@@ -0,0 +1,559 @@
+/*
+ * logdecode turns logs written with LOG_SERIALIZE_BINARY back into the
+ * JSON lines LOG_SERIALIZE_STREAM writes for the same records.
+ *
+ *   ./logdecode [-o output] [log...]
+ *
+ * e.g. ./logdecode app.log > app.json
+ *
+ * A writer defines each key once and refers to it by number after
+ * that, so the files are decoded as one stream, in the order given:
+ * segments go in their order and a file cannot be decoded without the
+ * ones before it that the same threads wrote to. For the same reason
+ * shards should be per thread, not per CPU. Lines of JSON text, such
+ * as schema, prepared and tracked records, are copied as they are. A
+ * record that refers to a key that was never defined, because the
+ * record defining it was lost, is reported on stderr and skipped.
+ */
+#include <stdio.h>
+#include <getopt.h>
+
+#include "logger.h"
+
+#define DECODE_MAX_DEPTH 2048
+
+#define DECODE_WRITERS 1024
+
+/**
+ * decode_writer_t is the key dictionary of one writer. keys[id] is key
+ * id, with its length in lens[id].
+ */
+struct decode_writer_t {
+    uint64_t id;
+    char **keys;
+    size_t *lens;
+    size_t cap;
+    struct decode_writer_t *next;
+};
+
+struct decode_in_t {
+    const unsigned char *p;
+    const unsigned char *end;
+    struct decode_writer_t *w;
+    const char *err;
+};
+
+static struct decode_writer_t *writers[DECODE_WRITERS];
+
+static struct decode_writer_t *
+decode_writer(uint64_t id)
+{
+    struct decode_writer_t **head = &writers[id % DECODE_WRITERS], *w;
+
+    for (w = *head; w != NULL; w = w->next)
+        if (w->id == id)
+            return w;
+    if ((w = (struct decode_writer_t *)calloc(1, sizeof(*w))) == NULL) {
+        perror("logdecode");
+        exit(1);
+    }
+    w->id = id;
+    w->next = *head;
+    *head = w;
+    return w;
+}
+
+static void
+decode_writer_reset(struct decode_writer_t *w)
+{
+    for (size_t i = 0; i < w->cap; i++) {
+        free(w->keys[i]);
+        w->keys[i] = NULL;
+    }
+}
+
+static int
+decode_byte(struct decode_in_t *r, int *c)
+{
+    if (r->p == r->end) {
+        r->err = "record is cut short";
+        return 0;
+    }
+    *c = *r->p++;
+    return 1;
+}
+
+static int
+decode_varint(struct decode_in_t *r, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (r->p == r->end) {
+            r->err = "record is cut short";
+            return 0;
+        }
+        *v |= (uint64_t)(*r->p & 0x7F) << shift;
+        if ((*r->p++ & 0x80) == 0)
+            return 1;
+    }
+    r->err = "varint is too long";
+    return 0;
+}
+
+static inline int64_t
+decode_unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static int
+decode_double(struct decode_in_t *r, double *v)
+{
+    uint64_t u = 0;
+
+    if (r->end - r->p < 8) {
+        r->err = "record is cut short";
+        return 0;
+    }
+    for (int i = 0; i < 8; i++)
+        u |= (uint64_t)r->p[i] << (8 * i);
+    r->p += 8;
+    memcpy(v, &u, sizeof(u));
+    return 1;
+}
+
+static int
+decode_string(struct decode_in_t *r, const char **s, size_t *n)
+{
+    uint64_t len;
+
+    if (!decode_varint(r, &len))
+        return 0;
+    if (len > (uint64_t)(r->end - r->p)) {
+        r->err = "record is cut short";
+        return 0;
+    }
+    *s = (const char *)r->p;
+    *n = (size_t)len;
+    r->p += len;
+    return 1;
+}
+
+/**
+ * decode_key reads a key into *key and *len. *key is NUL terminated;
+ * if it is not kept in the dictionary it is allocated and *tmp is set
+ * to it for the caller to free. Returns 0 at the end of the members
+ * and -1 on error.
+ */
+static int
+decode_key(struct decode_in_t *r, const char **key, size_t *len, char **tmp)
+{
+    struct decode_writer_t *w = r->w;
+    uint64_t k, id;
+    const char *s;
+    char *copy;
+
+    *tmp = NULL;
+    if (!decode_varint(r, &k))
+        return -1;
+    if (k == 0)
+        return 0;
+    id = k >> 1;
+    if ((k & 1) == 0) {
+        if (id >= w->cap || w->keys[id] == NULL) {
+            r->err = "key was never defined";
+            return -1;
+        }
+        *key = w->keys[id];
+        *len = w->lens[id];
+        return 1;
+    }
+
+    if (!decode_string(r, &s, len))
+        return -1;
+    if ((copy = (char *)malloc(*len + 1)) == NULL) {
+        perror("logdecode");
+        exit(1);
+    }
+    memcpy(copy, s, *len);
+    copy[*len] = '\0';
+    *key = copy;
+    if (id == 0) {
+        *tmp = copy;
+        return 1;
+    }
+    if (id >= w->cap) {
+        size_t cap = w->cap ? w->cap : 64;
+        while (cap <= id)
+            cap <<= 1;
+        char **keys = (char **)realloc(w->keys, cap * sizeof(char *));
+        size_t *lens = keys ? (size_t *)realloc(w->lens, cap * sizeof(size_t)) : NULL;
+        if (lens == NULL) {
+            perror("logdecode");
+            exit(1);
+        }
+        memset(keys + w->cap, 0, (cap - w->cap) * sizeof(char *));
+        w->keys = keys;
+        w->lens = lens;
+        w->cap = cap;
+    }
+    free(w->keys[id]);
+    w->keys[id] = copy;
+    w->lens[id] = *len;
+    return 1;
+}
+
+/**
+ * decode_json rebuilds the nested json value with tag tag.
+ */
+static JSON_STRUCT
+decode_json(struct decode_in_t *r, int tag, int depth)
+{
+    JSON_STRUCT v = NULL;
+    const char *s;
+    uint64_t u;
+    double d;
+    size_t n;
+
+    if (depth > DECODE_MAX_DEPTH) {
+        r->err = "values are nested too deep";
+        return NULL;
+    }
+    switch (tag) {
+        case LOG_BIN_JSON_INT:
+            return decode_varint(r, &u) ? json_integer(decode_unzigzag(u)) : NULL;
+        case LOG_BIN_JSON_REAL:
+            return decode_double(r, &d) ? json_real(d) : NULL;
+        case LOG_BIN_JSON_STRING:
+            return decode_string(r, &s, &n) ? json_stringn_nocheck(s, n) : NULL;
+        case LOG_BIN_TRUE:
+            return json_true();
+        case LOG_BIN_FALSE:
+            return json_false();
+        case LOG_BIN_NULL:
+            return json_null();
+        case LOG_BIN_JSON_OBJECT:
+            v = json_object();
+            for (;;) {
+                const char *key;
+                char *tmp;
+                JSON_STRUCT m;
+                int st = decode_key(r, &key, &n, &tmp);
+                if (st == 0)
+                    return v;
+                if (st < 0 || !decode_byte(r, &tag) ||
+                        (m = decode_json(r, tag, depth + 1)) == NULL) {
+                    free(tmp);
+                    break;
+                }
+                json_object_set_new_nocheck(v, key, m);
+                free(tmp);
+            }
+            break;
+        case LOG_BIN_JSON_ARRAY:
+            v = json_array();
+            for (;;) {
+                JSON_STRUCT m;
+                if (!decode_byte(r, &tag))
+                    break;
+                if (tag == LOG_BIN_END)
+                    return v;
+                if ((m = decode_json(r, tag, depth + 1)) == NULL)
+                    break;
+                json_array_append_new(v, m);
+            }
+            break;
+        default:
+            r->err = "unknown value tag";
+            return NULL;
+    }
+    JSON_DECREF(v);
+    return NULL;
+}
+
+/**
+ * decode_value writes the value with tag tag to b the way
+ * log_buf_put_value does.
+ */
+static int
+decode_value(struct decode_in_t *r, struct log_buf_t *b, int tag)
+{
+    const char *s;
+    JSON_STRUCT v;
+    uint64_t u;
+    double d;
+    size_t n;
+    int ok;
+
+    switch (tag) {
+        case LOG_BIN_INT:
+            if (!decode_varint(r, &u))
+                return 0;
+            log_buf_put_int(b, decode_unzigzag(u));
+            return 1;
+        case LOG_BIN_REAL:
+            if (!decode_double(r, &d))
+                return 0;
+            if (!log_buf_put_double(b, d)) {
+                r->err = "real is not finite";
+                return 0;
+            }
+            return 1;
+        case LOG_BIN_STRING:
+            if (!decode_string(r, &s, &n))
+                return 0;
+            log_buf_put_string(b, s, n);
+            return 1;
+        default:
+            if ((v = decode_json(r, tag, 0)) == NULL)
+                return 0;
+            ok = JSON_DUMP_CALLBACK(v, log_buf_dump_cb, b) == 0;
+            JSON_DECREF(v);
+            return ok;
+    }
+}
+
+/**
+ * decode_object writes the log_object record in r as
+ * log_stream_object_begin and log_stream_object_field would.
+ */
+static int
+decode_object(struct decode_in_t *r, struct log_buf_t *b, int flags)
+{
+    struct timespec ts;
+    uint64_t sec, nsec, tid;
+    const char *key;
+    size_t len;
+    char *tmp;
+    int level, tag, st;
+
+    if (!decode_varint(r, &sec) || !decode_varint(r, &nsec))
+        return 0;
+    ts.tv_sec = (time_t)decode_unzigzag(sec);
+    ts.tv_nsec = (long)nsec;
+    log_ts_format = flags & LOG_BIN_TS_MASK;
+    log_buf_puts(b, "{\"timestamp\": ");
+    if (log_ts_format == LOG_TS_RFC3339) {
+        char text[40];
+        size_t n = log_timestamp_rfc3339(&ts, text);
+        log_buf_putc(b, '"');
+        log_buf_put(b, text, n);
+        log_buf_putc(b, '"');
+    } else {
+        log_buf_put_int(b, log_timestamp_int(&ts));
+    }
+    if (flags & LOG_BIN_THREAD) {
+        if (!decode_varint(r, &tid))
+            return 0;
+        log_buf_puts(b, ", \"thread_id\": ");
+        log_buf_put_int(b, (long long)tid);
+    }
+    if (flags & LOG_BIN_LEVEL) {
+        if (!decode_byte(r, &level))
+            return 0;
+        if (level > LOG_LEVEL_FATAL) {
+            r->err = "unknown level";
+            return 0;
+        }
+        log_buf_puts(b, ", \"level\": \"");
+        log_buf_put(b, log_level_names[level], strlen(log_level_names[level]));
+        log_buf_putc(b, '"');
+    }
+
+    while ((st = decode_key(r, &key, &len, &tmp)) > 0) {
+        log_buf_puts(b, ", ");
+        log_buf_put_string(b, key, len);
+        log_buf_puts(b, ": ");
+        free(tmp);
+        if (!decode_byte(r, &tag) || !decode_value(r, b, tag))
+            return 0;
+    }
+    if (st < 0)
+        return 0;
+    log_buf_putc(b, '}');
+    return 1;
+}
+
+static int
+decode_array(struct decode_in_t *r, struct log_buf_t *b)
+{
+    int tag, first = 1;
+
+    log_buf_putc(b, '[');
+    for (;;) {
+        if (!decode_byte(r, &tag))
+            return 0;
+        if (tag == LOG_BIN_END)
+            break;
+        if (!first)
+            log_buf_puts(b, ", ");
+        if (!decode_value(r, b, tag))
+            return 0;
+        first = 0;
+    }
+    log_buf_putc(b, ']');
+    return 1;
+}
+
+/**
+ * decode_frame decodes the frame of kind in data into b.
+ */
+static int
+decode_frame(int kind, const unsigned char *data, size_t len,
+    struct log_buf_t *b, const char **err)
+{
+    struct decode_in_t r = { data, data + len, NULL, NULL };
+    uint64_t writer;
+    int flags, ok;
+
+    b->len = 0;
+    b->failed = 0;
+    if (!decode_varint(&r, &writer) || !decode_byte(&r, &flags)) {
+        *err = r.err;
+        return 0;
+    }
+    r.w = decode_writer(writer);
+    if (flags & LOG_BIN_RESET)
+        decode_writer_reset(r.w);
+    ok = kind == LOG_BIN_OBJECT ? decode_object(&r, b, flags) : decode_array(&r, b);
+    if (ok && r.p != r.end) {
+        r.err = "trailing bytes after record";
+        ok = 0;
+    }
+    log_buf_putc(b, '\n');
+    if (b->failed) {
+        perror("logdecode");
+        exit(1);
+    }
+    *err = r.err;
+    return ok;
+}
+
+static int
+decode_read(FILE *in, const char *name, FILE *out)
+{
+    unsigned char *data = NULL;
+    char *line = NULL;
+    size_t cap = 0, line_cap = 0;
+    long long off = 0;
+    struct log_buf_t b = { 0 };
+    int c, st = 0;
+
+    while ((c = getc(in)) != EOF) {
+        long long at = off++;
+        uint64_t len = 0;
+        const char *err;
+        ssize_t n;
+
+        if (c == '\0')
+            continue;
+        if (c == '{' || c == '[') {
+            ungetc(c, in);
+            off--;
+            if ((n = getline(&line, &line_cap, in)) <= 0)
+                break;
+            off += n;
+            fwrite(line, 1, (size_t)n, out);
+            if (line[n - 1] != '\n')
+                fputc('\n', out);
+            continue;
+        }
+        if (c != LOG_BIN_OBJECT && c != LOG_BIN_ARRAY) {
+            fprintf(stderr, "%s: offset %lld: not a record\n", name, at);
+            st = 1;
+            break;
+        }
+
+        for (int shift = 0; shift < 35; shift += 7) {
+            int d = getc(in);
+            if (d == EOF) {
+                len = UINT64_MAX;
+                break;
+            }
+            off++;
+            len |= (uint64_t)(d & 0x7F) << shift;
+            if ((d & 0x80) == 0)
+                break;
+        }
+        if (len == UINT64_MAX || len > SIZE_MAX / 2) {
+            fprintf(stderr, "%s: offset %lld: bad record length\n", name, at);
+            st = 1;
+            break;
+        }
+        if (len > cap) {
+            unsigned char *p = (unsigned char *)realloc(data, (size_t)len);
+            if (p == NULL) {
+                perror("logdecode");
+                exit(1);
+            }
+            data = p;
+            cap = (size_t)len;
+        }
+        if (fread(data, 1, (size_t)len, in) != (size_t)len) {
+            fprintf(stderr, "%s: offset %lld: record is cut short\n", name, at);
+            st = 1;
+            break;
+        }
+        off += (long long)len;
+
+        if (decode_frame(c, data, (size_t)len, &b, &err))
+            fwrite(b.data, 1, b.len, out);
+        else
+            fprintf(stderr, "%s: offset %lld: %s, record skipped\n", name, at, err);
+    }
+    free(data);
+    free(line);
+    free(b.data);
+    if (ferror(in)) {
+        perror(name);
+        st = 1;
+    }
+    return st;
+}
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: logdecode [-o output] [log...]\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    FILE *out = stdout;
+    int opt, st = 0;
+
+    while ((opt = getopt(argc, argv, "o:h")) != -1) {
+        switch (opt) {
+            case 'o':
+                if ((out = fopen(optarg, "w")) == NULL) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+    log_set_utf8_check(0);
+
+    if (optind == argc)
+        st = decode_read(stdin, "-", out);
+    for (int i = optind; i < argc; i++) {
+        FILE *in = fopen(argv[i], "r");
+        if (in == NULL) {
+            perror(argv[i]);
+            st = 1;
+            continue;
+        }
+        st |= decode_read(in, argv[i], out);
+        fclose(in);
+    }
+    if (fclose(out) != 0) {
+        perror("logdecode");
+        return 1;
+    }
+    return st;
+}
@@ -0,0 +1,196 @@
+/*
+ * logdelta rebuilds collections tracked with log_track from the delta
+ * records a logger wrote for them.
+ *
+ *   ./logdelta [-s stream] [log...]
+ *
+ * e.g. ./logdelta -s orders app.log
+ *
+ * Records are applied in the order they are read, so shard files go
+ * through logmerge first. Without -s every stream is printed once at
+ * the end as {"stream": id, "seq": last, "state": ...}, one per line;
+ * with -s only the state of that stream is printed. Lines that are not
+ * delta records are skipped. A record whose seq does not follow the
+ * one before it in its stream means records were lost: that is
+ * reported on stderr and the stream is marked incomplete until its
+ * next reset.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <jansson.h>
+
+struct delta_stream_t {
+    char *id;
+    json_t *state;
+    json_int_t seq;
+    int complete;
+    struct delta_stream_t *next;
+};
+
+static struct delta_stream_t *streams = NULL;
+
+static struct delta_stream_t **streams_tail = &streams;
+
+static struct delta_stream_t *
+delta_stream_get(const char *id)
+{
+    struct delta_stream_t *s;
+
+    for (s = streams; s != NULL; s = s->next)
+        if (strcmp(s->id, id) == 0)
+            return s;
+    if ((s = (struct delta_stream_t *)calloc(1, sizeof(struct delta_stream_t))) == NULL ||
+            (s->id = strdup(id)) == NULL) {
+        perror("logdelta");
+        exit(1);
+    }
+    s->seq = -1;
+    *streams_tail = s;
+    streams_tail = &s->next;
+    return s;
+}
+
+/**
+ * delta_apply applies one delta record to its stream. A reset replaces
+ * the state, an append adds items to an array and an update sets and
+ * deletes members of an object.
+ */
+static void
+delta_apply(const char *name, size_t line, json_t *rec)
+{
+    json_t *id = json_object_get(rec, "stream"), *seq = json_object_get(rec, "seq");
+    json_t *op = json_object_get(rec, "op"), *items = json_object_get(rec, "items");
+    json_t *set = json_object_get(rec, "set"), *del = json_object_get(rec, "del");
+    struct delta_stream_t *s;
+    const char *key;
+    json_t *v;
+    size_t i;
+
+    if (!json_is_string(id) || !json_is_integer(seq) || !json_is_string(op))
+        return;
+    s = delta_stream_get(json_string_value(id));
+
+    if (strcmp(json_string_value(op), "reset") == 0) {
+        if (s->state != NULL)
+            json_decref(s->state);
+        if (json_is_array(items))
+            s->state = json_incref(items);
+        else
+            s->state = json_is_object(set) ? json_incref(set) : json_object();
+        s->complete = 1;
+    } else {
+        if (s->state == NULL || json_integer_value(seq) != s->seq + 1) {
+            fprintf(stderr, "%s:%zu: stream %s: missing records before seq %" JSON_INTEGER_FORMAT "\n",
+                    name, line, s->id, json_integer_value(seq));
+            s->complete = 0;
+        }
+        if (s->state == NULL)
+            s->state = json_is_array(items) ? json_array() : json_object();
+        if (json_is_array(s->state) && json_is_array(items)) {
+            json_array_foreach(items, i, v)
+                json_array_append(s->state, v);
+        } else if (json_is_object(s->state)) {
+            if (json_is_object(set)) {
+                json_object_foreach(set, key, v)
+                    json_object_set(s->state, key, v);
+            }
+            if (json_is_array(del)) {
+                json_array_foreach(del, i, v)
+                    if (json_is_string(v))
+                        json_object_del(s->state, json_string_value(v));
+            }
+        }
+    }
+    s->seq = json_integer_value(seq);
+}
+
+static int
+delta_read(FILE *in, const char *name)
+{
+    char *buf = NULL;
+    size_t cap = 0, line = 0;
+    ssize_t len;
+
+    while ((len = getline(&buf, &cap, in)) > 0) {
+        json_t *rec;
+        line++;
+        if (strstr(buf, "\"stream\"") == NULL)
+            continue;
+        if ((rec = json_loads(buf, 0, NULL)) == NULL)
+            continue;
+        if (json_is_object(rec))
+            delta_apply(name, line, rec);
+        json_decref(rec);
+    }
+    free(buf);
+    return ferror(in) ? -1 : 0;
+}
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: logdelta [-s stream] [log...]\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *only = NULL;
+    struct delta_stream_t *s;
+    int opt, st = 0;
+
+    while ((opt = getopt(argc, argv, "s:h")) != -1) {
+        switch (opt) {
+            case 's':
+                only = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if (optind == argc) {
+        if (delta_read(stdin, "-") != 0) {
+            perror("-");
+            st = 1;
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        FILE *in = fopen(argv[i], "r");
+        if (in == NULL || delta_read(in, argv[i]) != 0) {
+            perror(argv[i]);
+            st = 1;
+        }
+        if (in != NULL)
+            fclose(in);
+    }
+
+    for (s = streams; s != NULL; s = s->next) {
+        if (only != NULL && strcmp(s->id, only) != 0)
+            continue;
+        if (!s->complete)
+            fprintf(stderr, "stream %s: state is incomplete\n", s->id);
+        if (only != NULL) {
+            json_dumpf(s->state, stdout, JSON_ENCODE_ANY);
+        } else {
+            json_t *out = json_object();
+            json_object_set_new(out, "stream", json_string(s->id));
+            json_object_set_new(out, "seq", json_integer(s->seq));
+            json_object_set(out, "state", s->state);
+            json_dumpf(out, stdout, 0);
+            json_decref(out);
+        }
+        fputc('\n', stdout);
+        if (only != NULL)
+            break;
+    }
+    if (only != NULL && s == NULL) {
+        fprintf(stderr, "stream %s: no records\n", only);
+        st = 1;
+    }
+    return st;
+}
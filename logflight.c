@@ -0,0 +1,199 @@
+/*
+ * logflight gets the records out of flight recorders (see
+ * log_init_recorder) that were never dumped.
+ *
+ *   ./logflight [-o output] file...
+ *   ./logflight [-o output] -p pid
+ *
+ * e.g. ./logflight /dev/shm/app.ring > app.log
+ *      ./logflight core.1234 > app.log
+ *
+ * A file is either the ring file of a recorder set up with a ring
+ * path, or a core file of a process that had recorders. Every ring
+ * found is written out, oldest record first, and described on stderr.
+ * With -p the rings are read from the memory of the running process
+ * pid, which takes the same permission as attaching a debugger to it.
+ * Records come out as they were written; binary ones still go through
+ * logdecode.
+ */
+#include <stdio.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+
+/**
+ * flight_ring checks that a ring starts at mem, with n bytes
+ * available, and returns its length including the header, or 0.
+ */
+static size_t
+flight_ring(const char *mem, size_t n)
+{
+    const struct log_rec_head_t *h = (const struct log_rec_head_t *)mem;
+
+    if (n < LOG_REC_HEAD || memcmp(h->magic, LOG_REC_MAGIC, sizeof(h->magic)) != 0 ||
+            h->version != LOG_REC_VERSION || h->data_off != LOG_REC_HEAD ||
+            h->size < 64 * 1024 || (h->size & (h->size - 1)) != 0 ||
+            h->size > n - LOG_REC_HEAD)
+        return 0;
+    return LOG_REC_HEAD + (size_t)h->size;
+}
+
+/**
+ * flight_scan writes out every ring in the n bytes at mem. Rings are
+ * page aligned in memory, and so in core files too.
+ */
+static int
+flight_scan(const char *mem, size_t n, const char *name, int fd)
+{
+    int found = 0;
+
+    for (size_t off = 0; off + LOG_REC_HEAD <= n; off += LOG_REC_HEAD) {
+        struct log_rec_head_t *h = (struct log_rec_head_t *)(mem + off);
+        size_t len = flight_ring(mem + off, n - off);
+        long records;
+
+        if (len == 0)
+            continue;
+        if ((records = log_rec_dump_fd(h, mem + off + LOG_REC_HEAD, fd)) < 0) {
+            perror("logflight");
+            exit(1);
+        }
+        fprintf(stderr, "%s: ring of %llu bytes from pid %lld: %ld records, %llu dropped\n",
+                name, (unsigned long long)h->size, (long long)h->pid, records,
+                (unsigned long long)h->dropped);
+        found++;
+        off += len - LOG_REC_HEAD;
+    }
+    return found;
+}
+
+static int
+flight_file(const char *name, int fd)
+{
+    struct stat st;
+    void *mem;
+    int in, found;
+
+    if ((in = open(name, O_RDONLY)) < 0 || fstat(in, &st) != 0) {
+        perror(name);
+        if (in >= 0)
+            close(in);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(in);
+        return 0;
+    }
+    mem = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, in, 0);
+    close(in);
+    if (mem == MAP_FAILED) {
+        perror(name);
+        return -1;
+    }
+    found = flight_scan((const char *)mem, (size_t)st.st_size, name, fd);
+    munmap(mem, (size_t)st.st_size);
+    return found;
+}
+
+/**
+ * flight_pid reads the shared mappings of process pid that start with
+ * a ring and writes them out.
+ */
+static int
+flight_pid(const char *pid, int fd)
+{
+    char path[64], line[512], perms[8];
+    unsigned long long start, end;
+    int found = 0, mem;
+    FILE *maps;
+
+    snprintf(path, sizeof(path), "/proc/%s/maps", pid);
+    if ((maps = fopen(path, "r")) == NULL) {
+        perror(path);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "/proc/%s/mem", pid);
+    if ((mem = open(path, O_RDONLY)) < 0) {
+        perror(path);
+        fclose(maps);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), maps) != NULL) {
+        char head[LOG_REC_HEAD], *buf;
+        size_t len;
+
+        if (sscanf(line, "%llx-%llx %7s", &start, &end, perms) != 3 || perms[3] != 's')
+            continue;
+        if (pread(mem, head, sizeof(head), (off_t)start) != (ssize_t)sizeof(head) ||
+                memcmp(head, LOG_REC_MAGIC, sizeof(LOG_REC_MAGIC)) != 0)
+            continue;
+        len = (size_t)(end - start);
+        if ((buf = (char *)malloc(len)) == NULL) {
+            perror("logflight");
+            exit(1);
+        }
+        if (pread(mem, buf, len, (off_t)start) == (ssize_t)len)
+            found += flight_scan(buf, len, pid, fd);
+        else
+            perror(path);
+        free(buf);
+    }
+    close(mem);
+    fclose(maps);
+    return found;
+}
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: logflight [-o output] file...\n"
+                    "       logflight [-o output] -p pid\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *pid = NULL;
+    int fd = STDOUT_FILENO, opt, found = 0, st = 0;
+
+    while ((opt = getopt(argc, argv, "o:p:h")) != -1) {
+        switch (opt) {
+            case 'o':
+                if ((fd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            case 'p':
+                pid = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if ((pid == NULL) == (optind == argc))
+        usage();
+
+    if (pid != NULL) {
+        if ((found = flight_pid(pid, fd)) < 0)
+            return 1;
+    }
+    for (int i = optind; i < argc; i++) {
+        int n = flight_file(argv[i], fd);
+        if (n < 0)
+            st = 1;
+        else
+            found += n;
+    }
+    if (found == 0) {
+        fprintf(stderr, "logflight: no flight recorder found\n");
+        st = 1;
+    }
+    if (fd != STDOUT_FILENO && close(fd) != 0) {
+        perror("logflight");
+        return 1;
+    }
+    return st;
+}
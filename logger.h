@@ -28,12 +28,49 @@
 #ifndef _LOGGER_H
 #define _LOGGER_H
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#if !defined(SIMD_DISABLE) && defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define LOG_HAVE_AVX2
+#endif
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(THREAD_ENABLE) && !defined(URING_DISABLE) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define LOG_HAVE_URING
+#endif
+#endif
+
+#if defined(__linux__) && defined(THREAD_ENABLE)
+#define LOG_HAVE_SHM
+#endif
 
 #ifdef HAVE_JANSSON
 /**
@@ -45,6 +82,7 @@
 #define JSON_ARRAY_ADD(x)           json_array_append_new(root, x)
 #define JSON_INTEGER(x)             json_integer(x)
 #define JSON_STRING(x)              json_string(x)
+#define JSON_STRING_NOCHECK(x)      json_string_nocheck(x)
 #define JSON_REAL(x)                json_real(x)
 #define JSON_OBJECT()               json_object()
 #define JSON_ARRAY()                json_array()
@@ -53,6 +91,7 @@
 #define JSON_FALSE()                json_false()
 #define JSON_DUMPS(x)               json_dumps(x, 0)
 #define JSON_DECREF(x)              json_decref(x)
+#define JSON_INCREF(x)              json_incref(x)
 #define JSON_IS_OBJECT(x)           json_is_object(x)
 #define JSON_IS_ARRAY(x)            json_is_array(x)
 #define JSON_IS_INTEGER(x)          json_is_integer(x)
@@ -60,6 +99,7 @@
 #define JSON_IS_BOOLEAN(x)          json_is_boolean(x)
 #define JSON_IS_REAL(x)             json_is_real(x)
 #define JSON_COPY(x)                json_deep_copy(x)
+#define JSON_DUMP_CALLBACK(x, f, d) json_dump_callback(x, f, d, JSON_ENCODE_ANY)
 #define JSON_STRUCT                 json_t*
 
 #endif
@@ -71,8 +111,10 @@
  */   
 #include <pthread.h>
 
-static pthread_mutex_t lock_edit_log = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+#endif
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
 #endif
 /**
  * object_field_types is an enum of the supported log field types.
@@ -88,17 +130,64 @@ static enum {
     LOG_OTHER
 } object_field_types;
         
+/**
+ * object_behave_types says what happens to the json values passed as
+ * fields. LOG_KEEP hands them to the logger, which releases them.
+ * LOG_COPY leaves them with the caller. LOG_SHARE also leaves them
+ * with the caller, but object/array build their tree around
+ * references to them instead of deep copies. The caller must not
+ * change a shared value until that tree is logged or released, and
+ * must not change it from another thread while it is being logged.
+ */
 static enum { 
     LOG_KEEP, 
-    LOG_COPY
+    LOG_COPY,
+    LOG_SHARE
 } object_behave_types;
 
+/**
+ * A log_object/log_array record is serialized before the call returns,
+ * so LOG_COPY values only have to stay unchanged for the call. The
+ * logger takes a reference to them instead of a deep copy when jansson
+ * can dump one value from several threads at once. Before 2.13 it
+ * marks containers while dumping them, and before 2.11 its refcounts
+ * are not atomic.
+ */
+#if defined(HAVE_JANSSON) && defined(JANSSON_VERSION_HEX) && JANSSON_VERSION_HEX >= 0x020d00
+#define LOG_COPY_SHARES 1
+#else
+#define LOG_COPY_SHARES 0
+#endif
+
 static enum { 
     LOG_NO_ACTION,
     LOG_OPEN, 
     LOG_CLOSE,
     LOG_FAIL
 } log_behave_types;
+/**
+ * log_serializer_types selects how log_object/log_array turn their
+ * fields into text. LOG_SERIALIZE_DOM builds a jansson tree and dumps
+ * it, LOG_SERIALIZE_STREAM writes JSON text straight into a per-thread
+ * buffer. LOG_SERIALIZE_BINARY writes binary frames (see log_bin_tags)
+ * that logdecode turns into the lines LOG_SERIALIZE_STREAM writes.
+ */
+static enum {
+    LOG_SERIALIZE_DOM,
+    LOG_SERIALIZE_STREAM,
+    LOG_SERIALIZE_BINARY
+} log_serializer_types __attribute__((unused));
+
+/**
+ * log_value_t holds the raw value of a scalar field until it is
+ * serialized.
+ */
+union log_value_t {
+    int i;
+    const char *s;
+    double r;
+};
+
 /**
  * object_field_t represents a field in a log entry and it's
  * associated type.
@@ -107,11 +196,13 @@ struct object_field_t {
     uint8_t type;
     char *key;
     JSON_STRUCT json_any;
+    union log_value_t value;
 } object_field_t;
 
 struct array_field_t {
     uint8_t type;
     JSON_STRUCT json_any;
+    union log_value_t value;
 } array_field_t;
 
 struct any_type_t {
@@ -132,15 +223,21 @@ struct any_type_t {
 } any_type_t;
 
 /**
- * log_output contains the location we're
- * going to write our log entries to
+ * log_utf8_check is cleared by log_set_utf8_check for callers whose
+ * strings are known to be valid UTF-8.
  */
-static FILE *log_output = NULL;
+static int log_utf8_check = 1;
 
-enum {
+/**
+ * log_out_types is the kind of destination a sink writes to.
+ */
+static enum {
     LOG_OUT_STDERR,
     LOG_OUT_STDOUT,
-};
+    LOG_OUT_FILE,
+    LOG_OUT_UNIX_STREAM,
+    LOG_OUT_UNIX_DGRAM
+} log_out_types __attribute__((unused));
 
 int 
 check_json_type(JSON_STRUCT root);
@@ -169,420 +266,8555 @@ JSON_STRUCT
 reallarray(int behave_type, ...);
 
 /**
- * log is the main entry point for adding data
- * to the logger to create log entries
+ * logger_t is an independent log destination opened with logger_open.
+ * log_init/log_object and friends use a built in default one.
  */
-#define log_object(x, ...) ({ reallogobject(x, __VA_ARGS__, NULL); })
+typedef struct logger_t logger_t;
 
-#define log_array(x, ...) ({ reallogarray(x, __VA_ARGS__, NULL); })
+/**
+ * reallogger_object/reallogger_array write to logger lg and tag the
+ * record with one of the LOG_LEVEL_ values, or none for
+ * LOG_LEVEL_NONE. Use them through logger_log_object/logger_object_at.
+ */
+int
+reallogger_object(struct logger_t *lg, int level, int behave_type, ...);
 
-#define object(x, ...) ({ reallobject(x, __VA_ARGS__, NULL); })
+int
+reallogger_array(struct logger_t *lg, int level, int behave_type, ...);
 
-#define array(x, ...) ({ reallarray(x, __VA_ARGS__, NULL); })
 /**
- * log_init initializes the logger and sets up
- * where the logger writes to.
+ * The _fields variants take a counted array of field descriptors
+ * instead of a NULL terminated list of heap allocated ones.
  */
 int
-log_init(const char* file_name)
-{
-    int wc;
-#ifdef THREAD_ENABLE
-    while(pthread_mutex_lock(&lock_edit_log) != 0){ usleep(1); }
-#endif
-    if(!log_output){
-        log_output = fopen(file_name, "a+");
-        wc = (log_output != NULL) ? LOG_OPEN : LOG_FAIL;
-    }
-    else
-        wc = LOG_NO_ACTION;
-#ifdef THREAD_ENABLE
-    pthread_mutex_unlock(&lock_edit_log);
-#endif
-    return wc;
-}
+reallogobject_fields(struct logger_t *lg, int level, int behave_type,
+    struct object_field_t *fields, size_t n);
 
 int
-log_close()
-{
-    int wc;
-#ifdef THREAD_ENABLE
-    while(pthread_mutex_lock(&lock_edit_log) != 0){ usleep(1); }
-#endif
-    if(log_output){
-        int close_con = fclose(log_output);
-        wc = (close_con == NULL) ? LOG_CLOSE : LOG_FAIL;
-        log_output = NULL;
-    }
-    else
-        wc = LOG_NO_ACTION;
-#ifdef THREAD_ENABLE
-    pthread_mutex_unlock(&lock_edit_log);
-#endif
-    return wc;
-}
+reallogarray_fields(struct logger_t *lg, int level, int behave_type,
+    struct array_field_t *fields, size_t n);
+
+JSON_STRUCT
+reallobject_fields(int behave_type, struct object_field_t *fields, size_t n);
 
 /**
- * object_field_new allocates memory for a new log field,
- * sets the memory to 0, and returns a pointer to it.
+ * log_schema_t is a registered record layout: an ordered list of keys
+ * and their types, each key kept as a pre-escaped fragment.
  */
-static struct object_field_t*
-object_field_new(const char *key)
-{
-    struct object_field_t *field = 
-        (struct object_field_t *)calloc(1, sizeof(object_field_t));
-    if (field == NULL) {
-        perror("unable to allocation memory for new field");
-        return NULL;
-    }
-    memset(field, 0, sizeof(object_field_t));
-    field->key = (char *)calloc(1, strlen(key)+1);
-    strcpy(field->key, key);
-    return field;
-}
+struct log_schema_t;
 
-static struct array_field_t*
-array_field_new()
-{
-    struct array_field_t *field = 
-        (struct array_field_t *)calloc(1, sizeof(array_field_t));
-    if (field == NULL) {
-        perror("unable to allocation memory for new field");
-        return NULL;
-    }
-    memset(field, 0, sizeof(array_field_t));\
-    return field;
-}
 /**
- * object_field_free frees the memory used by the object_field_t.
- * struct.
+ * log_schema_field_t names one field of a schema. type is LOG_INT,
+ * LOG_REAL, LOG_STRING or LOG_BOOLEAN.
  */
-static void
-object_field_free(struct object_field_t *sf)
-{
-    if (sf != NULL) {
-        if (sf->key != NULL) {
-            free(sf->key);
-        }
-        // if ((sf->type == LOG_STRING) && (sf->char_value != NULL)) {
-        //     free(sf->char_value);
-        // }
-        free(sf);
-    }
-}
+struct log_schema_field_t {
+    const char *key;
+    int type;
+};
 
-static void
-array_field_free(struct array_field_t *sf)
-{
-    if (sf != NULL) {
-        // if ((sf->type == LOG_STRING) && (sf->char_value != NULL)) {
-        //     free(sf->char_value);
-        // }
-        free(sf);
-    }
-}
 /**
- * object_int is used to add an integer value
- * to the log entry.
+ * log_schema_value_t is one value of a schema record, made by
+ * schema_int, schema_real, schema_string or schema_bool.
  */
-struct object_field_t*
-object_int(const char *key, const int value)
-{
-    struct object_field_t *field = object_field_new(key);
-    field->type = LOG_INT;
-    field->json_any = JSON_INTEGER(value);
-    return field;
-}
+struct log_schema_value_t {
+    int type;
+    union {
+        int i;
+        double d;
+        const char *s;
+    } u;
+};
+
+struct log_schema_t *
+log_schema_new(const struct log_schema_field_t *fields, size_t n);
+
+void
+log_schema_free(struct log_schema_t *sch);
+
+int
+reallogger_schema(struct logger_t *lg, int level, const struct log_schema_t *sch,
+    const struct log_schema_value_t *values, size_t n);
 
 /**
- * object_double is used to add a double to the
- * log entry.
+ * log_prep_t is a node of a prepared record: an object, an array or a
+ * leaf value. The shape is built once and logged many times; every
+ * node keeps its serialized text and only the parts changed since the
+ * last log are serialized again.
  */
-struct object_field_t*
-object_double(const char *key, const double value)
-{
-    struct object_field_t *field = object_field_new(key);
-    field->type = LOG_REAL;
-    field->json_any = JSON_REAL(value);
-    return field;
-}
+struct log_prep_t;
+
+struct log_prep_t *
+log_prep_object();
+
+struct log_prep_t *
+log_prep_array();
+
+struct log_prep_t *
+log_prep_add(struct log_prep_t *parent, const char *key, int type);
+
+int
+log_prep_set_int(struct log_prep_t *leaf, int value);
+
+int
+log_prep_set_real(struct log_prep_t *leaf, double value);
+
+int
+log_prep_set_string(struct log_prep_t *leaf, const char *value);
+
+int
+log_prep_set_bool(struct log_prep_t *leaf, int value);
+
+void
+log_prep_free(struct log_prep_t *node);
+
+int
+reallogger_prepared(struct logger_t *lg, int level, struct log_prep_t *root);
 
 /**
- * object_string is used to add a string to the
- * log entry.
+ * log_track_t follows a JSON array or object that the application
+ * keeps growing or editing. Each log_track of it writes only what
+ * changed since the last one, as a delta record of its stream.
  */
-struct object_field_t*
-object_string(const char *key, const char *value)
-{
-    struct object_field_t *field = object_field_new(key);
-    field->type = LOG_STRING;
-    field->json_any = JSON_STRING(value);
-    return field;
-}
+struct log_track_t;
+
+struct log_track_t *
+log_track_new(const char *stream, JSON_STRUCT collection);
+
+void
+log_track_free(struct log_track_t *t);
+
+int
+reallogger_track(struct logger_t *lg, int level, struct log_track_t *t);
+
+JSON_STRUCT
+reallarray_fields(int behave_type, struct array_field_t *fields, size_t n);
 
 /**
- * object_array is used to add a array to the
- * log entry.
+ * log is the main entry point for adding data
+ * to the logger to create log entries
  */
-struct object_field_t*
-object_array(const char *key, JSON_STRUCT array)
-{
-    struct object_field_t *field = object_field_new(key);
-    field->type = LOG_ARRAY;
-    field->json_any = array;
-    return field;
-}
+#ifndef STACK_FIELDS_ENABLE
+#define log_object(x, ...) ({ reallogobject(x, __VA_ARGS__, NULL); })
+
+#define log_array(x, ...) ({ reallogarray(x, __VA_ARGS__, NULL); })
+
+#define object(x, ...) ({ reallobject(x, __VA_ARGS__, NULL); })
+
+#define array(x, ...) ({ reallarray(x, __VA_ARGS__, NULL); })
+
+#define logger_object_call(lg, lvl, x, ...) reallogger_object(lg, lvl, x, __VA_ARGS__, NULL)
+
+#define logger_array_call(lg, lvl, x, ...) reallogger_array(lg, lvl, x, __VA_ARGS__, NULL)
+#else
+#define logger_object_call(lg, lvl, x, ...) ({ \
+        struct object_field_t _log_f[] = { __VA_ARGS__ }; \
+        reallogobject_fields(lg, lvl, x, _log_f, sizeof(_log_f) / sizeof(_log_f[0])); })
+
+#define logger_array_call(lg, lvl, x, ...) ({ \
+        struct array_field_t _log_f[] = { __VA_ARGS__ }; \
+        reallogarray_fields(lg, lvl, x, _log_f, sizeof(_log_f) / sizeof(_log_f[0])); })
+
+#define log_object(x, ...) log_object_call(LOG_LEVEL_NONE, x, __VA_ARGS__)
+
+#define log_array(x, ...) log_array_call(LOG_LEVEL_NONE, x, __VA_ARGS__)
+
+#define object(x, ...) ({ \
+        struct object_field_t _log_f[] = { __VA_ARGS__ }; \
+        reallobject_fields(x, _log_f, sizeof(_log_f) / sizeof(_log_f[0])); })
+
+#define array(x, ...) ({ \
+        struct array_field_t _log_f[] = { __VA_ARGS__ }; \
+        reallarray_fields(x, _log_f, sizeof(_log_f) / sizeof(_log_f[0])); })
+#endif
+
+#define log_object_call(lvl, x, ...) logger_object_call(&log_default, lvl, x, __VA_ARGS__)
+
+#define log_array_call(lvl, x, ...) logger_array_call(&log_default, lvl, x, __VA_ARGS__)
 
 /**
- * object_object is used to json object a array to the
- * log entry.
+ * logger_log_object/logger_log_array are log_object/log_array for a
+ * logger from logger_open.
  */
-struct object_field_t*
-object_object(const char *key, JSON_STRUCT object)
-{
-    struct object_field_t *field = object_field_new(key);
-    field->type = LOG_OBJECT;
-    field->json_any = object;
-    return field;
-}
+#define logger_log_object(lg, x, ...) logger_object_call(lg, LOG_LEVEL_NONE, x, __VA_ARGS__)
+
+#define logger_log_array(lg, x, ...) logger_array_call(lg, LOG_LEVEL_NONE, x, __VA_ARGS__)
 
 /**
- * object_any_json is used to json object a array to the
- * log entry.
+ * log_schema_define registers a schema from a list of
+ * { "key", type } pairs.
  */
-struct object_field_t*
-object_any_json(const char *key, JSON_STRUCT object)
-{
-    switch(check_json_type(object)){
-        case LOG_ARRAY:
-            return object_array(key, object);
-        case LOG_OBJECT:
-            return object_object(key, object);
-        default:
-            return NULL;
-    }
-}
+#define log_schema_define(...) log_schema_new((struct log_schema_field_t[]){ __VA_ARGS__ }, \
+        sizeof((struct log_schema_field_t[]){ __VA_ARGS__ }) / sizeof(struct log_schema_field_t))
 
 /**
- * object_array is used to add a array to the
- * log entry.
+ * schema_int/schema_real/schema_string/schema_bool make the values of
+ * a schema record, converting their argument to int, double,
+ * const char * or a 0/1 int.
  */
+#define schema_int(v) ((struct log_schema_value_t){ LOG_INT, { .i = (int)(v) } })
 
-#define object_any(key, x) _Generic((x),  \
-        int: object_int(key, x),              \
-        double: object_double(key, x),              \
-        char *: object_string(key, x),        \
-        JSON_STRUCT: object_any_json(key, x),        \
-        default: NULL)
+#define schema_real(v) ((struct log_schema_value_t){ LOG_REAL, { .d = (double)(v) } })
 
+#define schema_string(v) ((struct log_schema_value_t){ LOG_STRING, { .s = (v) } })
 
-// array_func
+#define schema_bool(v) ((struct log_schema_value_t){ LOG_BOOLEAN, { .i = !!(v) } })
+
+#define logger_schema_call(lg, lvl, sch, ...) ({ \
+        struct log_schema_value_t _log_v[] = { __VA_ARGS__ }; \
+        reallogger_schema(lg, lvl, sch, _log_v, sizeof(_log_v) / sizeof(_log_v[0])); })
 
 /**
- * array_int is used to add an integer value
- * to the log entry.
+ * log_schema writes a record laid out by sch from positional values,
+ * one per schema field and in its order:
+ *
+ *   log_schema(sch, schema_int(200), schema_string("GET"), schema_real(2));
+ *
+ * A field whose value has another type is left out, except that a
+ * schema_int may fill a LOG_REAL or LOG_BOOLEAN field. Fields past the
+ * last value are left out too, so log_schema(sch) writes just the
+ * timestamp.
  */
-struct array_field_t*
-array_int(const int value)
-{
-    struct array_field_t *field = array_field_new();
-    field->type = LOG_INT;
-    field->json_any = JSON_INTEGER(value);
-    return field;
-}
+#define log_schema(sch, ...) logger_schema_call(&log_default, LOG_LEVEL_NONE, sch, __VA_ARGS__)
+
+#define logger_log_schema(lg, sch, ...) logger_schema_call(lg, LOG_LEVEL_NONE, sch, __VA_ARGS__)
 
 /**
- * array_double is used to add a double to the
- * log entry.
+ * log_prepared writes the prepared object root as a record.
  */
-struct array_field_t*
-array_double(const double value)
-{
-    struct array_field_t *field = array_field_new();
-    field->type = LOG_REAL;
-    field->json_any = JSON_REAL(value);
-    return field;
-}
+#define log_prepared(root) reallogger_prepared(&log_default, LOG_LEVEL_NONE, root)
+
+#define logger_log_prepared(lg, root) reallogger_prepared(lg, LOG_LEVEL_NONE, root)
 
 /**
- * array_string is used to add a string to the
+ * log_track writes the changes to t's collection since the last
+ * log_track of it, or nothing when there are none.
+ */
+#define log_track(t) reallogger_track(&log_default, LOG_LEVEL_NONE, t)
+
+#define logger_log_track(lg, t) reallogger_track(lg, LOG_LEVEL_NONE, t)
+
+/**
+ * Log levels. They are plain macros so that LOG_LEVEL_MIN can be set
+ * with -D and compared at compile time.
+ */
+#define LOG_LEVEL_NONE  -1
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_FATAL 4
+
+/**
+ * LOG_LEVEL_MIN is the lowest level compiled in. Calls below it fold
+ * away at compile time together with their arguments.
+ */
+#ifndef LOG_LEVEL_MIN
+#define LOG_LEVEL_MIN LOG_LEVEL_DEBUG
+#endif
+
+/**
+ * LOG_MODULE names the module the calls that follow belong to, for
+ * per-module thresholds. Define it before including logger.h.
+ */
+#ifndef LOG_MODULE
+#define LOG_MODULE "main"
+#endif
+
+static const char *const log_level_names[] = {
+    "DEBUG", "INFO", "WARN", "ERROR", "FATAL"
+};
+
+/**
+ * log_module_t is the runtime threshold of one module. level follows
+ * the global level unless it was set explicitly.
+ */
+struct log_module_t {
+    char *name;
+    int level;
+    int explicit_level;
+    struct log_module_t *next;
+};
+
+struct log_module_t *
+log_module_get(const char *name);
+
+static int log_level = LOG_LEVEL_DEBUG;
+
+/**
+ * log_level_enabled is the runtime level check. *mod caches the call
+ * site's module, so once resolved the check is a load and a compare.
+ */
+static inline int
+log_level_enabled(struct log_module_t **mod, const char *name, int level)
+{
+    struct log_module_t *m = __atomic_load_n(mod, __ATOMIC_ACQUIRE);
+
+    if (__builtin_expect(m == NULL, 0)) {
+        if ((m = log_module_get(name)) == NULL)
+            return level >= __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+        __atomic_store_n(mod, m, __ATOMIC_RELEASE);
+    }
+    return level >= __atomic_load_n(&m->level, __ATOMIC_RELAXED);
+}
+
+/**
+ * log_object_at/log_array_at log at a level. Both checks happen before
+ * any argument is evaluated: calls below LOG_LEVEL_MIN compile to
+ * nothing and calls below the module's runtime threshold cost one
+ * branch. Evaluates to the bytes written or LOG_NO_ACTION.
+ */
+#define logger_object_at(lg, lvl, x, ...) ({ \
+        int _log_wc = LOG_NO_ACTION; \
+        if ((lvl) >= LOG_LEVEL_MIN) { \
+            static struct log_module_t *_log_mod; \
+            if (log_level_enabled(&_log_mod, LOG_MODULE, lvl)) \
+                _log_wc = logger_object_call(lg, lvl, x, __VA_ARGS__); \
+        } \
+        _log_wc; })
+
+#define logger_array_at(lg, lvl, x, ...) ({ \
+        int _log_wc = LOG_NO_ACTION; \
+        if ((lvl) >= LOG_LEVEL_MIN) { \
+            static struct log_module_t *_log_mod; \
+            if (log_level_enabled(&_log_mod, LOG_MODULE, lvl)) \
+                _log_wc = logger_array_call(lg, lvl, x, __VA_ARGS__); \
+        } \
+        _log_wc; })
+
+#define logger_schema_at(lg, lvl, sch, ...) ({ \
+        int _log_wc = LOG_NO_ACTION; \
+        if ((lvl) >= LOG_LEVEL_MIN) { \
+            static struct log_module_t *_log_mod; \
+            if (log_level_enabled(&_log_mod, LOG_MODULE, lvl)) \
+                _log_wc = logger_schema_call(lg, lvl, sch, __VA_ARGS__); \
+        } \
+        _log_wc; })
+
+#define log_object_at(lvl, x, ...) logger_object_at(&log_default, lvl, x, __VA_ARGS__)
+
+#define logger_prepared_at(lg, lvl, root) ({ \
+        int _log_wc = LOG_NO_ACTION; \
+        if ((lvl) >= LOG_LEVEL_MIN) { \
+            static struct log_module_t *_log_mod; \
+            if (log_level_enabled(&_log_mod, LOG_MODULE, lvl)) \
+                _log_wc = reallogger_prepared(lg, lvl, root); \
+        } \
+        _log_wc; })
+
+#define logger_track_at(lg, lvl, t) ({ \
+        int _log_wc = LOG_NO_ACTION; \
+        if ((lvl) >= LOG_LEVEL_MIN) { \
+            static struct log_module_t *_log_mod; \
+            if (log_level_enabled(&_log_mod, LOG_MODULE, lvl)) \
+                _log_wc = reallogger_track(lg, lvl, t); \
+        } \
+        _log_wc; })
+
+#define log_schema_at(lvl, sch, ...) logger_schema_at(&log_default, lvl, sch, __VA_ARGS__)
+
+#define log_prepared_at(lvl, root) logger_prepared_at(&log_default, lvl, root)
+
+#define log_track_at(lvl, t) logger_track_at(&log_default, lvl, t)
+
+#define log_array_at(lvl, x, ...) logger_array_at(&log_default, lvl, x, __VA_ARGS__)
+
+#define log_debug(x, ...) log_object_at(LOG_LEVEL_DEBUG, x, __VA_ARGS__)
+
+#define log_info(x, ...) log_object_at(LOG_LEVEL_INFO, x, __VA_ARGS__)
+
+#define log_warn(x, ...) log_object_at(LOG_LEVEL_WARN, x, __VA_ARGS__)
+
+#define log_error(x, ...) log_object_at(LOG_LEVEL_ERROR, x, __VA_ARGS__)
+
+#define log_fatal(x, ...) log_object_at(LOG_LEVEL_FATAL, x, __VA_ARGS__)
+
+/**
+ * log_site_t is the sampling and rate limiting state of one call site.
+ * Each sampled or limited macro expansion owns a static one; it joins
+ * the log_sites list on first use so the suppressed summary can find it.
+ */
+struct log_site_t {
+    const char *file;
+    int line;
+    int registered;
+    uint64_t seen;
+    uint64_t suppressed;
+    uint64_t reported;
+    uint64_t tat;
+    struct log_site_t *next;
+};
+
+#define LOG_SITE_INIT { __FILE__, __LINE__, 0, 0, 0, 0, 0, NULL }
+
+static inline int
+log_site_sample(struct log_site_t *site, unsigned int n);
+
+static inline int
+log_site_limit(struct log_site_t *site, unsigned int rate, unsigned int burst);
+
+/**
+ * log_object_sampled/log_array_sampled write one in every n records
+ * reaching the call site. log_object_limited/log_array_limited let
+ * through at most rate records per second with bursts of up to burst.
+ * The check runs before any argument is evaluated and evaluates to
+ * LOG_NO_ACTION when the record is suppressed.
+ */
+#define log_object_sampled(n, x, ...) ({ \
+        static struct log_site_t _log_site = LOG_SITE_INIT; \
+        log_site_sample(&_log_site, n) ? log_object(x, __VA_ARGS__) : LOG_NO_ACTION; })
+
+#define log_array_sampled(n, x, ...) ({ \
+        static struct log_site_t _log_site = LOG_SITE_INIT; \
+        log_site_sample(&_log_site, n) ? log_array(x, __VA_ARGS__) : LOG_NO_ACTION; })
+
+#define log_object_limited(rate, burst, x, ...) ({ \
+        static struct log_site_t _log_site = LOG_SITE_INIT; \
+        log_site_limit(&_log_site, rate, burst) ? log_object(x, __VA_ARGS__) : LOG_NO_ACTION; })
+
+#define log_array_limited(rate, burst, x, ...) ({ \
+        static struct log_site_t _log_site = LOG_SITE_INIT; \
+        log_site_limit(&_log_site, rate, burst) ? log_array(x, __VA_ARGS__) : LOG_NO_ACTION; })
+/**
+ * log_sync_types selects when written records are made durable.
+ * LOG_SYNC_NONE leaves it to the kernel, LOG_SYNC_PERIODIC calls
+ * fdatasync once enough time or bytes have gone by and LOG_SYNC_GROUP
+ * syncs every batch before the callers in it are released.
+ */
+static enum {
+    LOG_SYNC_NONE,
+    LOG_SYNC_PERIODIC,
+    LOG_SYNC_GROUP
+} log_sync_types __attribute__((unused));
+
+/**
+ * log_sync_t is the durability policy and its bookkeeping. Only the
+ * thread currently doing output touches the counters.
+ */
+struct log_sync_t {
+    int mode;
+    uint64_t interval_ns;
+    size_t interval_bytes;
+    uint64_t last_sync_ns;
+    size_t unsynced;
+};
+
+#ifdef IOV_MAX
+#define LOG_IOV_MAX IOV_MAX
+#else
+#define LOG_IOV_MAX 1024
+#endif
+
+#ifdef __APPLE__
+#define LOG_FDATASYNC(fd) fsync(fd)
+#else
+#define LOG_FDATASYNC(fd) fdatasync(fd)
+#endif
+
+static uint64_t
+log_monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * LOG_HIST_BUCKETS is the number of power of two buckets in a
+ * log_hist_t. Bucket i counts durations in [2^(i-1), 2^i) ns.
+ */
+#define LOG_HIST_BUCKETS 48
+
+/**
+ * log_hist_t is a latency histogram in nanoseconds.
+ */
+struct log_hist_t {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LOG_HIST_BUCKETS];
+};
+
+/**
+ * log_stats_t is a snapshot of what the logger has done since the
+ * process started. records counts records handed to the output and
+ * dropped the ones lost to a full async ring or a failed
+ * serialization. lock_wait is time spent waiting for a logger's lock,
+ * queue_wait time spent waiting on the async ring or for another
+ * thread to flush a batch, serialize the time from entering a log call
+ * to having its text and flush the time to write and sync a batch.
+ */
+struct log_stats_t {
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t dropped;
+    uint64_t writes;
+    uint64_t syncs;
+    struct log_hist_t lock_wait;
+    struct log_hist_t queue_wait;
+    struct log_hist_t serialize;
+    struct log_hist_t flush;
+};
+
+/**
+ * log_stats_shard_t holds one thread's share of the counters. Only its
+ * owner writes it, so updates are plain relaxed loads and stores and
+ * log_stats sums the shards.
+ */
+struct log_stats_shard_t {
+    struct log_stats_t st;
+    uint64_t t0;
+    int in_use;
+    struct log_stats_shard_t *next;
+};
+
+static struct log_stats_shard_t *log_stats_shards = NULL;
+
+static __thread struct log_stats_shard_t *log_tls_stats;
+
+#ifdef THREAD_ENABLE
+static pthread_key_t log_stats_key;
+
+static pthread_once_t log_stats_once = PTHREAD_ONCE_INIT;
+
+/**
+ * log_stats_release hands an exiting thread's shard to the next thread
+ * that needs one. Its counts stay in the totals.
+ */
+static void
+log_stats_release(void *arg)
+{
+    struct log_stats_shard_t *s = (struct log_stats_shard_t *)arg;
+    log_tls_stats = NULL;
+    __atomic_store_n(&s->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void
+log_stats_key_init()
+{
+    pthread_key_create(&log_stats_key, log_stats_release);
+}
+#endif
+
+/**
+ * log_stats_shard_new finds a released shard or registers a new one.
+ */
+static struct log_stats_shard_t *
+log_stats_shard_new()
+{
+    struct log_stats_shard_t *s;
+
+    for (s = __atomic_load_n(&log_stats_shards, __ATOMIC_ACQUIRE); s != NULL; s = s->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&s->in_use, &expected, 1, 0,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (s == NULL) {
+        s = (struct log_stats_shard_t *)calloc(1, sizeof(struct log_stats_shard_t));
+        if (s == NULL)
+            return NULL;
+        s->in_use = 1;
+        s->next = __atomic_load_n(&log_stats_shards, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&log_stats_shards, &s->next, s, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+#ifdef THREAD_ENABLE
+    pthread_once(&log_stats_once, log_stats_key_init);
+    pthread_setspecific(log_stats_key, s);
+#endif
+    return s;
+}
+
+static inline struct log_stats_shard_t *
+log_stats_shard()
+{
+    if (__builtin_expect(log_tls_stats == NULL, 0))
+        log_tls_stats = log_stats_shard_new();
+    return log_tls_stats;
+}
+
+#define log_stat_load(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+#define log_stat_store(x, v) __atomic_store_n(&(x), v, __ATOMIC_RELAXED)
+
+#define log_stat_add(x, v) log_stat_store(x, log_stat_load(x) + (v))
+
+/**
+ * log_stats_count adds to one counter of the calling thread's shard.
+ */
+#define log_stats_count(field, v) do { \
+        struct log_stats_shard_t *_log_s = log_stats_shard(); \
+        if (_log_s != NULL) \
+            log_stat_add(_log_s->st.field, v); \
+    } while (0)
+
+static inline void
+log_hist_add(struct log_hist_t *h, uint64_t ns)
+{
+    int i = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (i >= LOG_HIST_BUCKETS)
+        i = LOG_HIST_BUCKETS - 1;
+    log_stat_add(h->count, 1);
+    log_stat_add(h->total_ns, ns);
+    log_stat_add(h->buckets[i], 1);
+    if (ns > log_stat_load(h->max_ns))
+        log_stat_store(h->max_ns, ns);
+}
+
+/**
+ * log_stats_time adds a duration to one histogram of the calling
+ * thread's shard.
+ */
+#define log_stats_time(field, ns) do { \
+        struct log_stats_shard_t *_log_s = log_stats_shard(); \
+        if (_log_s != NULL) \
+            log_hist_add(&_log_s->st.field, ns); \
+    } while (0)
+
+/**
+ * log_stats_begin marks the start of a log call for the serialize
+ * histogram.
+ */
+static inline void
+log_stats_begin()
+{
+    struct log_stats_shard_t *s = log_stats_shard();
+    if (s != NULL)
+        s->t0 = log_monotonic_ns();
+}
+
+static uint64_t log_stats_interval_ns = 0;
+
+static uint64_t log_stats_next_ns = 0;
+
+void
+log_stats_report();
+
+/**
+ * log_stats_end closes what log_stats_begin opened once the record's
+ * text is ready (ok) or could not be produced, and writes the periodic
+ * stats record when it is due.
+ */
+static inline void
+log_stats_end(int ok)
+{
+    struct log_stats_shard_t *s = log_stats_shard();
+    uint64_t now, next, interval;
+
+    if (s == NULL)
+        return;
+    if (!ok)
+        log_stat_add(s->st.dropped, 1);
+    if (s->t0 == 0)
+        return;
+    now = log_monotonic_ns();
+    log_hist_add(&s->st.serialize, now - s->t0);
+    s->t0 = 0;
+
+    if ((interval = __atomic_load_n(&log_stats_interval_ns, __ATOMIC_RELAXED)) == 0)
+        return;
+    next = __atomic_load_n(&log_stats_next_ns, __ATOMIC_RELAXED);
+    if (now >= next && __atomic_compare_exchange_n(&log_stats_next_ns, &next,
+            now + interval, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) && next != 0)
+        log_stats_report();
+}
+
+#ifdef THREAD_ENABLE
+/**
+ * log_stats_lock takes a mutex, timing the wait into lock_wait when it
+ * is contended.
+ */
+static void
+log_stats_lock(pthread_mutex_t *m)
+{
+    if (pthread_mutex_trylock(m) == 0)
+        return;
+    uint64_t t0 = log_monotonic_ns();
+    while(pthread_mutex_lock(m) != 0){ usleep(1); }
+    log_stats_time(lock_wait, log_monotonic_ns() - t0);
+}
+#endif
+
+static void
+log_hist_merge(struct log_hist_t *dst, const struct log_hist_t *src)
+{
+    dst->count += log_stat_load(src->count);
+    dst->total_ns += log_stat_load(src->total_ns);
+    if (log_stat_load(src->max_ns) > dst->max_ns)
+        dst->max_ns = log_stat_load(src->max_ns);
+    for (int i = 0; i < LOG_HIST_BUCKETS; i++)
+        dst->buckets[i] += log_stat_load(src->buckets[i]);
+}
+
+/**
+ * log_hist_percentile returns the upper bound of the bucket holding
+ * the p-th percentile (0-100) of h.
+ */
+uint64_t
+log_hist_percentile(const struct log_hist_t *h, double p)
+{
+    uint64_t rank = (uint64_t)(p / 100.0 * (double)h->count), seen = 0;
+
+    if (h->count == 0)
+        return 0;
+    if (rank >= h->count)
+        rank = h->count - 1;
+    for (int i = 0; i < LOG_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return i == 0 ? 0 : (i == LOG_HIST_BUCKETS - 1 ? h->max_ns : (1ULL << i) - 1);
+    }
+    return h->max_ns;
+}
+
+#ifdef THREAD_ENABLE
+/**
+ * log_batch_t gathers records from concurrent callers. The first
+ * caller that finds no output in progress becomes the leader, writes
+ * everything gathered so far with writev(), applies the durability
+ * policy once and releases the whole batch together. Callers keep
+ * their record alive until their batch is done.
+ */
+struct log_batch_t {
+    struct iovec *iov;
+    size_t count;
+    size_t cap;
+    struct iovec *spare;
+    size_t spare_cap;
+    uint64_t gen;
+    uint64_t done_gen;
+    int writing;
+    pthread_cond_t done;
+};
+
+/**
+ * log_async_policy_types selects what a producer does when the
+ * async ring is full.
+ */
+static enum {
+    LOG_ASYNC_BLOCK,
+    LOG_ASYNC_DROP_NEWEST,
+    LOG_ASYNC_DROP_OLDEST
+} log_async_policy_types __attribute__((unused));
+
+/**
+ * log_slot_t is one cell of the async ring. seq tells producers and
+ * the writer whose turn it is to touch the cell.
+ */
+struct log_slot_t {
+    size_t seq;
+    char *data;
+    size_t len;
+    struct log_shared_t *shared;
+};
+
+/**
+ * log_shared_t is one record fanned out to several sinks. Every ring
+ * holding it owns a reference; the last one to let go frees it.
+ */
+struct log_shared_t {
+    int refs;
+    char data[];
+};
+
+/**
+ * log_async_t holds the bounded multi-producer ring and the writer
+ * thread that drains it to the logger's output.
+ */
+struct log_async_t {
+    struct log_slot_t *slots;
+    size_t mask;
+    size_t enqueue_pos __attribute__((aligned(64)));
+    size_t dequeue_pos __attribute__((aligned(64)));
+    size_t durable __attribute__((aligned(64)));
+    int running __attribute__((aligned(64)));
+    int stop;
+    int policy;
+    int active;
+    int writer_idle;
+    int blocked;
+    int sync_waiters;
+    uint64_t dropped_newest;
+    uint64_t dropped_oldest;
+    uint64_t failed;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t synced;
+};
+
+struct log_async_stats_t {
+    uint64_t dropped_newest;
+    uint64_t dropped_oldest;
+    uint64_t failed;
+};
+#endif
+
+/**
+ * log_io_types selects how an async writer writes to a file.
+ * LOG_IO_WRITE uses writev(). LOG_IO_URING keeps several large buffers
+ * in flight through an io_uring and syncs through it as well; where
+ * io_uring is not available it falls back to LOG_IO_WRITE.
+ */
+static enum {
+    LOG_IO_WRITE,
+    LOG_IO_URING
+} log_io_types __attribute__((unused));
+
+#ifdef LOG_HAVE_URING
+/**
+ * LOG_URING_BUFS is the number of buffers of LOG_URING_BUF_SIZE bytes
+ * the writer copies records into and has in flight at once.
+ */
+#ifndef LOG_URING_BUFS
+#define LOG_URING_BUFS 4
+#endif
+
+#ifndef LOG_URING_BUF_SIZE
+#define LOG_URING_BUF_SIZE (1 << 20)
+#endif
+
+/**
+ * log_uring_t is the io_uring of an async writer. Buffers are written
+ * at explicit offsets through a descriptor of their own, so several can
+ * be in flight and still land in order. Only the writer thread uses
+ * it.
+ */
+struct log_uring_t {
+    int active;
+    int fd;
+    int wfd;
+    int fixed_files;
+    int fixed_bufs;
+    off_t offset;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    char *mem;
+    int cur;
+    int inflight;
+    int busy[LOG_URING_BUFS];
+    size_t used[LOG_URING_BUFS];
+    size_t records[LOG_URING_BUFS];
+    off_t off[LOG_URING_BUFS];
+    uint64_t failed;
+    unsigned int gen;
+};
+#endif
+
+/**
+ * log_seg_t is one segment file of a segmented logger, preallocated and
+ * mapped in full. Writers reserve room with a fetch-add on pos and add
+ * what they copied in to committed; the first reservation that no
+ * longer fits sets end, the length the segment is cut to when sealed.
+ */
+struct log_seg_t {
+    char *base;
+    size_t size;
+    size_t pos __attribute__((aligned(64)));
+    size_t committed __attribute__((aligned(64)));
+    size_t end;
+    unsigned int index;
+    int fd;
+    struct log_seg_t *next;
+};
+
+/**
+ * LOG_SEGMENT_SIZE is the size of a segment unless configured
+ * otherwise.
+ */
+#ifndef LOG_SEGMENT_SIZE
+#define LOG_SEGMENT_SIZE (256UL << 20)
+#endif
+
+/**
+ * LOG_RECORDER_SIZE is the ring size of a flight recorder unless
+ * configured otherwise, and LOG_RECORDERS how many recorders the
+ * signal handlers of log_recorder_signals can dump.
+ */
+#ifndef LOG_RECORDER_SIZE
+#define LOG_RECORDER_SIZE (16UL << 20)
+#endif
+
+#ifndef LOG_RECORDERS
+#define LOG_RECORDERS 8
+#endif
+
+#define LOG_REC_MAGIC   "LOGREC1"
+#define LOG_REC_VERSION 1
+#define LOG_REC_HEAD    4096
+
+/**
+ * log_rec_head_t starts the memory of a flight recorder. The ring of
+ * size bytes follows at data_off. Writers reserve room by moving head
+ * forward and copy their record to head modulo size, behind a
+ * log_rec_hdr_t and rounded up to 16 bytes. The layout is fixed so
+ * that logflight can find a recorder in a core file or a ring file.
+ */
+struct log_rec_head_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t data_off;
+    uint64_t size;
+    uint64_t key;
+    int64_t pid;
+    int64_t created;
+    uint64_t dropped;
+    uint64_t head __attribute__((aligned(64)));
+};
+
+/**
+ * log_rec_hdr_t precedes each record in the ring. tag is the position
+ * of the record XORed with the ring's key. It is stored last, so a
+ * record only counts once it is complete and only at the position it
+ * was written for.
+ */
+struct log_rec_hdr_t {
+    uint64_t tag;
+    uint32_t len;
+    uint32_t unused;
+};
+
+/**
+ * log_rec_t is an open flight recorder: its mapping and the file it is
+ * dumped to.
+ */
+struct log_rec_t {
+    struct log_rec_head_t *head;
+    char *data;
+    size_t map_size;
+    int fd;
+    char *dump_path;
+};
+
+#ifdef LOG_HAVE_SHM
+/**
+ * LOG_SHARED_SIZE is the size of the ring a shared logger creates
+ * unless configured otherwise, see log_init_shared. Records are cut
+ * into slots of LOG_SHM_SLOT bytes, and the collector writes them out
+ * LOG_SHM_OUT bytes at a time. A writer finding the ring full drops
+ * its record once the collector has freed nothing for LOG_SHM_WAIT_MS,
+ * and each process checks that often that the collector is still
+ * alive. The collector gives a writer that claimed a slot
+ * LOG_SHM_STALL_MS before it checks whether the writer is still alive.
+ */
+#ifndef LOG_SHARED_SIZE
+#define LOG_SHARED_SIZE (4UL << 20)
+#endif
+
+#ifndef LOG_SHM_WAIT_MS
+#define LOG_SHM_WAIT_MS 100
+#endif
+
+#ifndef LOG_SHM_STALL_MS
+#define LOG_SHM_STALL_MS 10
+#endif
+
+#define LOG_SHM_SLOT    512
+#define LOG_SHM_OUT     (64 * 1024)
+#define LOG_SHM_HOLES   64
+#define LOG_SHM_MAGIC   "LOGSHM1"
+#define LOG_SHM_VERSION 1
+#define LOG_SHM_HEAD    4096
+
+/**
+ * A slot's ctl word packs the position it is for (the low 40 bits),
+ * its state, one of log_shm_states, and the thread id of the writer
+ * that claimed it, so that claiming a slot and saying who claimed it
+ * is one compare and swap. Linux thread ids fit in 22 bits.
+ */
+#define LOG_SHM_POS_MASK ((1ULL << 40) - 1)
+#define LOG_SHM_TID_MASK ((1U << 22) - 1)
+#define LOG_SHM_CTL(pos, state, tid) (((uint64_t)(pos) << 24) | \
+    ((uint64_t)(state) << 22) | (uint64_t)(tid))
+#define LOG_SHM_CTL_POS(ctl)   ((ctl) >> 24)
+#define LOG_SHM_CTL_STATE(ctl) ((int)((ctl) >> 22) & 3)
+#define LOG_SHM_CTL_TID(ctl)   ((uint32_t)(ctl) & LOG_SHM_TID_MASK)
+
+static enum {
+    LOG_SHM_FREE,
+    LOG_SHM_CLAIMED,
+    LOG_SHM_READY
+} log_shm_states __attribute__((unused));
+
+static enum {
+    LOG_SHM_FIRST = 1,
+    LOG_SHM_LAST = 2
+} log_shm_flags __attribute__((unused));
+
+/**
+ * log_shm_head_t starts the shared memory of a shared logger. slots
+ * log_shm_slot_t follow at LOG_SHM_HEAD. Writers claim the slot at
+ * enqueue, the collector frees slots from dequeue on, and collector is
+ * the pid of the process writing the file, 0 if there is none.
+ */
+struct log_shm_head_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t ready;
+    uint64_t slots;
+    int32_t collector;
+    uint32_t unused;
+    uint64_t dropped;
+    uint64_t enqueue __attribute__((aligned(64)));
+    uint64_t dequeue __attribute__((aligned(64)));
+};
+
+/**
+ * log_shm_slot_t holds len bytes of a record. A record longer than a
+ * slot spans several, which other writers' slots may come between;
+ * flags mark its first and last one.
+ */
+struct log_shm_slot_t {
+    uint64_t ctl;
+    uint32_t len;
+    uint32_t flags;
+    char data[LOG_SHM_SLOT - 16];
+};
+
+/**
+ * log_shm_part_t is a record the collector has seen the first slots
+ * of, but not yet the last one.
+ */
+struct log_shm_part_t {
+    uint32_t tid;
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * log_shm_hole_t is a slot the collector went past while its writer,
+ * thread tid, was still at it, and since when.
+ */
+struct log_shm_hole_t {
+    uint64_t pos;
+    uint64_t since;
+    uint32_t tid;
+};
+
+/**
+ * log_shm_t is a process's mapping of a shared ring. check_at is when
+ * its writers next look whether the collector is still alive. If the
+ * process is the collector it also runs the collector thread, with its
+ * output buffer and the records it is putting back together.
+ */
+struct log_shm_t {
+    struct log_shm_head_t *head;
+    struct log_shm_slot_t *slots;
+    size_t map_size;
+    char *file_name;
+    int collecting;
+    int stop;
+    uint64_t check_at;
+    pthread_t collector;
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    struct log_shm_part_t *parts;
+    size_t nparts;
+    size_t parts_cap;
+};
+#endif
+
+/**
+ * LOG_BLOCK_SIZE is how many bytes of records a block of a block file
+ * holds unless configured otherwise, LOG_BLOCK_LEVEL the zlib level
+ * blocks are compressed at and LOG_BLOCK_MS how long a block may fill
+ * before it is written out anyway. That is checked whenever records are
+ * written, and by the async writer while it is idle. Without async mode
+ * nothing checks it in between, so a logger that goes quiet keeps its
+ * last block in memory until the next record, sync or close.
+ */
+#ifndef LOG_BLOCK_SIZE
+#define LOG_BLOCK_SIZE (1UL << 20)
+#endif
+
+#ifndef LOG_BLOCK_LEVEL
+#define LOG_BLOCK_LEVEL 1
+#endif
+
+#ifndef LOG_BLOCK_MS
+#define LOG_BLOCK_MS 1000
+#endif
+
+#define LOG_BLK_MAGIC "LOGBLK1"
+
+/**
+ * log_blk_codecs says how the payload of a block is stored: as the
+ * records themselves or as raw deflate data.
+ */
+static enum {
+    LOG_BLK_STORED,
+    LOG_BLK_DEFLATE
+} log_blk_codecs __attribute__((unused));
+
+/**
+ * log_blk_head_t starts every block of a block file. len bytes of
+ * payload follow, holding raw_len bytes of records, and check is their
+ * crc32, or 0 for none as when written without zlib. first and last
+ * are the lowest and highest timestamp of the records in nanoseconds
+ * since the epoch, first > last if none had one. Blocks are
+ * independent, so each can be found by walking the headers and
+ * inflated on its own.
+ */
+struct log_blk_head_t {
+    char magic[8];
+    uint32_t codec;
+    uint32_t len;
+    uint32_t raw_len;
+    uint32_t records;
+    uint32_t check;
+    uint32_t unused;
+    int64_t first;
+    int64_t last;
+};
+
+/**
+ * log_blk_idx_t is an entry of the index of a block file, file.idx:
+ * the offset of a block and a copy of its header, written once the
+ * block is in the file. Readers use it to go straight to the blocks
+ * of a time range.
+ */
+struct log_blk_idx_t {
+    uint64_t offset;
+    struct log_blk_head_t head;
+};
+
+/**
+ * log_blk_t is the block a logger writing a block file is filling.
+ * Only the one writer at a time touches it. started is when its first
+ * record came, offset where it goes in the file.
+ */
+struct log_blk_t {
+    char *raw;
+    size_t raw_len;
+    size_t raw_cap;
+    size_t size;
+    char *out;
+    size_t out_cap;
+    uint32_t records;
+    int64_t first;
+    int64_t last;
+    uint64_t started;
+    uint64_t offset;
+    int idx_fd;
+#ifdef HAVE_ZLIB
+    z_stream zs;
+#endif
+};
+
+#ifdef THREAD_ENABLE
+/**
+ * LOG_ROTATE_CHUNK is how much of a sealed file is compressed at a
+ * time, between looks at whether the logger is closing.
+ */
+#ifndef LOG_ROTATE_CHUNK
+#define LOG_ROTATE_CHUNK (64 * 1024)
+#endif
+
+/**
+ * log_rot_t is the rotation of a logger's file. Writers only count
+ * what they write into written and raise due when the file is full.
+ * The rotator thread renames the file, opens the next one and swaps
+ * it in; gen counts the swaps. The sealed files go to pending, for
+ * the cleaner thread to compress at a low priority before it deletes
+ * all but the keep most recent. pending is under lock. Binary writers
+ * held up by a rotation wait on resume.
+ */
+struct log_rot_t {
+    char *file_name;
+    size_t size;
+    unsigned int interval;
+    unsigned int keep;
+    size_t written;
+    int due;
+    time_t retry;
+    int stop;
+    unsigned int gen;
+    pthread_t rotator;
+    pthread_t cleaner;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t work;
+    pthread_cond_t resume;
+    char **pending;
+    size_t npending;
+    size_t pending_cap;
+};
+#endif
+
+/**
+ * logger_t is one log destination with everything needed to write to
+ * it: the file, its lock, write batch and async ring, and its
+ * serializer and durability settings. Loggers share nothing, so
+ * records going to different loggers never wait for each other. The
+ * logger of a sink points back to it through sink.
+ */
+struct logger_t {
+    FILE *output;
+    int out_type;
+    int serializer;
+    int io_backend;
+    struct log_sync_t sync;
+    int shard;
+    unsigned int shard_count;
+    int *shard_fds;
+    char *shard_base;
+    size_t seg_size;
+    char *seg_base;
+    struct log_seg_t *seg_cur;
+    struct log_seg_t *segs;
+    struct log_rec_t *rec;
+    struct log_shm_t *shm;
+    struct log_rot_t *rot;
+    struct log_blk_t *blk;
+    unsigned int bin_epoch;
+#ifdef THREAD_ENABLE
+    pthread_mutex_t lock;
+    struct log_batch_t batch;
+    struct log_async_t async;
+    struct log_sink_t *sinks;
+    int sinks_active;
+    struct log_sink_t *sink;
+    int bin_active;
+    int bin_hold;
+#endif
+#ifdef LOG_HAVE_URING
+    struct log_uring_t uring;
+#endif
+    struct logger_t *next;
+};
+
+#ifdef THREAD_ENABLE
+/**
+ * log_sink_t is an extra destination records are copied to. It is a
+ * logger of its own, always in async mode, so a slow or stalled
+ * destination only fills its own ring and never holds up the caller
+ * or the other sinks.
+ */
+struct log_sink_t {
+    struct logger_t out;
+    struct sockaddr_un addr;
+    int broken;
+    uint64_t retry_ns;
+    struct log_sink_t *next;
+};
+
+/**
+ * log_sink_cfg_t configures logger_add_sink. type is one of
+ * log_out_types and path the file or socket for LOG_OUT_FILE and the
+ * LOG_OUT_UNIX_ types. When the ring of capacity records (4096 if 0)
+ * is full, new records are dropped, or the oldest ones if drop_oldest
+ * is set.
+ */
+struct log_sink_cfg_t {
+    int type;
+    const char *path;
+    size_t capacity;
+    int drop_oldest;
+};
+
+/**
+ * LOG_SINK_TIMEOUT_MS bounds how long a socket sink waits on a stalled
+ * reader before giving up on a write, and LOG_SINK_RETRY_MS how often
+ * it tries to reconnect after its reader went away.
+ */
+#ifndef LOG_SINK_TIMEOUT_MS
+#define LOG_SINK_TIMEOUT_MS 1000
+#endif
+
+#ifndef LOG_SINK_RETRY_MS
+#define LOG_SINK_RETRY_MS 1000
+#endif
+#endif
+
+/**
+ * log_shard_types selects whether a logger writes one file or one
+ * shard file per thread or per CPU. Shards are named after the
+ * logger's file with the shard number appended, file.0, file.1 and
+ * so on, and are appended to with O_APPEND, so writers share no lock
+ * and no file offset. logmerge puts them back in timestamp order.
+ */
+static enum {
+    LOG_SHARD_NONE,
+    LOG_SHARD_THREAD,
+    LOG_SHARD_CPU
+} log_shard_types __attribute__((unused));
+
+/**
+ * LOG_SHARD_THREADS is the number of shards of a LOG_SHARD_THREAD
+ * logger unless configured otherwise. Threads beyond it share shards.
+ */
+#ifndef LOG_SHARD_THREADS
+#define LOG_SHARD_THREADS 64
+#endif
+
+/**
+ * logger_cfg_t configures logger_open. Zeroed fields select the
+ * defaults: DOM serializer, no syncing, synchronous writes, one file.
+ * shard_count of 0 means LOG_SHARD_THREADS shards per thread or one
+ * per configured CPU. A sharded logger writes directly from the
+ * calling thread and ignores async_capacity. io_backend, one of
+ * log_io_types, only applies to the async writer. A nonzero
+ * segment_size writes memory mapped segment files of that size instead
+ * of one file, see log_init_segments. A nonzero recorder_size makes the
+ * logger a flight recorder of that size, dumped to file_name and kept
+ * in recorder_path if set, see log_init_recorder. A nonzero
+ * shared_size makes the logger write through a ring of that size
+ * shared by every process logging to file_name, see log_init_shared.
+ * A nonzero rotate_size or rotate_interval rotates the one file by
+ * size or every that many seconds, keeping rotate_keep sealed files
+ * (all if 0), see log_init_rotating. A nonzero block_size writes the
+ * one file as compressed blocks of that size with an index next to
+ * it, see log_init_blocks.
+ */
+struct logger_cfg_t {
+    const char *file_name;
+    int serializer;
+    int durability;
+    unsigned int sync_interval_ms;
+    size_t sync_interval_bytes;
+    size_t async_capacity;
+    int async_policy;
+    int io_backend;
+    int shard;
+    unsigned int shard_count;
+    size_t segment_size;
+    size_t recorder_size;
+    const char *recorder_path;
+    size_t shared_size;
+    size_t rotate_size;
+    unsigned int rotate_interval;
+    unsigned int rotate_keep;
+    size_t block_size;
+};
+
+#ifdef THREAD_ENABLE
+#define LOGGER_INIT { \
+    .out_type = LOG_OUT_FILE, \
+    .serializer = LOG_SERIALIZE_DOM, \
+    .lock = PTHREAD_MUTEX_INITIALIZER, \
+    .batch = { .gen = 1, .done = PTHREAD_COND_INITIALIZER }, \
+    .async = { \
+        .lock = PTHREAD_MUTEX_INITIALIZER, \
+        .not_empty = PTHREAD_COND_INITIALIZER, \
+        .not_full = PTHREAD_COND_INITIALIZER, \
+        .synced = PTHREAD_COND_INITIALIZER \
+    } \
+}
+#else
+#define LOGGER_INIT { .out_type = LOG_OUT_FILE, .serializer = LOG_SERIALIZE_DOM }
+#endif
+
+/**
+ * log_default is the logger behind log_init, log_object and the other
+ * functions that take no logger.
+ */
+static struct logger_t log_default = LOGGER_INIT;
+
+/**
+ * log_loggers lists the loggers opened with logger_open so a fatal
+ * record can flush all of them.
+ */
+static struct logger_t *log_loggers = NULL;
+
+#ifdef THREAD_ENABLE
+static pthread_mutex_t lock_loggers = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * logger_set_durability selects one of log_sync_types for lg. For
+ * LOG_SYNC_PERIODIC, interval_ms and interval_bytes bound how much
+ * written data may sit unsynced; 0 disables that bound.
+ */
+void
+logger_set_durability(struct logger_t *lg, int mode, unsigned int interval_ms,
+    size_t interval_bytes)
+{
+    lg->sync.mode = mode;
+    lg->sync.interval_ns = (uint64_t)interval_ms * 1000000ULL;
+    lg->sync.interval_bytes = interval_bytes;
+}
+
+void
+log_set_durability(int mode, unsigned int interval_ms, size_t interval_bytes)
+{
+    logger_set_durability(&log_default, mode, interval_ms, interval_bytes);
+}
+
+/**
+ * log_sync_due accounts for bytes just written and tells whether the
+ * durability policy st asks for a sync now.
+ */
+static int
+log_sync_due(struct log_sync_t *st, size_t bytes)
+{
+    int sync = 0;
+
+    st->unsynced += bytes;
+    if (st->unsynced == 0)
+        return 0;
+    switch (st->mode) {
+        case LOG_SYNC_GROUP:
+            sync = 1;
+            break;
+        case LOG_SYNC_PERIODIC: {
+            uint64_t now = log_monotonic_ns();
+            if (st->last_sync_ns == 0)
+                st->last_sync_ns = now;
+            sync = (st->interval_bytes && st->unsynced >= st->interval_bytes) ||
+                (st->interval_ns && now - st->last_sync_ns >= st->interval_ns);
+            break;
+        }
+        default:
+            break;
+    }
+    return sync;
+}
+
+static void
+log_sync_done(struct log_sync_t *st)
+{
+    log_stats_count(syncs, 1);
+    st->unsynced = 0;
+    st->last_sync_ns = log_monotonic_ns();
+}
+
+/**
+ * log_sync_commit accounts for bytes just written to fd and syncs it
+ * if the durability policy st asks for it.
+ */
+static void
+log_sync_commit(struct log_sync_t *st, int fd, size_t bytes)
+{
+    if (log_sync_due(st, bytes) && fd >= 0) {
+        LOG_FDATASYNC(fd);
+        log_sync_done(st);
+    }
+}
+
+/**
+ * log_bin_epochs numbers the binary key dictionaries of all loggers.
+ * log_bin_restart starts a new one for lg, so that the next frame of
+ * every thread defines its keys again: for a new file, or once frames
+ * that may have defined keys were lost on their way to the file.
+ */
+static unsigned int log_bin_epochs;
+
+static inline void
+log_bin_restart(struct logger_t *lg)
+{
+    __atomic_store_n(&lg->bin_epoch, __atomic_add_fetch(&log_bin_epochs, 1, __ATOMIC_RELAXED),
+        __ATOMIC_RELAXED);
+}
+
+/**
+ * log_bin_enter/log_bin_leave bracket a binary frame of a rotating
+ * logger, from taking its dictionary until it is handed over. While
+ * bin_hold is set, new frames wait, so a rotation can let the frames
+ * built for the old file reach it before swapping files.
+ */
+static inline void
+log_bin_enter(struct logger_t *lg)
+{
+#ifdef THREAD_ENABLE
+    if (lg->rot == NULL)
+        return;
+    for (;;) {
+        __atomic_add_fetch(&lg->bin_active, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&lg->bin_hold, __ATOMIC_SEQ_CST))
+            return;
+        __atomic_sub_fetch(&lg->bin_active, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_lock(&lg->rot->lock);
+        while (__atomic_load_n(&lg->bin_hold, __ATOMIC_SEQ_CST))
+            pthread_cond_wait(&lg->rot->resume, &lg->rot->lock);
+        pthread_mutex_unlock(&lg->rot->lock);
+    }
+#else
+    (void)lg;
+#endif
+}
+
+static inline void
+log_bin_leave(struct logger_t *lg)
+{
+#ifdef THREAD_ENABLE
+    if (lg->rot != NULL)
+        __atomic_sub_fetch(&lg->bin_active, 1, __ATOMIC_SEQ_CST);
+#else
+    (void)lg;
+#endif
+}
+
+/**
+ * log_writev_all writes cnt buffers to fd, retrying on short writes
+ * and EINTR. iov is consumed. Returns the number of bytes written or
+ * -1 on error.
+ */
+static ssize_t
+log_writev_all(int fd, struct iovec *iov, int cnt)
+{
+    ssize_t total = 0;
+
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt > LOG_IOV_MAX ? LOG_IOV_MAX : cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("unable to write log records");
+            return -1;
+        }
+        log_stats_count(writes, 1);
+        log_stats_count(bytes, (uint64_t)n);
+        total += n;
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return total;
+}
+
+/**
+ * log_blk_days returns the number of days from the epoch to the date
+ * y-m-d of the proleptic Gregorian calendar.
+ */
+static int64_t
+log_blk_days(int64_t y, int m, int d)
+{
+    int64_t era, yoe, doy;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+static int
+log_blk_digits(const char *p, const char *end, int n)
+{
+    int v = 0;
+
+    if (end - p < n)
+        return -1;
+    for (int i = 0; i < n; i++) {
+        if (p[i] < '0' || p[i] > '9')
+            return -1;
+        v = v * 10 + (p[i] - '0');
+    }
+    return v;
+}
+
+/**
+ * log_blk_ts_value reads a timestamp value from p, either an RFC 3339
+ * time, quoted or not, or an integer. An integer is taken to be in
+ * whichever of seconds, milliseconds, microseconds and nanoseconds
+ * puts it after 1973, so its unit needs not be known. Sets *ns to
+ * nanoseconds since the epoch and returns 0, or -1 if p holds neither.
+ */
+static int
+log_blk_ts_value(const char *p, const char *end, int64_t *ns)
+{
+    int y, mo, d, h, mi, s;
+    int64_t v = 0, frac = 0, scale = 100000000;
+
+    if (p < end && *p == '"')
+        p++;
+    if (end - p >= 19 && p[4] == '-' && p[10] == 'T') {
+        if ((y = log_blk_digits(p, end, 4)) < 0 || (mo = log_blk_digits(p + 5, end, 2)) < 1 ||
+                (d = log_blk_digits(p + 8, end, 2)) < 1 || (h = log_blk_digits(p + 11, end, 2)) < 0 ||
+                (mi = log_blk_digits(p + 14, end, 2)) < 0 || (s = log_blk_digits(p + 17, end, 2)) < 0)
+            return -1;
+        v = ((log_blk_days(y, mo, d) * 24 + h) * 60 + mi) * 60 + s;
+        p += 19;
+        if (p < end && *p == '.')
+            for (p++; p < end && *p >= '0' && *p <= '9'; p++, scale /= 10)
+                frac += (*p - '0') * scale;
+        if (end - p >= 6 && (*p == '+' || *p == '-') && (h = log_blk_digits(p + 1, end, 2)) >= 0 &&
+                (mi = log_blk_digits(p + 4, end, 2)) >= 0)
+            v -= (*p == '+' ? 1 : -1) * (h * 3600 + mi * 60);
+        *ns = v * 1000000000LL + frac;
+        return 0;
+    }
+    if (p == end || *p < '0' || *p > '9')
+        return -1;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (v > (INT64_MAX - 9) / 10)
+            return -1;
+        v = v * 10 + (*p - '0');
+    }
+    if (v < 100000000000LL)
+        *ns = v * 1000000000LL;
+    else if (v < 100000000000000LL)
+        *ns = v * 1000000LL;
+    else if (v < 100000000000000000LL)
+        *ns = v * 1000LL;
+    else
+        *ns = v;
+    return 0;
+}
+
+/**
+ * log_blk_stamp reads the timestamp of the record of len bytes at rec
+ * into *ns. Returns 0, or -1 if the record has none.
+ */
+static int
+log_blk_stamp(const char *rec, size_t len, int64_t *ns)
+{
+    static const char key[] = "\"timestamp\"";
+    const char *p = rec, *end = rec + len;
+
+    if (len == 0 || rec[0] != '{')
+        return -1;
+    if (len > sizeof(key) && memcmp(rec + 1, key, sizeof(key) - 1) == 0)
+        p = rec + sizeof(key);
+    else if ((p = (const char *)memmem(rec, len, key, sizeof(key) - 1)) != NULL)
+        p += sizeof(key) - 1;
+    else
+        return -1;
+    while (p < end && (*p == ' ' || *p == ':'))
+        p++;
+    return log_blk_ts_value(p, end, ns);
+}
+
+/**
+ * log_blk_valid checks that h looks like the header of a block.
+ */
+static inline int
+log_blk_valid(const struct log_blk_head_t *h)
+{
+    return memcmp(h->magic, LOG_BLK_MAGIC, sizeof(h->magic)) == 0 && h->raw_len > 0 &&
+        ((h->codec == LOG_BLK_STORED && h->len == h->raw_len) ||
+         (h->codec == LOG_BLK_DEFLATE && h->len > 0));
+}
+
+/**
+ * log_blk_find finds the first block of the file fd, end bytes long, at
+ * or after off and reads its header into h. A block counts if it ends
+ * where the file does or another block starts, so bytes that are not
+ * one, such as what is left of a block a crash cut short, are skipped.
+ * Returns its offset, or end if there is none.
+ */
+static uint64_t
+log_blk_find(int fd, uint64_t off, uint64_t end, struct log_blk_head_t *h)
+{
+    char buf[4096], *p;
+    ssize_t n;
+
+    while (off + sizeof(*h) <= end &&
+            (n = pread(fd, buf, sizeof(buf), (off_t)off)) >= (ssize_t)sizeof(*h)) {
+        if ((p = (char *)memmem(buf, (size_t)n, LOG_BLK_MAGIC, sizeof(h->magic))) == NULL) {
+            off += (uint64_t)n - sizeof(h->magic) + 1;
+            continue;
+        }
+        off += (uint64_t)(p - buf);
+        if (pread(fd, h, sizeof(*h), (off_t)off) == (ssize_t)sizeof(*h) && log_blk_valid(h)) {
+            uint64_t after = off + sizeof(*h) + h->len;
+            size_t m = end - after < sizeof(h->magic) ? (size_t)(end - after) : sizeof(h->magic);
+            if (after <= end && (m == 0 || (pread(fd, buf, m, (off_t)after) == (ssize_t)m &&
+                    memcmp(buf, LOG_BLK_MAGIC, m) == 0)))
+                return off;
+        }
+        off++;
+    }
+    return end;
+}
+
+/**
+ * log_blk_seal compresses the block bk has filled, writes it to fd and
+ * adds it to the index. The block is emptied either way. Returns 0, or
+ * -1 if it could not be written.
+ */
+static int
+log_blk_seal(struct log_blk_t *bk, int fd)
+{
+    struct log_blk_idx_t e;
+    struct iovec iov[2];
+    ssize_t n;
+
+    if (bk->raw_len == 0)
+        return 0;
+    memset(&e, 0, sizeof(e));
+    memcpy(e.head.magic, LOG_BLK_MAGIC, sizeof(e.head.magic));
+    e.head.codec = LOG_BLK_STORED;
+    e.head.len = e.head.raw_len = (uint32_t)bk->raw_len;
+    e.head.records = bk->records;
+    e.head.first = bk->first;
+    e.head.last = bk->last;
+    iov[1].iov_base = bk->raw;
+#ifdef HAVE_ZLIB
+    e.head.check = (uint32_t)crc32(0, (const Bytef *)bk->raw, (uInt)bk->raw_len);
+    bk->zs.next_in = (Bytef *)bk->raw;
+    bk->zs.avail_in = (uInt)bk->raw_len;
+    bk->zs.next_out = (Bytef *)bk->out;
+    bk->zs.avail_out = (uInt)bk->out_cap;
+    if (deflate(&bk->zs, Z_FINISH) == Z_STREAM_END && bk->zs.total_out < bk->raw_len) {
+        e.head.codec = LOG_BLK_DEFLATE;
+        e.head.len = (uint32_t)bk->zs.total_out;
+        iov[1].iov_base = bk->out;
+    }
+    deflateReset(&bk->zs);
+#endif
+    iov[0].iov_base = &e.head;
+    iov[0].iov_len = sizeof(e.head);
+    iov[1].iov_len = e.head.len;
+    e.offset = bk->offset;
+    bk->raw_len = 0;
+    bk->records = 0;
+    bk->first = INT64_MAX;
+    bk->last = INT64_MIN;
+
+    if ((n = log_writev_all(fd, iov, 2)) < 0) {
+        /* whatever made it is skipped by readers, the next block goes after it */
+        off_t end = lseek(fd, 0, SEEK_END);
+        if (end >= 0)
+            bk->offset = (uint64_t)end;
+        return -1;
+    }
+    bk->offset += (uint64_t)n;
+    if (bk->idx_fd >= 0 && write(bk->idx_fd, &e, sizeof(e)) != (ssize_t)sizeof(e)) {
+        perror("unable to write log block index");
+        close(bk->idx_fd);
+        bk->idx_fd = -1;
+    }
+    return 0;
+}
+
+/**
+ * log_blk_add appends the record of len bytes at data to bk's block,
+ * writing the block to fd first if the record does not fit and after
+ * if the block is full. A record larger than a block gets one of its
+ * own. Returns 0, or -1 if a block could not be written.
+ */
+static int
+log_blk_add(struct log_blk_t *bk, int fd, const char *data, size_t len)
+{
+    int64_t ns;
+    int st = 0;
+
+    if (bk->raw_len > 0 && bk->raw_len + len > bk->size)
+        st = log_blk_seal(bk, fd);
+    if (len > bk->raw_cap) {
+        char *raw = (char *)realloc(bk->raw, len);
+        if (raw == NULL) {
+            perror("unable to allocation memory for log block");
+            return -1;
+        }
+        bk->raw = raw;
+        bk->raw_cap = len;
+#ifdef HAVE_ZLIB
+        size_t bound = deflateBound(&bk->zs, (uLong)len);
+        char *out = (char *)realloc(bk->out, bound);
+        if (out == NULL) {
+            perror("unable to allocation memory for log block");
+            return -1;
+        }
+        bk->out = out;
+        bk->out_cap = bound;
+#endif
+    }
+    if (bk->raw_len == 0)
+        bk->started = log_monotonic_ns();
+    memcpy(bk->raw + bk->raw_len, data, len);
+    bk->raw_len += len;
+    bk->records++;
+    if (log_blk_stamp(data, len, &ns) == 0) {
+        if (ns < bk->first)
+            bk->first = ns;
+        if (ns > bk->last)
+            bk->last = ns;
+    }
+    if (bk->raw_len >= bk->size && log_blk_seal(bk, fd) != 0)
+        st = -1;
+    return st;
+}
+
+/**
+ * log_blk_aged tells whether bk's block has been filling for
+ * LOG_BLOCK_MS and should be written out as it is.
+ */
+static inline int
+log_blk_aged(const struct log_blk_t *bk)
+{
+    return bk->raw_len && log_monotonic_ns() - bk->started >= LOG_BLOCK_MS * 1000000ULL;
+}
+
+/**
+ * log_blk_recover gets bk ready to append to the block file fd. Blocks
+ * the index is missing, because the process died between writing a
+ * block and indexing it, are indexed again. A block left half written
+ * stays where it is: readers skip it and appending starts after it.
+ * Returns 0, or -1 if fd holds something other than blocks.
+ */
+static int
+log_blk_recover(struct log_blk_t *bk, int fd)
+{
+    struct log_blk_idx_t e;
+    struct stat st, ist;
+    uint64_t off = 0;
+    off_t n;
+
+    if (fstat(fd, &st) != 0 || fstat(bk->idx_fd, &ist) != 0)
+        return -1;
+    if (st.st_size > 0 && (pread(fd, &e.head, sizeof(e.head), 0) != (ssize_t)sizeof(e.head) ||
+            memcmp(e.head.magic, LOG_BLK_MAGIC, sizeof(e.head.magic)) != 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (n = ist.st_size / (off_t)sizeof(e); n > 0; n--) {
+        if (pread(bk->idx_fd, &e, sizeof(e), (n - 1) * (off_t)sizeof(e)) == (ssize_t)sizeof(e) &&
+                log_blk_valid(&e.head) &&
+                e.offset + sizeof(e.head) + e.head.len <= (uint64_t)st.st_size) {
+            off = e.offset + sizeof(e.head) + e.head.len;
+            break;
+        }
+    }
+    if (ftruncate(bk->idx_fd, n * (off_t)sizeof(e)) != 0)
+        return -1;
+    while ((off = log_blk_find(fd, off, (uint64_t)st.st_size, &e.head)) < (uint64_t)st.st_size) {
+        e.offset = off;
+        if (write(bk->idx_fd, &e, sizeof(e)) != (ssize_t)sizeof(e))
+            return -1;
+        off += sizeof(e.head) + e.head.len;
+    }
+    bk->offset = (uint64_t)st.st_size;
+    return 0;
+}
+
+static void
+log_blk_free(struct log_blk_t *bk)
+{
+    if (bk->idx_fd >= 0)
+        close(bk->idx_fd);
+#ifdef HAVE_ZLIB
+    deflateEnd(&bk->zs);
+#endif
+    free(bk->raw);
+    free(bk->out);
+    free(bk);
+}
+
+/**
+ * log_blk_open opens file_name, fd already being open on it for
+ * reading and appending, and its index to be written in blocks of
+ * size bytes. Returns NULL on failure.
+ */
+static struct log_blk_t *
+log_blk_open(const char *file_name, int fd, size_t size)
+{
+    struct log_blk_t *bk = (struct log_blk_t *)calloc(1, sizeof(struct log_blk_t));
+    char *idx_name = (char *)malloc(strlen(file_name) + sizeof(".idx"));
+
+    if (bk == NULL || idx_name == NULL || (bk->raw = (char *)malloc(size)) == NULL) {
+        perror("unable to allocation memory for log blocks");
+        free(idx_name);
+        if (bk != NULL)
+            free(bk->raw);
+        free(bk);
+        return NULL;
+    }
+    bk->size = bk->raw_cap = size;
+    bk->first = INT64_MAX;
+    bk->last = INT64_MIN;
+    sprintf(idx_name, "%s.idx", file_name);
+    bk->idx_fd = open(idx_name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (bk->idx_fd < 0)
+        perror(idx_name);
+#ifdef HAVE_ZLIB
+    if (deflateInit2(&bk->zs, LOG_BLOCK_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "unable to set up compression for %s\n", file_name);
+        close(bk->idx_fd);
+        free(bk->raw);
+        free(bk);
+        free(idx_name);
+        return NULL;
+    }
+    bk->out_cap = deflateBound(&bk->zs, (uLong)size);
+    if ((bk->out = (char *)malloc(bk->out_cap)) == NULL) {
+        perror("unable to allocation memory for log blocks");
+        log_blk_free(bk);
+        free(idx_name);
+        return NULL;
+    }
+#endif
+    if (bk->idx_fd < 0 || log_blk_recover(bk, fd) != 0) {
+        if (errno == EINVAL)
+            fprintf(stderr, "%s: not a log block file\n", file_name);
+        else
+            perror(idx_name);
+        log_blk_free(bk);
+        free(idx_name);
+        return NULL;
+    }
+    free(idx_name);
+    return bk;
+}
+
+/**
+ * log_out_writev writes cnt records to lg's file fd, into its current
+ * block if it writes a block file. Returns the number of bytes taken
+ * or -1 on error.
+ */
+static ssize_t
+log_out_writev(struct logger_t *lg, int fd, struct iovec *iov, int cnt)
+{
+    ssize_t total = 0;
+    int st = 0;
+
+    if (lg->blk == NULL)
+        return log_writev_all(fd, iov, cnt);
+    for (int i = 0; i < cnt; i++) {
+        if (log_blk_add(lg->blk, fd, (const char *)iov[i].iov_base, iov[i].iov_len) != 0)
+            st = -1;
+        total += (ssize_t)iov[i].iov_len;
+    }
+    return st ? -1 : total;
+}
+
+/**
+ * log_out_commit is log_sync_commit for records written with
+ * log_out_writev: a block file gets its current block written out
+ * before it is synced, or once the block is LOG_BLOCK_MS old.
+ */
+static void
+log_out_commit(struct logger_t *lg, int fd, size_t bytes)
+{
+    int due;
+
+    if (lg->blk == NULL) {
+        log_sync_commit(&lg->sync, fd, bytes);
+        return;
+    }
+    due = log_sync_due(&lg->sync, bytes);
+    if (fd < 0)
+        return;
+    if (due || log_blk_aged(lg->blk))
+        log_blk_seal(lg->blk, fd);
+    if (due) {
+        LOG_FDATASYNC(fd);
+        log_sync_done(&lg->sync);
+    }
+}
+
+#ifdef THREAD_ENABLE
+/**
+ * log_io_acquire waits until nobody else is writing to lg and makes
+ * the caller the only one doing output. Returns the fd to write to, -1
+ * if lg is closed. lg->lock must not be held.
+ */
+static int
+log_io_acquire(struct logger_t *lg)
+{
+    int fd;
+
+    log_stats_lock(&lg->lock);
+    if (lg->batch.writing) {
+        uint64_t t0 = log_monotonic_ns();
+        while (lg->batch.writing)
+            pthread_cond_wait(&lg->batch.done, &lg->lock);
+        log_stats_time(lock_wait, log_monotonic_ns() - t0);
+    }
+    lg->batch.writing = 1;
+    fd = lg->output ? fileno(lg->output) : -1;
+    pthread_mutex_unlock(&lg->lock);
+    return fd;
+}
+
+static void
+log_io_release(struct logger_t *lg)
+{
+    while(pthread_mutex_lock(&lg->lock) != 0){ usleep(1); }
+    lg->batch.writing = 0;
+    pthread_cond_broadcast(&lg->batch.done);
+    pthread_mutex_unlock(&lg->lock);
+}
+
+/**
+ * log_rot_written accounts for bytes just written to lg's file and
+ * wakes the rotation thread once the file is full. Only the caller
+ * may be writing.
+ */
+static inline void
+log_rot_written(struct logger_t *lg, size_t bytes)
+{
+    struct log_rot_t *rot = lg->rot;
+    size_t written;
+
+    if (rot == NULL)
+        return;
+    written = __atomic_load_n(&rot->written, __ATOMIC_RELAXED) + bytes;
+    __atomic_store_n(&rot->written, written, __ATOMIC_RELAXED);
+    if (rot->size && written >= rot->size && !__atomic_load_n(&rot->due, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&rot->due, 1, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&rot->lock);
+        pthread_cond_signal(&rot->wake);
+        pthread_mutex_unlock(&rot->lock);
+    }
+}
+
+/**
+ * log_batch_flush_locked writes lg's pending batch as its leader.
+ * lg->lock must be held and nobody else may be writing; the lock is
+ * dropped while the batch is on its way to disk.
+ */
+static void
+log_batch_flush_locked(struct logger_t *lg)
+{
+    struct log_batch_t *bt = &lg->batch;
+    struct iovec *iov = bt->iov;
+    size_t n = bt->count, cap = bt->cap, bytes = 0;
+    uint64_t gen = bt->gen;
+    int fd = lg->output ? fileno(lg->output) : -1;
+
+    bt->iov = bt->spare;
+    bt->cap = bt->spare_cap;
+    bt->spare = iov;
+    bt->spare_cap = cap;
+    bt->count = 0;
+    bt->gen++;
+    bt->writing = 1;
+    pthread_mutex_unlock(&lg->lock);
+
+    for (size_t i = 0; i < n; i++)
+        bytes += iov[i].iov_len;
+    if (fd >= 0 && n > 0) {
+        uint64_t t0 = log_monotonic_ns();
+        if (log_out_writev(lg, fd, iov, (int)n) >= 0) {
+            log_out_commit(lg, fd, bytes);
+            log_rot_written(lg, bytes);
+        } else {
+            log_bin_restart(lg);
+        }
+        log_stats_time(flush, log_monotonic_ns() - t0);
+    }
+
+    while(pthread_mutex_lock(&lg->lock) != 0){ usleep(1); }
+    bt->writing = 0;
+    bt->done_gen = gen;
+    pthread_cond_broadcast(&bt->done);
+}
+
+/**
+ * log_batch_write adds a record to lg's current batch and returns once
+ * that batch has been written.
+ */
+static int
+log_batch_write(struct logger_t *lg, char *str, size_t len)
+{
+    struct log_batch_t *bt = &lg->batch;
+    uint64_t gen, t0 = 0;
+
+    log_stats_lock(&lg->lock);
+    if (!lg->output) {
+        pthread_mutex_unlock(&lg->lock);
+        return LOG_NO_ACTION;
+    }
+    if (bt->count == bt->cap) {
+        size_t cap = bt->cap ? bt->cap * 2 : 64;
+        struct iovec *iov = (struct iovec *)realloc(bt->iov, cap * sizeof(struct iovec));
+        if (iov == NULL) {
+            perror("unable to allocation memory for write batch");
+            pthread_mutex_unlock(&lg->lock);
+            return LOG_NO_ACTION;
+        }
+        bt->iov = iov;
+        bt->cap = cap;
+    }
+    bt->iov[bt->count].iov_base = str;
+    bt->iov[bt->count].iov_len = len;
+    bt->count++;
+
+    gen = bt->gen;
+    while (bt->done_gen < gen) {
+        if (!bt->writing) {
+            log_batch_flush_locked(lg);
+        } else {
+            if (t0 == 0)
+                t0 = log_monotonic_ns();
+            pthread_cond_wait(&bt->done, &lg->lock);
+        }
+    }
+    pthread_mutex_unlock(&lg->lock);
+    if (t0)
+        log_stats_time(queue_wait, log_monotonic_ns() - t0);
+    return (int)len;
+}
+
+/**
+ * log_ring_push appends a record to the ring. Returns the record's
+ * ticket (its position plus one), or 0 when the ring is full.
+ */
+static size_t
+log_ring_push(struct log_async_t *q, char *data, size_t len,
+    struct log_shared_t *shared)
+{
+    size_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    struct log_slot_t *slot;
+
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    slot->data = data;
+    slot->len = len;
+    slot->shared = shared;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return pos + 1;
+}
+
+/**
+ * log_ring_pop takes the oldest record off the ring. Returns 0 when
+ * the ring is empty. Producers call it too for LOG_ASYNC_DROP_OLDEST.
+ */
+static int
+log_ring_pop(struct log_async_t *q, char **data, size_t *len,
+    struct log_shared_t **shared)
+{
+    size_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    struct log_slot_t *slot;
+
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    *data = slot->data;
+    *len = slot->len;
+    *shared = slot->shared;
+    __atomic_store_n(&slot->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * log_record_free releases a record taken off a ring: data itself, or
+ * one reference to shared if the record is fanned out.
+ */
+static void
+log_record_free(char *data, struct log_shared_t *shared)
+{
+    if (shared == NULL)
+        free(data);
+    else if (__atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(shared);
+}
+
+/**
+ * log_sink_connect opens a socket of the sink's type and connects it
+ * to the sink's path. Returns the socket or -1.
+ */
+static int
+log_sink_connect(struct log_sink_t *s)
+{
+    int type = s->out.out_type == LOG_OUT_UNIX_DGRAM ? SOCK_DGRAM : SOCK_STREAM;
+    struct timeval tv = { LOG_SINK_TIMEOUT_MS / 1000, (LOG_SINK_TIMEOUT_MS % 1000) * 1000 };
+    int fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *)&s->addr, sizeof(s->addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * log_sink_send writes cnt records to the socket sink s, one datagram
+ * each for LOG_OUT_UNIX_DGRAM. A sink whose reader went away is
+ * reconnected at most every LOG_SINK_RETRY_MS; until then its records
+ * are lost. Returns the number of records not sent.
+ */
+static size_t
+log_sink_send(struct log_sink_t *s, int fd, struct iovec *iov, int cnt)
+{
+    struct msghdr msg;
+    size_t failed = 0;
+
+    if (s->broken) {
+        uint64_t now = log_monotonic_ns();
+        int sock;
+        if (now < s->retry_ns)
+            return (size_t)cnt;
+        s->retry_ns = now + (uint64_t)LOG_SINK_RETRY_MS * 1000000ULL;
+        if ((sock = log_sink_connect(s)) < 0)
+            return (size_t)cnt;
+        dup2(sock, fd);
+        close(sock);
+        s->broken = 0;
+    }
+
+    if (s->out.out_type == LOG_OUT_UNIX_DGRAM) {
+        for (int i = 0; i < cnt; i++) {
+            ssize_t n;
+            while ((n = send(fd, iov[i].iov_base, iov[i].iov_len, MSG_NOSIGNAL)) < 0 &&
+                    errno == EINTR)
+                ;
+            if (n < 0 && (errno == EMSGSIZE || errno == ENOBUFS)) {
+                failed++;
+                continue;
+            }
+            if (n < 0) {
+                /* a reader that timed out once won't take the rest either */
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    s->broken = 1;
+                return failed + (size_t)(cnt - i);
+            }
+            log_stats_count(writes, 1);
+            log_stats_count(bytes, (uint64_t)n);
+        }
+        return failed;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    while (cnt > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt > LOG_IOV_MAX ? LOG_IOV_MAX : cnt;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            /* a partly sent record leaves the stream out of step */
+            s->broken = 1;
+            return (size_t)cnt;
+        }
+        log_stats_count(writes, 1);
+        log_stats_count(bytes, (uint64_t)n);
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+#ifdef LOG_HAVE_URING
+/**
+ * LOG_URING_SYNC tags the completion of a sync in a log_uring_t.
+ */
+#define LOG_URING_SYNC ((uint64_t)-1)
+
+/**
+ * log_pwrite_all writes len bytes of buf to fd at off, retrying on
+ * short writes and EINTR. Returns 0, or -1 on error.
+ */
+static int
+log_pwrite_all(int fd, const char *buf, size_t len, off_t off)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("unable to write log records");
+            return -1;
+        }
+        log_stats_count(writes, 1);
+        log_stats_count(bytes, (uint64_t)n);
+        buf += n;
+        len -= (size_t)n;
+        off += n;
+    }
+    return 0;
+}
+
+static int
+log_uring_enter(struct log_uring_t *u, unsigned int submit, unsigned int wait)
+{
+    long rc;
+
+    while ((rc = syscall(__NR_io_uring_enter, u->fd, submit, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0 && errno == EINTR)
+        ;
+    return (int)rc;
+}
+
+/**
+ * log_uring_reap waits for at least wait completions of u and handles
+ * all that are there. A short write is finished with pwrite(); the
+ * records of a failed one are counted in u->failed.
+ */
+static void
+log_uring_reap(struct log_uring_t *u, unsigned int wait)
+{
+    unsigned int head, tail;
+
+    if (wait && log_uring_enter(u, 0, wait) < 0) {
+        perror("unable to wait for log records");
+        return;
+    }
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        int res = cqe->res;
+        u->inflight--;
+        if (cqe->user_data == LOG_URING_SYNC) {
+            if (res < 0) {
+                errno = -res;
+                perror("unable to sync log records");
+            }
+            continue;
+        }
+        int i = (int)cqe->user_data;
+        if (res < 0) {
+            errno = -res;
+            perror("unable to write log records");
+            u->failed += u->records[i];
+        } else {
+            log_stats_count(writes, 1);
+            log_stats_count(bytes, (uint64_t)res);
+            if ((size_t)res < u->used[i] &&
+                    log_pwrite_all(u->wfd, u->mem + (size_t)i * LOG_URING_BUF_SIZE + res,
+                        u->used[i] - (size_t)res, u->off[i] + res) < 0)
+                u->failed += u->records[i];
+        }
+        u->busy[i] = 0;
+        u->used[i] = 0;
+        u->records[i] = 0;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * log_uring_close waits for u's writes in flight and releases it.
+ */
+static void
+log_uring_close(struct log_uring_t *u)
+{
+    if (!u->active)
+        return;
+    while (u->inflight > 0)
+        log_uring_reap(u, 1);
+    if (u->sqes != NULL)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring != NULL && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring != NULL)
+        munmap(u->sq_ring, u->sq_ring_size);
+    if (u->mem != NULL)
+        munmap(u->mem, (size_t)LOG_URING_BUFS * LOG_URING_BUF_SIZE);
+    if (u->fd >= 0)
+        close(u->fd);
+    if (u->wfd >= 0)
+        close(u->wfd);
+    memset(u, 0, sizeof(struct log_uring_t));
+}
+
+/**
+ * log_uring_open sets up an io_uring for writing lg's file from its
+ * async writer. The buffers and the file are registered with the ring
+ * when the kernel allows it. Returns 0, or -1 if io_uring can't be used,
+ * in which case the writer keeps using writev().
+ */
+static int
+log_uring_open(struct logger_t *lg)
+{
+    struct log_uring_t *u = &lg->uring;
+    struct io_uring_params p;
+    struct iovec iov[LOG_URING_BUFS];
+    char path[64];
+
+    memset(u, 0, sizeof(struct log_uring_t));
+    u->active = 1;
+    u->wfd = -1;
+    memset(&p, 0, sizeof(p));
+    if ((u->fd = (int)syscall(__NR_io_uring_setup, 2 * LOG_URING_BUFS, &p)) < 0)
+        goto fail;
+
+    /* the log file is in append mode, which would ignore the offsets */
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fileno(lg->output));
+    if ((u->wfd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+        goto fail;
+    if ((u->offset = lseek(u->wfd, 0, SEEK_END)) < 0)
+        goto fail;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) {
+            u->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto fail;
+    }
+    u->sq_tail = (unsigned int *)((char *)u->sq_ring + p.sq_off.tail);
+    u->sq_mask = (unsigned int *)((char *)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned int *)((char *)u->sq_ring + p.sq_off.array);
+    u->cq_head = (unsigned int *)((char *)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned int *)((char *)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = (unsigned int *)((char *)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+
+    u->mem = (char *)mmap(NULL, (size_t)LOG_URING_BUFS * LOG_URING_BUF_SIZE,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->mem == MAP_FAILED) {
+        u->mem = NULL;
+        goto fail;
+    }
+    for (int i = 0; i < LOG_URING_BUFS; i++) {
+        iov[i].iov_base = u->mem + (size_t)i * LOG_URING_BUF_SIZE;
+        iov[i].iov_len = LOG_URING_BUF_SIZE;
+    }
+    /* both can fail under a low RLIMIT_MEMLOCK; plain writes still work */
+    u->fixed_bufs = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS,
+        iov, LOG_URING_BUFS) == 0;
+    u->fixed_files = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES,
+        &u->wfd, 1) == 0;
+    u->gen = lg->rot ? lg->rot->gen : 0;
+    return 0;
+
+fail:
+    log_uring_close(u);
+    return -1;
+}
+
+/**
+ * log_uring_reopen points u at lg's file again after a rotation swapped
+ * it. Nothing may be in flight. Returns 0, or -1 if the new file can't
+ * be opened.
+ */
+static int
+log_uring_reopen(struct logger_t *lg)
+{
+    struct log_uring_t *u = &lg->uring;
+    char path[64];
+    int wfd;
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fileno(lg->output));
+    if ((wfd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+        return -1;
+    if (u->fixed_files)
+        syscall(__NR_io_uring_register, u->fd, IORING_UNREGISTER_FILES, NULL, 0);
+    close(u->wfd);
+    u->wfd = wfd;
+    u->offset = lseek(wfd, 0, SEEK_END);
+    u->fixed_files = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES,
+        &u->wfd, 1) == 0;
+    u->gen = lg->rot->gen;
+    return u->offset < 0 ? -1 : 0;
+}
+
+/**
+ * log_uring_sqe returns the next free submission entry of u, cleared
+ * and aimed at the log file.
+ */
+static struct io_uring_sqe *
+log_uring_sqe(struct log_uring_t *u)
+{
+    unsigned int tail = *u->sq_tail, idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    if (u->fixed_files) {
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = u->wfd;
+    }
+    u->sq_array[idx] = idx;
+    return sqe;
+}
+
+static void
+log_uring_push(struct log_uring_t *u)
+{
+    __atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+    u->inflight++;
+    if (log_uring_enter(u, 1, 0) < 0)
+        perror("unable to submit log records");
+}
+
+/**
+ * log_uring_submit starts writing buffer i of u at the end of what was
+ * written so far. An empty buffer is left alone.
+ */
+static void
+log_uring_submit(struct log_uring_t *u, int i)
+{
+    struct io_uring_sqe *sqe;
+
+    if (u->used[i] == 0 || u->busy[i])
+        return;
+    sqe = log_uring_sqe(u);
+    sqe->opcode = u->fixed_bufs ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->addr = (uint64_t)(uintptr_t)(u->mem + (size_t)i * LOG_URING_BUF_SIZE);
+    sqe->len = (uint32_t)u->used[i];
+    sqe->off = (uint64_t)u->offset;
+    sqe->buf_index = (uint16_t)i;
+    sqe->user_data = (uint64_t)i;
+    u->off[i] = u->offset;
+    u->offset += (off_t)u->used[i];
+    u->busy[i] = 1;
+    log_uring_push(u);
+}
+
+/**
+ * log_uring_sync queues an fdatasync that starts once every write
+ * submitted before it has completed.
+ */
+static void
+log_uring_sync(struct log_uring_t *u)
+{
+    struct io_uring_sqe *sqe = log_uring_sqe(u);
+
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->flags |= IOSQE_IO_DRAIN;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = LOG_URING_SYNC;
+    log_uring_push(u);
+}
+
+/**
+ * log_uring_put copies a record into u's current buffer. A full buffer
+ * is submitted and the next one taken once its previous write is done.
+ * A record larger than a buffer is written on its own with pwrite().
+ */
+static void
+log_uring_put(struct log_uring_t *u, const char *data, size_t len)
+{
+    if (u->used[u->cur] + len > LOG_URING_BUF_SIZE) {
+        log_uring_submit(u, u->cur);
+        u->cur = (u->cur + 1) % LOG_URING_BUFS;
+        while (u->busy[u->cur])
+            log_uring_reap(u, 1);
+    }
+    if (len > LOG_URING_BUF_SIZE) {
+        if (log_pwrite_all(u->wfd, data, len, u->offset) < 0)
+            u->failed++;
+        u->offset += (off_t)len;
+        return;
+    }
+    memcpy(u->mem + (size_t)u->cur * LOG_URING_BUF_SIZE + u->used[u->cur], data, len);
+    u->used[u->cur] += len;
+    u->records[u->cur]++;
+}
+
+/**
+ * log_uring_drain is log_async_drain for a writer with an io_uring.
+ * It keeps filling buffers while earlier ones are written, then syncs
+ * through the ring if the durability policy asks for it, and returns
+ * once everything is written. Returns the number of records taken off
+ * the ring.
+ *
+ * The end of the file is looked up again first: between drains other
+ * writers may have appended to it, or copytruncate emptied it.
+ */
+static size_t
+log_uring_drain(struct logger_t *lg, size_t *failed)
+{
+    struct log_uring_t *u = &lg->uring;
+    struct log_shared_t *shared;
+    size_t len, total = 0, bytes = 0;
+    off_t end = lseek(u->wfd, 0, SEEK_END);
+    char *data;
+
+    if (end >= 0)
+        u->offset = end;
+    while (log_ring_pop(&lg->async, &data, &len, &shared)) {
+        log_uring_put(u, data, len);
+        log_record_free(data, shared);
+        bytes += len;
+        total++;
+    }
+    log_uring_submit(u, u->cur);
+    u->cur = (u->cur + 1) % LOG_URING_BUFS;
+    if (log_sync_due(&lg->sync, bytes)) {
+        log_uring_sync(u);
+        log_sync_done(&lg->sync);
+    }
+    while (u->inflight > 0)
+        log_uring_reap(u, 1);
+    log_rot_written(lg, bytes);
+    *failed += u->failed;
+    u->failed = 0;
+    return total;
+}
+#endif
+
+/**
+ * log_async_drain writes everything currently queued for lg, up to
+ * LOG_IOV_MAX records per writev(), and applies the durability policy
+ * once for the whole drain. Returns the number of records taken off
+ * the ring.
+ */
+static size_t
+log_async_drain(struct logger_t *lg)
+{
+    struct log_async_t *q = &lg->async;
+    struct iovec iov[LOG_IOV_MAX];
+    char *data[LOG_IOV_MAX];
+    struct log_shared_t *shared[LOG_IOV_MAX];
+    size_t n, total = 0, bytes = 0, failed = 0;
+    int fd = log_io_acquire(lg);
+    uint64_t t0 = log_monotonic_ns();
+
+#ifdef LOG_HAVE_URING
+    if (lg->uring.active && fd >= 0 && lg->rot != NULL && lg->uring.gen != lg->rot->gen &&
+            log_uring_reopen(lg) != 0)
+        log_uring_close(&lg->uring);
+    if (lg->uring.active && fd >= 0)
+        total = log_uring_drain(lg, &failed);
+    else
+#endif
+    {
+        do {
+            for (n = 0; n < LOG_IOV_MAX; n++) {
+                size_t len;
+                if (!log_ring_pop(q, &data[n], &len, &shared[n]))
+                    break;
+                iov[n].iov_base = data[n];
+                iov[n].iov_len = len;
+                bytes += len;
+            }
+            if (n > 0 && fd < 0) {
+                failed += n;
+            } else if (n > 0 && (lg->out_type == LOG_OUT_UNIX_STREAM ||
+                    lg->out_type == LOG_OUT_UNIX_DGRAM)) {
+                failed += log_sink_send(lg->sink, fd, iov, (int)n);
+            } else if (n > 0 && log_out_writev(lg, fd, iov, (int)n) < 0) {
+                failed += n;
+                fd = -1;
+            }
+            for (size_t i = 0; i < n; i++)
+                log_record_free(data[i], shared[i]);
+            total += n;
+        } while (n == LOG_IOV_MAX);
+        log_out_commit(lg, fd, bytes);
+        if (fd >= 0)
+            log_rot_written(lg, bytes);
+    }
+    if (failed) {
+        __atomic_add_fetch(&q->failed, failed, __ATOMIC_RELAXED);
+        log_bin_restart(lg);
+    }
+    log_io_release(lg);
+    if (total)
+        log_stats_time(flush, log_monotonic_ns() - t0);
+
+    __atomic_store_n(&q->durable, __atomic_load_n(&q->dequeue_pos, __ATOMIC_SEQ_CST),
+        __ATOMIC_SEQ_CST);
+    if ((total && __atomic_load_n(&q->blocked, __ATOMIC_SEQ_CST)) ||
+            __atomic_load_n(&q->sync_waiters, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_broadcast(&q->not_full);
+        pthread_cond_broadcast(&q->synced);
+        pthread_mutex_unlock(&q->lock);
+    }
+    return total;
+}
+
+/**
+ * log_async_wait sleeps on cond for at most ms milliseconds.
+ * q->lock must be held.
+ */
+static void
+log_async_wait(struct log_async_t *q, pthread_cond_t *cond, long ms)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += ms * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(cond, &q->lock, &ts);
+}
+
+static void*
+log_async_writer(void *arg)
+{
+    struct logger_t *lg = (struct logger_t *)arg;
+    struct log_async_t *q = &lg->async;
+
+#ifdef LOG_HAVE_URING
+    if (lg->io_backend == LOG_IO_URING && lg->out_type == LOG_OUT_FILE && lg->blk == NULL)
+        log_uring_open(lg);
+#endif
+    for (;;) {
+        if (log_async_drain(lg))
+            continue;
+        if (__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE))
+            break;
+        if (lg->sync.mode == LOG_SYNC_PERIODIC &&
+                __atomic_load_n(&lg->sync.unsynced, __ATOMIC_RELAXED)) {
+            int fd = log_io_acquire(lg);
+            log_out_commit(lg, fd, 0);
+            log_io_release(lg);
+        }
+        if (lg->blk != NULL) {
+            int fd = log_io_acquire(lg);
+            if (fd >= 0 && log_blk_aged(lg->blk))
+                log_blk_seal(lg->blk, fd);
+            log_io_release(lg);
+        }
+        pthread_mutex_lock(&q->lock);
+        __atomic_store_n(&q->writer_idle, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&q->enqueue_pos, __ATOMIC_SEQ_CST) ==
+                __atomic_load_n(&q->dequeue_pos, __ATOMIC_SEQ_CST) &&
+                !__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE))
+            log_async_wait(q, &q->not_empty, 100);
+        __atomic_store_n(&q->writer_idle, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&q->lock);
+    }
+    log_async_drain(lg);
+#ifdef LOG_HAVE_URING
+    log_uring_close(&lg->uring);
+#endif
+    return NULL;
+}
+
+/**
+ * log_async_push hands a serialized record over to lg's writer thread,
+ * taking ownership of data, or of one reference to shared if set.
+ * Returns 1 if the record was queued, 0 if it was dropped and -1 if
+ * async mode is not running. With LOG_SYNC_GROUP it only returns once
+ * the record has been synced.
+ */
+static int
+log_async_push(struct logger_t *lg, char *data, size_t len,
+    struct log_shared_t *shared)
+{
+    struct log_async_t *q = &lg->async;
+    size_t ticket = 0;
+    char *old;
+    size_t old_len;
+    struct log_shared_t *old_shared;
+    uint64_t t0 = 0;
+
+    __atomic_add_fetch(&q->active, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&q->running, __ATOMIC_SEQ_CST)) {
+        __atomic_sub_fetch(&q->active, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+
+    while (ticket == 0) {
+        if ((ticket = log_ring_push(q, data, len, shared)) != 0)
+            break;
+        switch (q->policy) {
+            case LOG_ASYNC_DROP_NEWEST:
+                __atomic_add_fetch(&q->dropped_newest, 1, __ATOMIC_RELAXED);
+                log_record_free(data, shared);
+                goto out;
+            case LOG_ASYNC_DROP_OLDEST:
+                if (log_ring_pop(q, &old, &old_len, &old_shared)) {
+                    __atomic_add_fetch(&q->dropped_oldest, 1, __ATOMIC_RELAXED);
+                    log_record_free(old, old_shared);
+                    /* it may have defined keys later frames refer to */
+                    log_bin_restart(lg);
+                }
+                break;
+            default:
+                if (t0 == 0)
+                    t0 = log_monotonic_ns();
+                pthread_mutex_lock(&q->lock);
+                __atomic_add_fetch(&q->blocked, 1, __ATOMIC_SEQ_CST);
+                if ((ticket = log_ring_push(q, data, len, shared)) == 0)
+                    log_async_wait(q, &q->not_full, 10);
+                __atomic_sub_fetch(&q->blocked, 1, __ATOMIC_SEQ_CST);
+                pthread_mutex_unlock(&q->lock);
+                break;
+        }
+    }
+
+    if (__atomic_load_n(&q->writer_idle, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_signal(&q->not_empty);
+        pthread_mutex_unlock(&q->lock);
+    }
+    if (lg->sync.mode == LOG_SYNC_GROUP) {
+        if (t0 == 0)
+            t0 = log_monotonic_ns();
+        pthread_mutex_lock(&q->lock);
+        __atomic_add_fetch(&q->sync_waiters, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&q->durable, __ATOMIC_SEQ_CST) < ticket)
+            log_async_wait(q, &q->synced, 10);
+        __atomic_sub_fetch(&q->sync_waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&q->lock);
+    }
+out:
+    if (t0)
+        log_stats_time(queue_wait, log_monotonic_ns() - t0);
+    __atomic_sub_fetch(&q->active, 1, __ATOMIC_SEQ_CST);
+    return ticket != 0;
+}
+
+/**
+ * logger_async_start switches lg to async mode: records are queued on
+ * a bounded ring of capacity entries (rounded up to a power of two)
+ * and written by a dedicated thread. policy is one of
+ * log_async_policy_types and decides what happens when the ring is full.
+ */
+int
+logger_async_start(struct logger_t *lg, size_t capacity, int policy)
+{
+    struct log_async_t *q = &lg->async;
+    size_t size = 2;
+    int wc;
+
+    while (size < capacity)
+        size <<= 1;
+
+    while(pthread_mutex_lock(&lg->lock) != 0){ usleep(1); }
+    if (!lg->output || lg->shm) {
+        wc = LOG_FAIL;
+    } else if (q->running) {
+        wc = LOG_NO_ACTION;
+    } else {
+        q->slots = (struct log_slot_t *)calloc(size, sizeof(struct log_slot_t));
+        if (q->slots == NULL) {
+            perror("unable to allocation memory for async ring");
+            wc = LOG_FAIL;
+        } else {
+            for (size_t i = 0; i < size; i++)
+                q->slots[i].seq = i;
+            q->mask = size - 1;
+            q->enqueue_pos = 0;
+            q->dequeue_pos = 0;
+            q->durable = 0;
+            q->policy = policy;
+            q->stop = 0;
+            if (pthread_create(&q->writer, NULL, log_async_writer, lg) != 0) {
+                free(q->slots);
+                q->slots = NULL;
+                wc = LOG_FAIL;
+            } else {
+                __atomic_store_n(&q->running, 1, __ATOMIC_SEQ_CST);
+                wc = LOG_OPEN;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lg->lock);
+    return wc;
+}
+
+int
+log_async_start(size_t capacity, int policy)
+{
+    return logger_async_start(&log_default, capacity, policy);
+}
+
+/**
+ * log_async_stop stops lg accepting async records, waits for the
+ * writer to flush everything still queued and releases the ring.
+ */
+static void
+log_async_stop(struct logger_t *lg)
+{
+    struct log_async_t *q = &lg->async;
+
+    if (!__atomic_exchange_n(&q->running, 0, __ATOMIC_SEQ_CST))
+        return;
+    while (__atomic_load_n(&q->active, __ATOMIC_SEQ_CST) != 0)
+        sched_yield();
+
+    __atomic_store_n(&q->stop, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    pthread_join(q->writer, NULL);
+
+    log_async_drain(lg);
+    free(q->slots);
+    q->slots = NULL;
+}
+
+/**
+ * logger_async_stats returns how many of lg's records were thrown away
+ * because the ring was full, and how many the writer failed to write.
+ */
+struct log_async_stats_t
+logger_async_stats(struct logger_t *lg)
+{
+    struct log_async_stats_t st;
+    st.dropped_newest = __atomic_load_n(&lg->async.dropped_newest, __ATOMIC_RELAXED);
+    st.dropped_oldest = __atomic_load_n(&lg->async.dropped_oldest, __ATOMIC_RELAXED);
+    st.failed = __atomic_load_n(&lg->async.failed, __ATOMIC_RELAXED);
+    return st;
+}
+
+struct log_async_stats_t
+log_async_stats()
+{
+    return logger_async_stats(&log_default);
+}
+
+/**
+ * log_sinks_write copies a record to every sink of lg. Returns the
+ * number of sinks that queued it. lg->sinks_active counts the callers
+ * walking the sinks, so logger_shutdown knows when it may free them.
+ */
+static int
+log_sinks_write(struct logger_t *lg, const char *str, size_t len)
+{
+    struct log_shared_t *rec;
+    struct log_sink_t *s;
+    int queued = 0;
+
+    rec = (struct log_shared_t *)malloc(sizeof(struct log_shared_t) + len);
+    if (rec == NULL) {
+        perror("unable to allocation memory for record");
+        return 0;
+    }
+    rec->refs = 1;
+    memcpy(rec->data, str, len);
+    __atomic_add_fetch(&lg->sinks_active, 1, __ATOMIC_SEQ_CST);
+    for (s = __atomic_load_n(&lg->sinks, __ATOMIC_SEQ_CST); s != NULL; s = s->next) {
+        __atomic_add_fetch(&rec->refs, 1, __ATOMIC_RELAXED);
+        switch (log_async_push(&s->out, rec->data, len, rec)) {
+            case 1:
+                queued++;
+                break;
+            case -1:
+                log_record_free(rec->data, rec);
+                break;
+            default:
+                break;
+        }
+    }
+    __atomic_sub_fetch(&lg->sinks_active, 1, __ATOMIC_SEQ_CST);
+    log_record_free(rec->data, rec);
+    return queued;
+}
+#endif
+
+/**
+ * log_tls_shard is the calling thread's ordinal for LOG_SHARD_THREAD,
+ * handed out from log_shard_next on the thread's first record.
+ */
+static __thread int log_tls_shard = -1;
+static unsigned int log_shard_next = 0;
+
+/**
+ * log_shard_open opens shard i of lg on first use. Two threads racing
+ * to open it agree on whichever fd got published first.
+ */
+static int
+log_shard_open(struct logger_t *lg, unsigned int i)
+{
+    char name[PATH_MAX];
+    int fd, expected = -1;
+
+    snprintf(name, sizeof(name), "%s.%u", lg->shard_base, i);
+    fd = open(name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("unable to open log shard");
+        return -1;
+    }
+    if (!__atomic_compare_exchange_n(&lg->shard_fds[i], &expected, fd, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        close(fd);
+        fd = expected;
+    }
+    return fd;
+}
+
+/**
+ * log_shard_write appends a record to the calling thread's or CPU's
+ * shard of lg with a single write. With LOG_SYNC_GROUP the shard is
+ * synced before returning; other durability modes sync on close.
+ */
+static int
+log_shard_write(struct logger_t *lg, char *str, size_t len)
+{
+    struct iovec iov = { str, len };
+    unsigned int i;
+    ssize_t n;
+    int fd;
+
+#ifdef __linux__
+    if (lg->shard == LOG_SHARD_CPU && (fd = sched_getcpu()) >= 0)
+        i = (unsigned int)fd % lg->shard_count;
+    else
+#endif
+    {
+        if (log_tls_shard < 0)
+            log_tls_shard = (int)__atomic_fetch_add(&log_shard_next, 1, __ATOMIC_RELAXED);
+        i = (unsigned int)log_tls_shard % lg->shard_count;
+    }
+    if ((fd = __atomic_load_n(&lg->shard_fds[i], __ATOMIC_ACQUIRE)) < 0 &&
+            (fd = log_shard_open(lg, i)) < 0)
+        return LOG_NO_ACTION;
+
+    if ((n = log_writev_all(fd, &iov, 1)) < 0)
+        return LOG_NO_ACTION;
+    if (lg->sync.mode == LOG_SYNC_GROUP) {
+        LOG_FDATASYNC(fd);
+        log_stats_count(syncs, 1);
+    }
+    return (int)n;
+}
+
+/**
+ * log_seg_open creates the first segment file of lg from index on,
+ * preallocated to lg->seg_size bytes and mapped. Segment files are
+ * named after the logger's file with a six digit number appended and
+ * existing ones are skipped, so a restarted process carries on after
+ * the last one.
+ */
+static struct log_seg_t *
+log_seg_open(struct logger_t *lg, unsigned int index)
+{
+    char name[PATH_MAX];
+    struct log_seg_t *seg;
+    void *base;
+    int fd, rc;
+
+    for (;; index++) {
+        snprintf(name, sizeof(name), "%s.%06u", lg->seg_base, index);
+        fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd >= 0 || errno != EEXIST)
+            break;
+    }
+    if (fd < 0) {
+        perror("unable to open log segment");
+        return NULL;
+    }
+    /* only fall back to a sparse file where preallocation isn't supported */
+#ifdef __linux__
+    if ((rc = fallocate(fd, 0, 0, (off_t)lg->seg_size)) != 0 && errno == EOPNOTSUPP)
+#endif
+        rc = ftruncate(fd, (off_t)lg->seg_size);
+    base = rc == 0 ? mmap(NULL, lg->seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) :
+        MAP_FAILED;
+    seg = base != MAP_FAILED ? (struct log_seg_t *)calloc(1, sizeof(struct log_seg_t)) : NULL;
+    if (seg == NULL) {
+        perror("unable to map log segment");
+        if (base != MAP_FAILED)
+            munmap(base, lg->seg_size);
+        close(fd);
+        unlink(name);
+        return NULL;
+    }
+    seg->base = (char *)base;
+    seg->size = lg->seg_size;
+    seg->end = SIZE_MAX;
+    seg->index = index;
+    seg->fd = fd;
+    return seg;
+}
+
+/**
+ * log_seg_seal waits for the writers still copying into seg, flushes
+ * it, syncs it if a durability mode is set and cuts the file down to
+ * what was written.
+ */
+static void
+log_seg_seal(struct logger_t *lg, struct log_seg_t *seg)
+{
+    size_t end;
+
+    while ((end = __atomic_load_n(&seg->end, __ATOMIC_ACQUIRE)) == SIZE_MAX)
+        sched_yield();
+    while (__atomic_load_n(&seg->committed, __ATOMIC_ACQUIRE) < end)
+        sched_yield();
+    msync(seg->base, end, lg->sync.mode != LOG_SYNC_NONE ? MS_SYNC : MS_ASYNC);
+    munmap(seg->base, seg->size);
+    if (ftruncate(seg->fd, (off_t)end) != 0)
+        perror("unable to truncate log segment");
+    if (lg->sync.mode != LOG_SYNC_NONE) {
+        LOG_FDATASYNC(seg->fd);
+        log_stats_count(syncs, 1);
+    }
+    close(seg->fd);
+    seg->base = NULL;
+    seg->fd = -1;
+}
+
+/**
+ * log_seg_roll replaces the full segment seg of lg with a new one and
+ * seals seg. Only the first writer to get here does it; the others
+ * find seg already replaced. Returns -1 if no new segment could be
+ * opened.
+ */
+static int
+log_seg_roll(struct logger_t *lg, struct log_seg_t *seg)
+{
+    struct log_seg_t *next;
+    int rc = 0;
+
+    if (__atomic_load_n(&lg->seg_cur, __ATOMIC_ACQUIRE) != seg)
+        return 0;
+#ifdef THREAD_ENABLE
+    log_stats_lock(&lg->lock);
+#endif
+    if (lg->seg_cur == seg) {
+        if ((next = log_seg_open(lg, seg->index + 1)) == NULL) {
+            rc = -1;
+        } else {
+            /* writers may still hold seg, so it is only freed on close */
+            next->next = lg->segs;
+            lg->segs = next;
+            __atomic_store_n(&lg->seg_cur, next, __ATOMIC_RELEASE);
+            log_seg_seal(lg, seg);
+        }
+    }
+#ifdef THREAD_ENABLE
+    pthread_mutex_unlock(&lg->lock);
+#endif
+    return rc;
+}
+
+/**
+ * log_seg_write copies a record into lg's current segment. Writing
+ * takes no lock and no system call, only a fetch-add to reserve room
+ * and a copy, except for the writer that finds the segment full and
+ * moves on to the next one. A record must fit in a segment.
+ */
+static int
+log_seg_write(struct logger_t *lg, const char *str, size_t len)
+{
+    for (;;) {
+        struct log_seg_t *seg = __atomic_load_n(&lg->seg_cur, __ATOMIC_ACQUIRE);
+        size_t off;
+
+        if (seg == NULL || len > seg->size)
+            return LOG_NO_ACTION;
+        off = __atomic_fetch_add(&seg->pos, len, __ATOMIC_RELAXED);
+        if (off + len <= seg->size) {
+            memcpy(seg->base + off, str, len);
+            __atomic_add_fetch(&seg->committed, len, __ATOMIC_RELEASE);
+            log_stats_count(bytes, (uint64_t)len);
+            return (int)len;
+        }
+        if (off <= seg->size)
+            __atomic_store_n(&seg->end, off, __ATOMIC_RELEASE);
+        if (log_seg_roll(lg, seg) != 0)
+            return LOG_NO_ACTION;
+    }
+}
+
+/**
+ * log_rec_copy_in and log_rec_copy_out copy n bytes to or from
+ * position pos of a ring of size bytes, wrapping at its end.
+ */
+static inline void
+log_rec_copy_in(char *data, uint64_t size, uint64_t pos, const char *src, size_t n)
+{
+    size_t off = (size_t)(pos & (size - 1));
+    size_t first = n < size - off ? n : (size_t)(size - off);
+
+    memcpy(data + off, src, first);
+    memcpy(data, src + first, n - first);
+}
+
+static inline void
+log_rec_copy_out(const char *data, uint64_t size, uint64_t pos, char *dst, size_t n)
+{
+    size_t off = (size_t)(pos & (size - 1));
+    size_t first = n < size - off ? n : (size_t)(size - off);
+
+    memcpy(dst, data + off, first);
+    memcpy(dst + first, data, n - first);
+}
+
+/**
+ * log_rec_write copies a record into the flight recorder rec. Writers
+ * never wait for each other or for a dump; once the ring is full each
+ * record overwrites the oldest ones. Records larger than half the ring
+ * are dropped, as are those the other writers lap while they are
+ * copied in.
+ */
+static int
+log_rec_write(struct log_rec_t *rec, const char *str, size_t len)
+{
+    struct log_rec_head_t *h = rec->head;
+    uint64_t size = h->size;
+    uint64_t sz = (sizeof(struct log_rec_hdr_t) + len + 15) & ~(uint64_t)15;
+    struct log_rec_hdr_t *hdr;
+    uint64_t pos;
+
+    if (sz > size / 2) {
+        __atomic_add_fetch(&h->dropped, 1, __ATOMIC_RELAXED);
+        return LOG_NO_ACTION;
+    }
+    pos = __atomic_fetch_add(&h->head, sz, __ATOMIC_ACQUIRE);
+    hdr = (struct log_rec_hdr_t *)(rec->data + (pos & (size - 1)));
+    hdr->len = (uint32_t)len;
+    log_rec_copy_in(rec->data, size, pos + sizeof(*hdr), str, len);
+    if (__atomic_load_n(&h->head, __ATOMIC_ACQUIRE) - pos >= size) {
+        /* the slot was reused under us: don't vouch for it */
+        __atomic_add_fetch(&h->dropped, 1, __ATOMIC_RELAXED);
+        return LOG_NO_ACTION;
+    }
+    __atomic_store_n(&hdr->tag, pos ^ h->key, __ATOMIC_RELEASE);
+    log_stats_count(bytes, (uint64_t)len);
+    return (int)len;
+}
+
+/**
+ * LOG_REC_BOUNCE is how much of a record a dump copies out of the ring
+ * at a time, on the stack, before checking that it was not overwritten.
+ */
+#define LOG_REC_BOUNCE 4096
+
+static int
+log_rec_write_all(int fd, const char *buf, size_t n)
+{
+    while (n > 0) {
+        ssize_t wc = write(fd, buf, n);
+        if (wc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += wc;
+        n -= (size_t)wc;
+    }
+    return 0;
+}
+
+/**
+ * log_rec_dump_fd writes the complete records of the ring at data,
+ * described by h, to fd, oldest first, and returns how many it wrote,
+ * or -1 on a write error. Records that writers overwrite while they are
+ * copied out are skipped, except that one larger than LOG_REC_BOUNCE
+ * can come out cut short, ended with a newline. It only makes
+ * async-signal-safe calls, so it can run in a signal handler.
+ */
+static long
+log_rec_dump_fd(struct log_rec_head_t *h, const char *data, int fd)
+{
+    char bounce[LOG_REC_BOUNCE];
+    uint64_t size = h->size;
+    uint64_t end = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+    uint64_t p = end > size ? end - size : 0;
+    long n = 0;
+
+    while (p < end) {
+        const struct log_rec_hdr_t *hdr =
+            (const struct log_rec_hdr_t *)(data + (p & (size - 1)));
+        uint64_t len, sz, off, head;
+
+        if (__atomic_load_n(&hdr->tag, __ATOMIC_ACQUIRE) != (p ^ h->key)) {
+            p += 16;
+            continue;
+        }
+        len = hdr->len;
+        sz = (sizeof(*hdr) + len + 15) & ~(uint64_t)15;
+        if (sz > size / 2 || p + sz > end) {
+            p += 16;
+            continue;
+        }
+        for (off = 0; off < len; off += LOG_REC_BOUNCE) {
+            size_t chunk = len - off < LOG_REC_BOUNCE ? (size_t)(len - off) : LOG_REC_BOUNCE;
+            log_rec_copy_out(data, size, p + sizeof(*hdr) + off, bounce, chunk);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            head = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+            if (head > p + size ||
+                    __atomic_load_n(&hdr->tag, __ATOMIC_RELAXED) != (p ^ h->key))
+                break;
+            if (log_rec_write_all(fd, bounce, chunk) != 0)
+                return -1;
+        }
+        if (off < len) {
+            if (off > 0 && log_rec_write_all(fd, "\n", 1) != 0)
+                return -1;
+            /* lapped by the writers: go on from the oldest record left */
+            p = head > p + size + 16 ? head - size : p + 16;
+            continue;
+        }
+        n++;
+        p += sz;
+    }
+    return n;
+}
+
+/**
+ * log_recs are the open flight recorders, for the signal handlers.
+ */
+static struct log_rec_t *log_recs[LOG_RECORDERS];
+
+/**
+ * log_rec_dump writes the records of rec to path, replacing the file,
+ * and returns how many it wrote or -1. Async-signal-safe.
+ */
+static long
+log_rec_dump(struct log_rec_t *rec, const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    long n;
+
+    if (fd < 0)
+        return -1;
+    n = log_rec_dump_fd(rec->head, rec->data, fd);
+    if (close(fd) != 0)
+        n = -1;
+    return n;
+}
+
+/**
+ * log_recorders_dump dumps every open flight recorder to its file.
+ * Async-signal-safe.
+ */
+static void
+log_recorders_dump()
+{
+    for (int i = 0; i < LOG_RECORDERS; i++) {
+        struct log_rec_t *rec = __atomic_load_n(&log_recs[i], __ATOMIC_ACQUIRE);
+        if (rec != NULL)
+            log_rec_dump(rec, rec->dump_path);
+    }
+}
+
+/**
+ * log_rec_keep moves a ring left at path by an earlier process to
+ * path.old, so that it is not lost before logflight got to it.
+ */
+static void
+log_rec_keep(const char *path)
+{
+    struct log_rec_head_t h;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    char *old;
+
+    if (fd < 0)
+        return;
+    if (pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) &&
+            memcmp(h.magic, LOG_REC_MAGIC, sizeof(h.magic)) == 0 &&
+            (old = (char *)malloc(strlen(path) + 5)) != NULL) {
+        sprintf(old, "%s.old", path);
+        if (rename(path, old) != 0)
+            perror("unable to keep previous flight recorder");
+        free(old);
+    }
+    close(fd);
+}
+
+/**
+ * log_rec_open creates a flight recorder with a ring of at least size
+ * bytes, dumped to dump_path. The ring lives in ring_path, which
+ * outlives the process, or in an anonymous memfd if ring_path is NULL,
+ * which a core dump includes with the default coredump_filter.
+ */
+static struct log_rec_t *
+log_rec_open(const char *dump_path, size_t size, const char *ring_path)
+{
+    struct log_rec_t *rec = (struct log_rec_t *)calloc(1, sizeof(struct log_rec_t));
+    struct log_rec_head_t *h;
+    struct timespec now;
+    uint64_t ring = 64 * 1024;
+    void *mem;
+
+    if (rec == NULL || (rec->dump_path = strdup(dump_path)) == NULL) {
+        perror("unable to allocation memory for flight recorder");
+        free(rec);
+        return NULL;
+    }
+    while (ring < size)
+        ring <<= 1;
+    rec->map_size = LOG_REC_HEAD + (size_t)ring;
+
+    if (ring_path != NULL) {
+        log_rec_keep(ring_path);
+        rec->fd = open(ring_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    } else {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+        rec->fd = memfd_create("liblogger-recorder", MFD_CLOEXEC);
+#else
+        rec->fd = -2;
+#endif
+    }
+    if (rec->fd == -1 || (rec->fd >= 0 && ftruncate(rec->fd, (off_t)rec->map_size) != 0)) {
+        perror("unable to create flight recorder");
+        goto fail;
+    }
+    mem = rec->fd >= 0 ?
+        mmap(NULL, rec->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, rec->fd, 0) :
+        mmap(NULL, rec->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("unable to map flight recorder");
+        goto fail;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    rec->head = h = (struct log_rec_head_t *)mem;
+    rec->data = (char *)mem + LOG_REC_HEAD;
+    h->version = LOG_REC_VERSION;
+    h->data_off = LOG_REC_HEAD;
+    h->size = ring;
+    h->key = ((uint64_t)now.tv_nsec << 32 ^ (uint64_t)now.tv_sec ^ (uintptr_t)mem) | 1;
+    h->pid = (int64_t)getpid();
+    h->created = (int64_t)now.tv_sec;
+    memcpy(h->magic, LOG_REC_MAGIC, sizeof(h->magic));
+
+    for (int i = 0; i < LOG_RECORDERS; i++) {
+        struct log_rec_t *none = NULL;
+        if (__atomic_compare_exchange_n(&log_recs[i], &none, rec, 0,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            break;
+    }
+    return rec;
+
+fail:
+    if (rec->fd >= 0)
+        close(rec->fd);
+    free(rec->dump_path);
+    free(rec);
+    return NULL;
+}
+
+static void
+log_rec_close(struct log_rec_t *rec)
+{
+    for (int i = 0; i < LOG_RECORDERS; i++) {
+        struct log_rec_t *cur = rec;
+        __atomic_compare_exchange_n(&log_recs[i], &cur, NULL, 0,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+    munmap(rec->head, rec->map_size);
+    if (rec->fd >= 0)
+        close(rec->fd);
+    free(rec->dump_path);
+    free(rec);
+}
+
+#ifdef LOG_HAVE_SHM
+static __thread uint32_t log_tls_shm_tid;
+
+static pthread_once_t log_shm_once = PTHREAD_ONCE_INIT;
+
+static uint32_t
+log_shm_tid()
+{
+    if (log_tls_shm_tid == 0)
+        log_tls_shm_tid = (uint32_t)syscall(SYS_gettid) & LOG_SHM_TID_MASK;
+    return log_tls_shm_tid;
+}
+
+/**
+ * log_shm_alive tells whether the process or thread id is still
+ * running. A zombie is not: it will never finish what it started.
+ * kill() only finds thread ids that are process ids too, so threads
+ * are looked up in /proc.
+ */
+static int
+log_shm_alive(pid_t id)
+{
+    char path[64], buf[256], *p;
+    ssize_t n;
+    int fd;
+
+    if (id <= 0)
+        return 0;
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)id);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        if (errno == ENOENT && access("/proc/self/stat", F_OK) == 0)
+            return 0;
+        return kill(id, 0) == 0 || errno == EPERM;
+    }
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 1;
+    buf[n] = '\0';
+    p = strrchr(buf, ')');
+    return p == NULL || p[1] == '\0' || (p[2] != 'Z' && p[2] != 'X');
+}
+
+/**
+ * log_shm_forget drops what a forked child inherited of its parent's
+ * collector: unwritten output and partial records are the parent's to
+ * write.
+ */
+static void
+log_shm_forget(struct log_shm_t *shm)
+{
+    shm->collecting = 0;
+    shm->out_len = 0;
+    for (size_t i = 0; i < shm->nparts; i++)
+        free(shm->parts[i].data);
+    shm->nparts = 0;
+}
+
+static void
+log_shm_atfork_prepare()
+{
+    pthread_mutex_lock(&lock_loggers);
+}
+
+static void
+log_shm_atfork_parent()
+{
+    pthread_mutex_unlock(&lock_loggers);
+}
+
+/**
+ * log_shm_atfork_child runs in the child of a fork. The child goes on
+ * writing to the rings it inherited, but collector threads are left
+ * behind in the parent, so it collects none of them.
+ */
+static void
+log_shm_atfork_child()
+{
+    log_tls_shm_tid = 0;
+    if (log_default.shm != NULL)
+        log_shm_forget(log_default.shm);
+    for (struct logger_t *lg = log_loggers; lg != NULL; lg = lg->next)
+        if (lg->shm != NULL)
+            log_shm_forget(lg->shm);
+    pthread_mutex_unlock(&lock_loggers);
+}
+
+static void
+log_shm_once_init()
+{
+    pthread_atfork(log_shm_atfork_prepare, log_shm_atfork_parent, log_shm_atfork_child);
+}
+
+/**
+ * log_shm_name derives the name of the ring every process logging to
+ * file_name shares from the file's real path, so that relative paths
+ * and links to the file meet in one ring. Creates the file if needed.
+ */
+static int
+log_shm_name(const char *file_name, char *name, size_t size)
+{
+    uint64_t h = 14695981039346656037ULL;
+    int fd = open(file_name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    char *real;
+
+    if (fd < 0)
+        return -1;
+    close(fd);
+    if ((real = realpath(file_name, NULL)) == NULL)
+        return -1;
+    for (const char *p = real; *p != '\0'; p++)
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    free(real);
+    snprintf(name, size, "/liblogger-%016llx", (unsigned long long)h);
+    return 0;
+}
+
+/**
+ * log_shm_attach maps the ring another process created at fd, once
+ * that process has set it up, or returns NULL if it does not within a
+ * second.
+ */
+static struct log_shm_head_t *
+log_shm_attach(int fd, size_t *map_size)
+{
+    struct log_shm_head_t *h = NULL;
+    struct stat st;
+
+    for (int i = 0; i < 1000; i++, usleep(1000)) {
+        if (fstat(fd, &st) != 0)
+            return NULL;
+        if (st.st_size < LOG_SHM_HEAD + (off_t)sizeof(struct log_shm_slot_t))
+            continue;
+        if (h == NULL) {
+            h = (struct log_shm_head_t *)mmap(NULL, (size_t)st.st_size,
+                PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (h == MAP_FAILED)
+                return NULL;
+            *map_size = (size_t)st.st_size;
+        }
+        if (__atomic_load_n(&h->ready, __ATOMIC_ACQUIRE))
+            break;
+    }
+    if (h == NULL || !h->ready || memcmp(h->magic, LOG_SHM_MAGIC, sizeof(h->magic)) != 0 ||
+            h->version != LOG_SHM_VERSION || h->slots == 0 || (h->slots & (h->slots - 1)) != 0 ||
+            LOG_SHM_HEAD + h->slots * sizeof(struct log_shm_slot_t) != *map_size) {
+        if (h != NULL)
+            munmap(h, *map_size);
+        errno = EINVAL;
+        return NULL;
+    }
+    return h;
+}
+
+/**
+ * log_shm_map creates the ring name with slots slots, or maps the one
+ * that is already there, whatever its size. A ring whose creator died
+ * before setting it up is replaced.
+ */
+static struct log_shm_head_t *
+log_shm_map(const char *name, uint64_t slots, size_t *map_size)
+{
+    struct log_shm_head_t *h;
+    int fd;
+
+    for (int tries = 0; tries < 2; tries++) {
+        if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0) {
+            if (errno != EEXIST)
+                return NULL;
+            if ((fd = shm_open(name, O_RDWR | O_CLOEXEC, 0)) < 0)
+                continue;
+            h = log_shm_attach(fd, map_size);
+            close(fd);
+            if (h != NULL)
+                return h;
+            shm_unlink(name);
+            continue;
+        }
+        *map_size = LOG_SHM_HEAD + (size_t)slots * sizeof(struct log_shm_slot_t);
+        h = ftruncate(fd, (off_t)*map_size) != 0 ? MAP_FAILED :
+            (struct log_shm_head_t *)mmap(NULL, *map_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+        close(fd);
+        if (h == MAP_FAILED) {
+            shm_unlink(name);
+            return NULL;
+        }
+        struct log_shm_slot_t *slot = (struct log_shm_slot_t *)((char *)h + LOG_SHM_HEAD);
+        for (uint64_t i = 0; i < slots; i++)
+            slot[i].ctl = LOG_SHM_CTL(i, LOG_SHM_FREE, 0);
+        h->version = LOG_SHM_VERSION;
+        h->slots = slots;
+        memcpy(h->magic, LOG_SHM_MAGIC, sizeof(h->magic));
+        __atomic_store_n(&h->ready, 1, __ATOMIC_RELEASE);
+        return h;
+    }
+    return NULL;
+}
+
+/**
+ * log_shm_open maps the ring shared by every process logging to
+ * file_name, creating it with room for size bytes of records if it
+ * does not exist yet.
+ */
+static struct log_shm_t *
+log_shm_open(const char *file_name, size_t size)
+{
+    struct log_shm_t *shm = (struct log_shm_t *)calloc(1, sizeof(struct log_shm_t));
+    uint64_t slots = 2;
+    char name[64];
+
+    if (shm == NULL || (shm->file_name = strdup(file_name)) == NULL) {
+        perror("unable to allocation memory for shared logger");
+        free(shm);
+        return NULL;
+    }
+    while (slots * LOG_SHM_SLOT < size)
+        slots <<= 1;
+    if (log_shm_name(file_name, name, sizeof(name)) != 0 ||
+            (shm->head = log_shm_map(name, slots, &shm->map_size)) == NULL) {
+        perror("unable to open shared log ring");
+        free(shm->file_name);
+        free(shm);
+        return NULL;
+    }
+    shm->slots = (struct log_shm_slot_t *)((char *)shm->head + LOG_SHM_HEAD);
+    pthread_once(&log_shm_once, log_shm_once_init);
+    return shm;
+}
+
+/**
+ * log_shm_flush writes out the records the collector has gathered.
+ */
+static void
+log_shm_flush(struct logger_t *lg)
+{
+    struct log_shm_t *shm = lg->shm;
+    struct iovec iov = { shm->out, shm->out_len };
+    int fd = fileno(lg->output);
+    ssize_t n;
+
+    if (shm->out_len == 0)
+        return;
+    if ((n = log_writev_all(fd, &iov, 1)) > 0)
+        log_sync_commit(&lg->sync, fd, (size_t)n);
+    shm->out_len = 0;
+}
+
+static void
+log_shm_append(struct logger_t *lg, const char *data, size_t n)
+{
+    struct log_shm_t *shm = lg->shm;
+
+    if (shm->out_len + n > shm->out_cap) {
+        log_shm_flush(lg);
+        if (n > shm->out_cap) {
+            size_t cap = shm->out_cap ? shm->out_cap : LOG_SHM_OUT;
+            char *out;
+            while (cap < n)
+                cap <<= 1;
+            if ((out = (char *)realloc(shm->out, cap)) == NULL) {
+                perror("unable to allocation memory for shared log output");
+                return;
+            }
+            shm->out = out;
+            shm->out_cap = cap;
+        }
+    }
+    memcpy(shm->out + shm->out_len, data, n);
+    shm->out_len += n;
+}
+
+static struct log_shm_part_t *
+log_shm_part(struct log_shm_t *shm, uint32_t tid)
+{
+    for (size_t i = 0; i < shm->nparts; i++)
+        if (shm->parts[i].tid == tid)
+            return &shm->parts[i];
+    return NULL;
+}
+
+static void
+log_shm_part_drop(struct log_shm_t *shm, struct log_shm_part_t *p)
+{
+    free(p->data);
+    *p = shm->parts[--shm->nparts];
+}
+
+/**
+ * log_shm_take passes the slot thread tid wrote on to the output, or
+ * holds it until the last slot of its record arrives. Slots of a
+ * record whose first slot was missed, because its writer dropped the
+ * rest or an earlier collector died halfway, are thrown away.
+ */
+static void
+log_shm_take(struct logger_t *lg, uint32_t tid, const struct log_shm_slot_t *slot)
+{
+    struct log_shm_t *shm = lg->shm;
+    struct log_shm_part_t *p = shm->nparts ? log_shm_part(shm, tid) : NULL;
+    size_t len = slot->len < sizeof(slot->data) ? slot->len : sizeof(slot->data);
+
+    if (slot->flags & LOG_SHM_FIRST) {
+        if (slot->flags & LOG_SHM_LAST) {
+            if (p != NULL)
+                log_shm_part_drop(shm, p);
+            log_shm_append(lg, slot->data, len);
+            return;
+        }
+        if (p == NULL) {
+            if (shm->nparts == shm->parts_cap) {
+                size_t cap = shm->parts_cap ? 2 * shm->parts_cap : 16;
+                p = (struct log_shm_part_t *)realloc(shm->parts, cap * sizeof(*p));
+                if (p == NULL) {
+                    perror("unable to allocation memory for shared log record");
+                    return;
+                }
+                shm->parts = p;
+                shm->parts_cap = cap;
+            }
+            p = &shm->parts[shm->nparts++];
+            memset(p, 0, sizeof(*p));
+            p->tid = tid;
+        }
+        p->len = 0;
+    } else if (p == NULL) {
+        return;
+    }
+    if (p->len + len > p->cap) {
+        size_t cap = p->cap ? 2 * p->cap : 4 * sizeof(slot->data);
+        char *data;
+        while (cap < p->len + len)
+            cap <<= 1;
+        if ((data = (char *)realloc(p->data, cap)) == NULL) {
+            perror("unable to allocation memory for shared log record");
+            log_shm_part_drop(shm, p);
+            return;
+        }
+        p->data = data;
+        p->cap = cap;
+    }
+    memcpy(p->data + p->len, slot->data, len);
+    p->len += len;
+    if (slot->flags & LOG_SHM_LAST) {
+        log_shm_append(lg, p->data, p->len);
+        log_shm_part_drop(shm, p);
+    }
+}
+
+/**
+ * log_shm_idle writes out what the collector has once it finds the
+ * ring empty, then waits for more, sleeping longer the longer the ring
+ * stays empty, up to a millisecond. Now and then it throws away
+ * partial records of threads that died.
+ */
+static void
+log_shm_idle(struct logger_t *lg, unsigned int *idle)
+{
+    struct log_shm_t *shm = lg->shm;
+
+    if ((*idle)++ == 0)
+        log_shm_flush(lg);
+    if (lg->sync.mode == LOG_SYNC_PERIODIC && lg->sync.unsynced)
+        log_sync_commit(&lg->sync, fileno(lg->output), 0);
+    if (*idle < 64) {
+        sched_yield();
+        return;
+    }
+    if ((*idle & 1023) == 0) {
+        for (size_t i = 0; i < shm->nparts; )
+            if (!log_shm_alive((pid_t)shm->parts[i].tid))
+                log_shm_part_drop(shm, &shm->parts[i]);
+            else
+                i++;
+    }
+    usleep(*idle < 256 ? 50 : 1000);
+}
+
+/**
+ * log_shm_free hands the slot at pos back to writers for the next lap.
+ */
+static inline void
+log_shm_free(struct log_shm_t *shm, uint64_t pos)
+{
+    __atomic_store_n(&shm->slots[pos & (shm->head->slots - 1)].ctl,
+        LOG_SHM_CTL(pos + shm->head->slots, LOG_SHM_FREE, 0), __ATOMIC_RELEASE);
+}
+
+/**
+ * log_shm_fill takes the holes, slots the collector went past while
+ * their writers were still at them, that are finished now, and frees
+ * those whose writer has been at them for LOG_SHM_STALL_MS and turns
+ * out to have died. Returns how many holes are gone.
+ */
+static unsigned int
+log_shm_fill(struct logger_t *lg, struct log_shm_hole_t *holes, unsigned int *nholes)
+{
+    struct log_shm_t *shm = lg->shm;
+    unsigned int n = 0, done = 0;
+    uint64_t now = 0;
+
+    for (unsigned int i = 0; i < *nholes; i++) {
+        struct log_shm_slot_t *slot = &shm->slots[holes[i].pos & (shm->head->slots - 1)];
+        uint64_t ctl = __atomic_load_n(&slot->ctl, __ATOMIC_ACQUIRE);
+
+        if (LOG_SHM_CTL_STATE(ctl) == LOG_SHM_READY) {
+            log_shm_take(lg, LOG_SHM_CTL_TID(ctl), slot);
+        } else {
+            if (now == 0)
+                now = log_monotonic_ns();
+            if (now - holes[i].since < LOG_SHM_STALL_MS * 1000000ULL) {
+                holes[n++] = holes[i];
+                continue;
+            }
+            if (log_shm_alive((pid_t)LOG_SHM_CTL_TID(ctl))) {
+                holes[i].since = now;
+                holes[n++] = holes[i];
+                continue;
+            }
+            /* its writer died before finishing it */
+            struct log_shm_part_t *p = log_shm_part(shm, LOG_SHM_CTL_TID(ctl));
+            if (p != NULL)
+                log_shm_part_drop(shm, p);
+        }
+        log_shm_free(shm, holes[i].pos);
+        done++;
+    }
+    *nholes = n;
+    return done;
+}
+
+static inline int
+log_shm_hole(const struct log_shm_hole_t *holes, unsigned int nholes, uint32_t tid)
+{
+    for (unsigned int i = 0; i < nholes; i++)
+        if (holes[i].tid == tid)
+            return 1;
+    return 0;
+}
+
+static inline int
+log_shm_hole_at(const struct log_shm_hole_t *holes, unsigned int nholes, uint64_t pos)
+{
+    for (unsigned int i = 0; i < nholes; i++)
+        if (holes[i].pos == pos)
+            return 1;
+    return 0;
+}
+
+/**
+ * log_shm_oldest returns the oldest position the collector has not
+ * taken: its first hole, the first slot it left or else next.
+ */
+static inline uint64_t
+log_shm_oldest(const struct log_shm_hole_t *holes, unsigned int nholes, uint64_t left,
+    uint64_t next)
+{
+    uint64_t pos = left != 0 && left < next ? left : next;
+    return nholes != 0 && holes[0].pos < pos ? holes[0].pos : pos;
+}
+
+/**
+ * log_shm_collector is the collector thread. It takes slots in ring
+ * order as their writers finish them and frees them for reuse. A slot
+ * a writer has claimed but not finished does not hold the others up:
+ * the collector goes past it and comes back to it before it takes
+ * anything further from the same writer, which only comes once the
+ * slot is finished. Only writers wrapping around to it have to wait.
+ * dequeue is the oldest slot not taken yet.
+ *
+ * After a stop it takes what was written up to then and, past that,
+ * only the rest of records it has begun, so that the next collector
+ * starts on whole records. Should the slots it leaves fill a quarter
+ * of the ring, writers would soon wait on them, so it goes back and
+ * takes everything until no record is halfway. It gives up on writers
+ * that make no progress for LOG_SHM_WAIT_MS.
+ */
+static void *
+log_shm_collector(void *arg)
+{
+    struct logger_t *lg = (struct logger_t *)arg;
+    struct log_shm_t *shm = lg->shm;
+    struct log_shm_head_t *h = shm->head;
+    struct log_shm_hole_t holes[LOG_SHM_HOLES];
+    uint64_t next = __atomic_load_n(&h->dequeue, __ATOMIC_ACQUIRE);
+    uint64_t end = 0, left = 0, stopped = 0, seen = 0;
+    unsigned int nholes = 0, idle = 0;
+    int stopping = 0, all = 0;
+
+    for (;;) {
+        struct log_shm_slot_t *slot = &shm->slots[next & (h->slots - 1)];
+        uint64_t ctl = __atomic_load_n(&slot->ctl, __ATOMIC_ACQUIRE);
+        uint64_t at = LOG_SHM_CTL_POS(ctl);
+        uint32_t tid = LOG_SHM_CTL_TID(ctl);
+        int state = LOG_SHM_CTL_STATE(ctl);
+
+        if (!stopping && __atomic_load_n(&shm->stop, __ATOMIC_ACQUIRE)) {
+            stopping = 1;
+            end = __atomic_load_n(&h->enqueue, __ATOMIC_ACQUIRE);
+            stopped = log_monotonic_ns();
+        }
+        if (stopping && next >= end) {
+            if ((nholes == 0 && shm->nparts == 0) ||
+                    log_monotonic_ns() - stopped >= LOG_SHM_WAIT_MS * 1000000ULL)
+                break;
+            if (!all && at == (next & LOG_SHM_POS_MASK) && state != LOG_SHM_FREE &&
+                    log_shm_part(shm, tid) == NULL && !log_shm_hole(holes, nholes, tid)) {
+                /* not part of a record begun, left for the next collector */
+                if (left == 0)
+                    left = next;
+                if (++next - left >= h->slots / 4) {
+                    all = 1;
+                    seen = next;
+                    next = left;
+                    left = 0;
+                }
+                continue;
+            }
+        }
+        if (next < seen && log_shm_hole_at(holes, nholes, next)) {
+            next++;
+            continue;
+        }
+
+        if (at == ((next + h->slots) & LOG_SHM_POS_MASK)) {
+            /* taken by an earlier collector that got further */
+            next++;
+            continue;
+        } else if (at == (next & LOG_SHM_POS_MASK) && state == LOG_SHM_READY) {
+            if (log_shm_hole(holes, nholes, tid))
+                log_shm_fill(lg, holes, &nholes);
+            log_shm_take(lg, tid, slot);
+            log_shm_free(shm, next++);
+        } else if (at == (next & LOG_SHM_POS_MASK) && state == LOG_SHM_CLAIMED &&
+                nholes < LOG_SHM_HOLES) {
+            holes[nholes].pos = next++;
+            holes[nholes].tid = tid;
+            holes[nholes++].since = log_monotonic_ns();
+        } else if (nholes == 0 || log_shm_fill(lg, holes, &nholes) == 0) {
+            log_shm_idle(lg, &idle);
+            continue;
+        }
+        if (nholes && (next & 63) == 0)
+            log_shm_fill(lg, holes, &nholes);
+        if (stopping)
+            stopped = log_monotonic_ns();
+        __atomic_store_n(&h->dequeue, log_shm_oldest(holes, nholes, left, next),
+            __ATOMIC_RELEASE);
+        idle = 0;
+    }
+    __atomic_store_n(&h->dequeue, log_shm_oldest(holes, nholes, left, next),
+        __ATOMIC_RELEASE);
+    log_shm_flush(lg);
+    return NULL;
+}
+
+/**
+ * log_shm_collect makes this process the collector of lg's ring if it
+ * has none, because it is new or its collector closed its logger or
+ * died, and starts writing lg's file. lg->lock must be held.
+ */
+static void
+log_shm_collect(struct logger_t *lg)
+{
+    struct log_shm_t *shm = lg->shm;
+    int32_t cur = __atomic_load_n(&shm->head->collector, __ATOMIC_ACQUIRE);
+    int32_t self = (int32_t)getpid();
+
+    if (shm->collecting || (cur != 0 && cur != self && log_shm_alive(cur)) ||
+            !__atomic_compare_exchange_n(&shm->head->collector, &cur, self, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return;
+    if (lg->output == NULL)
+        lg->output = fopen(shm->file_name, "a");
+    shm->stop = 0;
+    if (lg->output == NULL ||
+            pthread_create(&shm->collector, NULL, log_shm_collector, lg) != 0) {
+        perror("unable to start shared log collector");
+        __atomic_store_n(&shm->head->collector, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    shm->collecting = 1;
+}
+
+static void
+log_shm_takeover(struct logger_t *lg)
+{
+    while(pthread_mutex_lock(&lg->lock) != 0){ usleep(1); }
+    if (lg->shm != NULL)
+        log_shm_collect(lg);
+    pthread_mutex_unlock(&lg->lock);
+}
+
+/**
+ * log_shm_claim claims the next free slot of lg's ring for thread tid.
+ * A writer that claimed the slot at enqueue but died before moving
+ * enqueue on is helped along. While the ring is full it waits for the
+ * collector, and makes sure there still is one; if the collector frees
+ * nothing for LOG_SHM_WAIT_MS it returns NULL.
+ */
+static struct log_shm_slot_t *
+log_shm_claim(struct logger_t *lg, uint32_t tid, uint64_t *claimed)
+{
+    struct log_shm_t *shm = lg->shm;
+    struct log_shm_head_t *h = shm->head;
+    uint64_t deadline = 0, seen = 0;
+    unsigned int spins = 0;
+
+    for (;;) {
+        uint64_t pos = __atomic_load_n(&h->enqueue, __ATOMIC_RELAXED);
+        struct log_shm_slot_t *slot = &shm->slots[pos & (h->slots - 1)];
+        uint64_t ctl = __atomic_load_n(&slot->ctl, __ATOMIC_ACQUIRE);
+        uint64_t at = LOG_SHM_CTL_POS(ctl);
+
+        if (at == (pos & LOG_SHM_POS_MASK)) {
+            if (LOG_SHM_CTL_STATE(ctl) == LOG_SHM_FREE &&
+                    __atomic_compare_exchange_n(&slot->ctl, &ctl,
+                        LOG_SHM_CTL(pos, LOG_SHM_CLAIMED, tid), 0,
+                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                *claimed = pos;
+                __atomic_compare_exchange_n(&h->enqueue, &pos, pos + 1, 0,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+                return slot;
+            }
+            if (LOG_SHM_CTL_STATE(ctl) != LOG_SHM_FREE)
+                __atomic_compare_exchange_n(&h->enqueue, &pos, pos + 1, 0,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (at != ((pos - h->slots) & LOG_SHM_POS_MASK))
+            continue;
+        /* full: the slot still holds the record from one lap ago */
+        uint64_t now = log_monotonic_ns();
+        uint64_t dequeue = __atomic_load_n(&h->dequeue, __ATOMIC_RELAXED);
+        if (deadline == 0 || dequeue != seen) {
+            if (deadline == 0) {
+                int32_t cur = __atomic_load_n(&h->collector, __ATOMIC_ACQUIRE);
+                if (cur == 0 || !log_shm_alive(cur))
+                    log_shm_takeover(lg);
+            }
+            seen = dequeue;
+            deadline = now + LOG_SHM_WAIT_MS * 1000000ULL;
+            spins = 0;
+        } else if (now > deadline) {
+            return NULL;
+        }
+        if (++spins < 64)
+            sched_yield();
+        else
+            usleep(50);
+    }
+}
+
+/**
+ * log_shm_check makes sure lg's ring has a collector. One writer per
+ * LOG_SHM_WAIT_MS looks whether the one it has is still alive, so a
+ * collector that died is replaced even while the ring has room.
+ */
+static void
+log_shm_check(struct logger_t *lg)
+{
+    struct log_shm_t *shm = lg->shm;
+    int32_t cur = __atomic_load_n(&shm->head->collector, __ATOMIC_RELAXED);
+    uint64_t now, at;
+
+    if (cur == 0) {
+        log_shm_takeover(lg);
+        return;
+    }
+    if (__atomic_load_n(&shm->collecting, __ATOMIC_RELAXED))
+        return;
+    now = log_monotonic_ns();
+    at = __atomic_load_n(&shm->check_at, __ATOMIC_RELAXED);
+    if (now < at || !__atomic_compare_exchange_n(&shm->check_at, &at,
+            now + LOG_SHM_WAIT_MS * 1000000ULL, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+    if (!log_shm_alive(cur))
+        log_shm_takeover(lg);
+}
+
+/**
+ * log_shm_write copies a record into lg's ring, cut into as many slots
+ * as it takes. Each slot is published on its own, so the collector
+ * puts records back together by writer.
+ */
+static int
+log_shm_write(struct logger_t *lg, const char *str, size_t len)
+{
+    struct log_shm_head_t *h = lg->shm->head;
+    uint32_t tid = log_shm_tid(), flags = LOG_SHM_FIRST;
+    size_t off = 0;
+
+    log_shm_check(lg);
+    do {
+        struct log_shm_slot_t *slot;
+        uint64_t pos;
+        size_t n;
+
+        if ((slot = log_shm_claim(lg, tid, &pos)) == NULL) {
+            __atomic_add_fetch(&h->dropped, 1, __ATOMIC_RELAXED);
+            return LOG_NO_ACTION;
+        }
+        n = len - off < sizeof(slot->data) ? len - off : sizeof(slot->data);
+        memcpy(slot->data, str + off, n);
+        off += n;
+        slot->len = (uint32_t)n;
+        slot->flags = flags | (off == len ? LOG_SHM_LAST : 0);
+        __atomic_store_n(&slot->ctl, LOG_SHM_CTL(pos, LOG_SHM_READY, tid), __ATOMIC_RELEASE);
+        flags = 0;
+    } while (off < len);
+    log_stats_count(bytes, (uint64_t)len);
+    return (int)len;
+}
+
+/**
+ * log_shm_close detaches lg from its ring. Any other process first
+ * waits for the collector to take what this one wrote, and becomes
+ * the collector itself if the role comes free meanwhile. A collector
+ * writes out what its writers finished and gives the role up to
+ * whichever process writes next, then closes the file. The ring
+ * itself stays, with what is left in it, for the next process to log
+ * to the file.
+ */
+static int
+log_shm_close(struct logger_t *lg)
+{
+    struct log_shm_t *shm = lg->shm;
+    struct log_shm_head_t *h = shm->head;
+    uint64_t written = __atomic_load_n(&h->enqueue, __ATOMIC_ACQUIRE);
+    uint64_t seen = 0, deadline = 0;
+    int wc = LOG_CLOSE;
+
+    while (!shm->collecting) {
+        uint64_t dequeue = __atomic_load_n(&h->dequeue, __ATOMIC_ACQUIRE);
+        uint64_t now = log_monotonic_ns();
+        int32_t cur = __atomic_load_n(&h->collector, __ATOMIC_ACQUIRE);
+
+        if (dequeue >= written)
+            break;
+        if (deadline == 0 || dequeue != seen) {
+            seen = dequeue;
+            deadline = now + LOG_SHM_WAIT_MS * 1000000ULL;
+        } else if (now > deadline && cur != 0 && log_shm_alive(cur)) {
+            break;
+        }
+        if (cur == 0 || now > deadline)
+            log_shm_collect(lg);
+        else
+            usleep(50);
+    }
+    if (shm->collecting) {
+        int32_t self = (int32_t)getpid();
+        __atomic_store_n(&shm->stop, 1, __ATOMIC_RELEASE);
+        pthread_join(shm->collector, NULL);
+        shm->collecting = 0;
+        __atomic_compare_exchange_n(&shm->head->collector, &self, 0, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&lg->shm, NULL, __ATOMIC_RELEASE);
+    if (lg->output) {
+        if (lg->sync.mode != LOG_SYNC_NONE && lg->sync.unsynced) {
+            LOG_FDATASYNC(fileno(lg->output));
+            lg->sync.unsynced = 0;
+        }
+        if (fclose(lg->output) != 0)
+            wc = LOG_FAIL;
+        lg->output = NULL;
+    }
+    munmap(shm->head, shm->map_size);
+    for (size_t i = 0; i < shm->nparts; i++)
+        free(shm->parts[i].data);
+    free(shm->parts);
+    free(shm->out);
+    free(shm->file_name);
+    free(shm);
+    return wc;
+}
+#endif
+
+#ifdef THREAD_ENABLE
+/**
+ * log_rot_background lowers the CPU and I/O priority of the calling
+ * thread, so that compressing sealed files stays out of the way of
+ * the writers. Only Linux can do that for a single thread.
+ */
+static void
+log_rot_background()
+{
+#ifdef __linux__
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+#ifdef SYS_ioprio_set
+    /* best effort class, lowest level */
+    syscall(SYS_ioprio_set, 1, 0, 2 << 13 | 7);
+#endif
+#endif
+}
+
+/**
+ * log_rot_sealed returns the length of name if it is, up to a .gz
+ * suffix, a file sealed from base, base.YYYYmmdd-HHMMSS[_NNN], or 0.
+ */
+static size_t
+log_rot_sealed(const char *base, const char *name)
+{
+    size_t n = strlen(base), i;
+
+    if (strncmp(name, base, n) != 0 || name[n] != '.')
+        return 0;
+    for (i = n + 1; i < n + 16; i++)
+        if (i == n + 9 ? name[i] != '-' : (name[i] < '0' || name[i] > '9'))
+            return 0;
+    if (name[i] == '_' && name[i + 1] >= '0' && name[i + 1] <= '9')
+        for (i++; name[i] >= '0' && name[i] <= '9'; i++)
+            ;
+    return i;
+}
+
+/**
+ * log_rot_name returns a name to seal rot's file under, its name with
+ * the UTC time appended, and a sequence number if that is taken, so
+ * that sealed files sort in the order they were sealed.
+ */
+static char *
+log_rot_name(const struct log_rot_t *rot)
+{
+    size_t cap = strlen(rot->file_name) + 24;
+    char stamp[16], *name = (char *)malloc(cap + 3);
+    time_t now = time(NULL);
+    struct stat st;
+    struct tm tm;
+
+    if (name == NULL)
+        return NULL;
+    gmtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    for (unsigned int i = 0; i < 1000; i++) {
+        size_t len;
+        int taken;
+        if (i == 0)
+            snprintf(name, cap, "%s.%s", rot->file_name, stamp);
+        else
+            snprintf(name, cap, "%s.%s_%03u", rot->file_name, stamp, i);
+        len = strlen(name);
+        taken = stat(name, &st) == 0;
+        memcpy(name + len, ".gz", 4);
+        taken |= stat(name, &st) == 0;
+        name[len] = '\0';
+        if (!taken)
+            return name;
+    }
+    free(name);
+    errno = EEXIST;
+    return NULL;
+}
+
+/**
+ * log_rot_queue hands the sealed file path to the cleaner thread.
+ */
+static void
+log_rot_queue(struct log_rot_t *rot, const char *path)
+{
+    char *copy = strdup(path);
+
+    pthread_mutex_lock(&rot->lock);
+    if (copy != NULL && rot->npending == rot->pending_cap) {
+        size_t cap = rot->pending_cap ? 2 * rot->pending_cap : 8;
+        char **pending = (char **)realloc(rot->pending, cap * sizeof(char *));
+        if (pending != NULL) {
+            rot->pending = pending;
+            rot->pending_cap = cap;
+        } else {
+            free(copy);
+            copy = NULL;
+        }
+    }
+    if (copy != NULL)
+        rot->pending[rot->npending++] = copy;
+    else
+        perror("unable to allocation memory for log rotation");
+    pthread_cond_signal(&rot->work);
+    pthread_mutex_unlock(&rot->lock);
+}
+
+/**
+ * log_rot_remove deletes the sealed file path, compressed or not, and
+ * takes it off the pending ones.
+ */
+static void
+log_rot_remove(struct log_rot_t *rot, char *path)
+{
+    size_t len = strlen(path);
+
+    pthread_mutex_lock(&rot->lock);
+    for (size_t i = 0; i < rot->npending; i++) {
+        if (strcmp(rot->pending[i], path) == 0) {
+            free(rot->pending[i]);
+            memmove(rot->pending + i, rot->pending + i + 1,
+                (rot->npending - i - 1) * sizeof(char *));
+            rot->npending--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rot->lock);
+    unlink(path);
+    memcpy(path + len, ".gz", 4);
+    unlink(path);
+    path[len] = '\0';
+}
+
+static int
+log_rot_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * log_rot_scan deletes all but the keep most recent files sealed from
+ * rot's file, if keep is set. At startup it also queues those an
+ * earlier run left uncompressed and removes its unfinished .gz files.
+ */
+static void
+log_rot_scan(struct log_rot_t *rot, int startup)
+{
+    const char *slash = strrchr(rot->file_name, '/');
+    size_t dir_len = slash ? (size_t)(slash - rot->file_name) + 1 : 0;
+    const char *base = rot->file_name + dir_len;
+    char **sealed = NULL;
+    size_t n = 0, cap = 0, m = 0;
+    struct dirent *e;
+    char *dir;
+    DIR *d;
+
+    if ((dir = strndup(rot->file_name, dir_len)) == NULL)
+        return;
+    if ((d = opendir(dir_len ? dir : ".")) == NULL) {
+        free(dir);
+        return;
+    }
+    while ((e = readdir(d)) != NULL) {
+        size_t len = log_rot_sealed(base, e->d_name);
+        const char *rest = e->d_name + len;
+        char *path;
+
+        if (len == 0 || (*rest != '\0' && strcmp(rest, ".gz") != 0 &&
+                strcmp(rest, ".gz.tmp") != 0))
+            continue;
+        if ((path = (char *)malloc(dir_len + len + 8)) == NULL)
+            break;
+        snprintf(path, dir_len + len + 8, "%s%s", dir, e->d_name);
+        if (strcmp(rest, ".gz.tmp") == 0) {
+            if (startup)
+                unlink(path);
+            free(path);
+            continue;
+        }
+        path[dir_len + len] = '\0';
+#ifdef HAVE_ZLIB
+        if (startup && *rest == '\0')
+            log_rot_queue(rot, path);
+#endif
+        if (n == cap) {
+            char **grown = (char **)realloc(sealed, (cap ? 2 * cap : 16) * sizeof(char *));
+            if (grown == NULL) {
+                free(path);
+                break;
+            }
+            sealed = grown;
+            cap = cap ? 2 * cap : 16;
+        }
+        sealed[n++] = path;
+    }
+    closedir(d);
+    free(dir);
+
+    /* a file and its .gz count once */
+    if (n > 0)
+        qsort(sealed, n, sizeof(char *), log_rot_cmp);
+    for (size_t i = 0; i < n; i++) {
+        if (m > 0 && strcmp(sealed[m - 1], sealed[i]) == 0)
+            free(sealed[i]);
+        else
+            sealed[m++] = sealed[i];
+    }
+    for (size_t i = 0; i < m; i++) {
+        if (rot->keep && i + rot->keep < m)
+            log_rot_remove(rot, sealed[i]);
+        free(sealed[i]);
+    }
+    free(sealed);
+}
+
+/**
+ * log_rot_due tells whether lg's file is to be rotated now.
+ */
+static inline int
+log_rot_due(struct log_rot_t *rot)
+{
+    return __atomic_load_n(&rot->due, __ATOMIC_ACQUIRE) &&
+        (rot->retry == 0 || time(NULL) >= rot->retry);
+}
+
+/**
+ * log_rot_settle waits until the async writer of lg has written every
+ * record queued so far, if it is running.
+ */
+static void
+log_rot_settle(struct logger_t *lg)
+{
+    struct log_async_t *q = &lg->async;
+    size_t last = __atomic_load_n(&q->enqueue_pos, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&q->lock);
+    __atomic_add_fetch(&q->sync_waiters, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&q->running, __ATOMIC_SEQ_CST) &&
+            __atomic_load_n(&q->durable, __ATOMIC_SEQ_CST) < last)
+        log_async_wait(q, &q->synced, 10);
+    __atomic_sub_fetch(&q->sync_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * log_rot_rotate seals lg's file. It renames the file and opens a new
+ * one under its name, while writers go on with the old one, then swaps
+ * the new one in as soon as nobody is writing, which only takes a
+ * pointer flip. With the binary serializer, new records are held up
+ * meanwhile until those built for the old file have reached it. The
+ * sealed file goes to the cleaner. Returns 0, or -1 if no new file
+ * could be opened, in which case lg keeps the old one and the rotation
+ * is tried again a second later.
+ */
+static int
+log_rot_rotate(struct logger_t *lg)
+{
+    struct log_rot_t *rot = lg->rot;
+    char *sealed = log_rot_name(rot);
+    int renamed = 0, hold = lg->serializer == LOG_SERIALIZE_BINARY;
+    FILE *out, *old;
+
+    if (sealed != NULL && rename(rot->file_name, sealed) == 0)
+        renamed = 1;
+    else if (sealed == NULL || errno != ENOENT)
+        goto fail;
+    /* with ENOENT the file was removed from under us: only reopen it */
+    if ((out = fopen(rot->file_name, "a+")) == NULL) {
+        if (renamed)
+            rename(sealed, rot->file_name);
+        goto fail;
+    }
+
+    if (hold) {
+        /* binary frames built for the old file must all land in it */
+        __atomic_store_n(&lg->bin_hold, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&lg->bin_active, __ATOMIC_SEQ_CST) != 0)
+            sched_yield();
+        log_rot_settle(lg);
+    }
+
+    while(pthread_mutex_lock(&lg->lock) != 0){ usleep(1); }
+    while (lg->batch.writing)
+        pthread_cond_wait(&lg->batch.done, &lg->lock);
+    old = lg->output;
+    lg->output = out;
+    rot->gen++;
+    log_bin_restart(lg);
+    __atomic_store_n(&rot->written, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&rot->due, 0, __ATOMIC_RELEASE);
+    rot->retry = 0;
+    pthread_mutex_unlock(&lg->lock);
+    if (hold) {
+        pthread_mutex_lock(&rot->lock);
+        __atomic_store_n(&lg->bin_hold, 0, __ATOMIC_SEQ_CST);
+        pthread_cond_broadcast(&rot->resume);
+        pthread_mutex_unlock(&rot->lock);
+    }
+
+    if (lg->sync.mode != LOG_SYNC_NONE)
+        LOG_FDATASYNC(fileno(old));
+    fclose(old);
+    if (renamed)
+        log_rot_queue(rot, sealed);
+    free(sealed);
+    return 0;
+
+fail:
+    perror("unable to rotate log file");
+    free(sealed);
+    rot->retry = time(NULL) + 1;
+    return -1;
+}
+
+/**
+ * log_rot_compress gzips the sealed file path into path.gz and removes
+ * path. Returns 0, or -1 if it failed or lg is closing, leaving path
+ * as it was.
+ */
+static int
+log_rot_compress(struct logger_t *lg, const char *path)
+{
+#ifdef HAVE_ZLIB
+    struct log_rot_t *rot = lg->rot;
+    size_t len = strlen(path);
+    char *tmp = (char *)malloc(len + 8), *done = (char *)malloc(len + 4);
+    char *buf = (char *)malloc(LOG_ROTATE_CHUNK);
+    int in = -1, fd = -1, gz_fd = -1, wc = -1;
+    gzFile gz = NULL;
+    ssize_t n;
+
+    if (tmp == NULL || done == NULL || buf == NULL) {
+        perror("unable to allocation memory for log compression");
+        goto out;
+    }
+    snprintf(tmp, len + 8, "%s.gz.tmp", path);
+    snprintf(done, len + 4, "%s.gz", path);
+    if ((in = open(path, O_RDONLY | O_CLOEXEC)) < 0 ||
+            (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ||
+            (gz_fd = dup(fd)) < 0 || (gz = gzdopen(gz_fd, "wb")) == NULL) {
+        perror(path);
+        if (gz_fd >= 0)
+            close(gz_fd);
+        goto out;
+    }
+    while ((n = read(in, buf, LOG_ROTATE_CHUNK)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || gzwrite(gz, buf, (unsigned int)n) != (int)n) {
+            perror(path);
+            goto out;
+        }
+        if (__atomic_load_n(&rot->stop, __ATOMIC_ACQUIRE))
+            goto out;
+    }
+    n = gzclose(gz);
+    gz = NULL;
+    if (n != Z_OK) {
+        perror(tmp);
+        goto out;
+    }
+    if (lg->sync.mode != LOG_SYNC_NONE)
+        LOG_FDATASYNC(fd);
+    if (rename(tmp, done) != 0) {
+        perror(tmp);
+        goto out;
+    }
+    unlink(path);
+    wc = 0;
+out:
+    if (gz != NULL)
+        gzclose(gz);
+    if (fd >= 0)
+        close(fd);
+    if (in >= 0)
+        close(in);
+    if (wc != 0 && tmp != NULL)
+        unlink(tmp);
+    free(tmp);
+    free(done);
+    free(buf);
+    return wc;
+#else
+    (void)lg;
+    (void)path;
+    return -1;
+#endif
+}
+
+/**
+ * log_rot_rotator is the rotator thread of lg. It rotates lg's file
+ * when writers find it full and at every multiple of the interval
+ * since the epoch, if anything was written since the last time.
+ */
+static void *
+log_rot_rotator(void *arg)
+{
+    struct logger_t *lg = (struct logger_t *)arg;
+    struct log_rot_t *rot = lg->rot;
+    time_t next = rot->interval ? (time(NULL) / rot->interval + 1) * rot->interval : 0;
+
+    while (!__atomic_load_n(&rot->stop, __ATOMIC_ACQUIRE)) {
+        time_t now = time(NULL), wake = next;
+
+        if (next && now >= next) {
+            if (__atomic_load_n(&rot->written, __ATOMIC_RELAXED) > 0)
+                __atomic_store_n(&rot->due, 1, __ATOMIC_RELEASE);
+            next = (now / rot->interval + 1) * rot->interval;
+            continue;
+        }
+        if (log_rot_due(rot)) {
+            log_rot_rotate(lg);
+            continue;
+        }
+        pthread_mutex_lock(&rot->lock);
+        if (rot->due && rot->retry && (wake == 0 || rot->retry < wake))
+            wake = rot->retry;
+        if (!rot->stop && !log_rot_due(rot)) {
+            if (wake) {
+                struct timespec ts = { wake, 0 };
+                pthread_cond_timedwait(&rot->wake, &rot->lock, &ts);
+            } else {
+                pthread_cond_wait(&rot->wake, &rot->lock);
+            }
+        }
+        pthread_mutex_unlock(&rot->lock);
+    }
+    return NULL;
+}
+
+/**
+ * log_rot_cleaner is the cleaner thread of lg. At a low priority, it
+ * compresses the files the rotator sealed and then applies the
+ * retention.
+ */
+static void *
+log_rot_cleaner(void *arg)
+{
+    struct logger_t *lg = (struct logger_t *)arg;
+    struct log_rot_t *rot = lg->rot;
+
+    log_rot_background();
+    log_rot_scan(rot, 1);
+    pthread_mutex_lock(&rot->lock);
+    while (!rot->stop) {
+        char *path;
+
+        if (rot->npending == 0) {
+            pthread_cond_wait(&rot->work, &rot->lock);
+            continue;
+        }
+        path = rot->pending[0];
+        memmove(rot->pending, rot->pending + 1, --rot->npending * sizeof(char *));
+        pthread_mutex_unlock(&rot->lock);
+
+        if (log_rot_compress(lg, path) != 0 && __atomic_load_n(&rot->stop, __ATOMIC_ACQUIRE)) {
+            /* left as it is for the next run */
+            free(path);
+            pthread_mutex_lock(&rot->lock);
+            break;
+        }
+        free(path);
+        log_rot_scan(rot, 0);
+        pthread_mutex_lock(&rot->lock);
+    }
+    pthread_mutex_unlock(&rot->lock);
+    return NULL;
+}
+
+/**
+ * log_rot_start starts the threads of lg's rotation. Returns 0 or -1.
+ */
+static int
+log_rot_start(struct logger_t *lg)
+{
+    struct log_rot_t *rot = lg->rot;
+
+    if (pthread_create(&rot->cleaner, NULL, log_rot_cleaner, lg) != 0)
+        return -1;
+    if (pthread_create(&rot->rotator, NULL, log_rot_rotator, lg) != 0) {
+        pthread_mutex_lock(&rot->lock);
+        __atomic_store_n(&rot->stop, 1, __ATOMIC_RELEASE);
+        pthread_cond_signal(&rot->work);
+        pthread_mutex_unlock(&rot->lock);
+        pthread_join(rot->cleaner, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * log_rot_stop stops lg's rotation threads. Sealed files not
+ * compressed yet are left for the next run.
+ */
+static void
+log_rot_stop(struct logger_t *lg)
+{
+    struct log_rot_t *rot = lg->rot;
+
+    if (rot == NULL || rot->stop)
+        return;
+    pthread_mutex_lock(&rot->lock);
+    __atomic_store_n(&rot->stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&rot->wake);
+    pthread_cond_signal(&rot->work);
+    pthread_mutex_unlock(&rot->lock);
+    pthread_join(rot->rotator, NULL);
+    pthread_join(rot->cleaner, NULL);
+}
+
+static void
+log_rot_free(struct log_rot_t *rot)
+{
+    for (size_t i = 0; i < rot->npending; i++)
+        free(rot->pending[i]);
+    free(rot->pending);
+    pthread_mutex_destroy(&rot->lock);
+    pthread_cond_destroy(&rot->wake);
+    pthread_cond_destroy(&rot->work);
+    pthread_cond_destroy(&rot->resume);
+    free(rot->file_name);
+    free(rot);
+}
+#endif
+
+/**
+ * log_write_line writes one serialized record of len bytes, which must
+ * already end in a newline, to lg's sinks and to lg itself: through
+ * the async writer, to its flight recorder, shard, segment or shared
+ * ring, or through the write batch. If borrowed is 0 it takes
+ * ownership of str, otherwise str stays with the caller and is copied
+ * when it has to outlive the call.
+ */
+static int
+log_write_line(struct logger_t *lg, char *str, size_t len, int borrowed)
+{
+    int wc;
+
+    log_stats_end(str != NULL);
+    if (str == NULL)
+        return LOG_NO_ACTION;
+
+#ifdef THREAD_ENABLE
+    int fanned = 0;
+    if (__atomic_load_n(&lg->sinks, __ATOMIC_ACQUIRE) != NULL)
+        fanned = log_sinks_write(lg, str, len);
+    if (lg->shard_fds == NULL && __atomic_load_n(&lg->async.running, __ATOMIC_RELAXED)) {
+        char *data = str;
+        if (borrowed) {
+            data = (char *)malloc(len);
+            if (data == NULL) {
+                perror("unable to allocation memory for record");
+                log_stats_count(dropped, 1);
+                return LOG_NO_ACTION;
+            }
+            memcpy(data, str, len);
+        }
+        switch (log_async_push(lg, data, len, NULL)) {
+            case 1:
+                log_stats_count(records, 1);
+                return (int)len;
+            case 0:
+                return LOG_NO_ACTION;
+            default:
+                if (borrowed)
+                    free(data);
+                break;
+        }
+    }
+    struct log_rec_t *rec = __atomic_load_n(&lg->rec, __ATOMIC_ACQUIRE);
+    if (rec != NULL)
+        wc = log_rec_write(rec, str, len);
+    else if (lg->shard_fds != NULL)
+        wc = log_shard_write(lg, str, len);
+    else if (lg->seg_size != 0)
+        wc = log_seg_write(lg, str, len);
+#ifdef LOG_HAVE_SHM
+    else if (lg->shm != NULL)
+        wc = log_shm_write(lg, str, len);
+#endif
+    else
+        wc = log_batch_write(lg, str, len);
+    if (wc == LOG_NO_ACTION && fanned)
+        wc = (int)len;
+#else
+    struct log_rec_t *rec = __atomic_load_n(&lg->rec, __ATOMIC_ACQUIRE);
+    if (rec != NULL)
+        wc = log_rec_write(rec, str, len);
+    else if (lg->shard_fds != NULL)
+        wc = log_shard_write(lg, str, len);
+    else if (lg->seg_size != 0)
+        wc = log_seg_write(lg, str, len);
+    else if(lg->output){
+        struct iovec iov = { str, len };
+        int fd = fileno(lg->output);
+        wc = (int)log_out_writev(lg, fd, &iov, 1);
+        if (wc > 0)
+            log_out_commit(lg, fd, (size_t)wc);
+    }
+    else
+        wc = LOG_NO_ACTION;
+#endif
+
+    if (!borrowed)
+        free(str);
+    if (wc == (int)len)
+        log_stats_count(records, 1);
+    else
+        log_stats_count(dropped, 1);
+    return wc;
+}
+
+/**
+ * logger_set_serializer picks the log_serializer_types value lg uses
+ * for its records. Returns 0, or -1 with errno set to EINVAL for
+ * LOG_SERIALIZE_BINARY on a block file, see log_init_blocks.
+ */
+int
+logger_set_serializer(struct logger_t *lg, int serializer)
+{
+    if (lg->blk != NULL && serializer == LOG_SERIALIZE_BINARY) {
+        errno = EINVAL;
+        return -1;
+    }
+    lg->serializer = serializer;
+    return 0;
+}
+
+int
+log_set_serializer(int serializer)
+{
+    return logger_set_serializer(&log_default, serializer);
+}
+
+/**
+ * logger_set_io_backend picks the log_io_types value lg's async writer
+ * uses. It takes effect when the writer is started.
+ */
+void
+logger_set_io_backend(struct logger_t *lg, int backend)
+{
+    lg->io_backend = backend;
+}
+
+void
+log_set_io_backend(int backend)
+{
+    logger_set_io_backend(&log_default, backend);
+}
+
+/**
+ * log_set_utf8_check turns UTF-8 validation of string values and keys
+ * on or off. Only turn it off for trusted input: invalid UTF-8 then
+ * ends up in the log as is instead of failing the record.
+ */
+void
+log_set_utf8_check(int enabled)
+{
+    log_utf8_check = enabled;
+}
+
+/**
+ * logger_shards_init sets lg up to write count shards named after
+ * file_name. The shard files are created as they are first written.
+ */
+static int
+logger_shards_init(struct logger_t *lg, const char *file_name, int shard,
+    unsigned int count)
+{
+    if (count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_CONF);
+        count = (shard == LOG_SHARD_CPU && cpus > 0) ? (unsigned int)cpus : LOG_SHARD_THREADS;
+    }
+    lg->shard_fds = (int *)malloc(count * sizeof(int));
+    lg->shard_base = strdup(file_name);
+    if (lg->shard_fds == NULL || lg->shard_base == NULL) {
+        perror("unable to allocation memory for log shards");
+        free(lg->shard_fds);
+        free(lg->shard_base);
+        lg->shard_fds = NULL;
+        lg->shard_base = NULL;
+        return LOG_FAIL;
+    }
+    for (unsigned int i = 0; i < count; i++)
+        lg->shard_fds[i] = -1;
+    lg->shard = shard;
+    lg->shard_count = count;
+    return LOG_OPEN;
+}
+
+/**
+ * logger_segs_init sets lg up to write segments of size bytes, rounded
+ * up to whole pages, named after file_name, and opens the first one.
+ */
+static int
+logger_segs_init(struct logger_t *lg, const char *file_name, size_t size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    lg->seg_size = (size + page - 1) / page * page;
+    if ((lg->seg_base = strdup(file_name)) == NULL) {
+        perror("unable to allocation memory for log segments");
+        return LOG_FAIL;
+    }
+    if ((lg->segs = log_seg_open(lg, 0)) == NULL) {
+        free(lg->seg_base);
+        lg->seg_base = NULL;
+        lg->seg_size = 0;
+        return LOG_FAIL;
+    }
+    lg->seg_cur = lg->segs;
+    return LOG_OPEN;
+}
+
+/**
+ * logger_init opens file_name for lg, or sets up its segments if
+ * segment_size is not 0 or its shards if shard is one of the
+ * log_shard_types other than LOG_SHARD_NONE. Returns LOG_NO_ACTION if
+ * lg is already open.
+ */
+static int
+logger_init(struct logger_t *lg, const char *file_name, int shard,
+    unsigned int shard_count, size_t segment_size)
+{
+    int wc;
+#ifdef THREAD_ENABLE
+    while(pthread_mutex_lock(&lg->lock) != 0){ usleep(1); }
+#endif
+    if(lg->output || lg->shard_fds || lg->segs || lg->rec || lg->shm)
+        wc = LOG_NO_ACTION;
+    else if (segment_size != 0)
+        wc = logger_segs_init(lg, file_name, segment_size);
+    else if (shard != LOG_SHARD_NONE)
+        wc = logger_shards_init(lg, file_name, shard, shard_count);
+    else {
+        lg->output = fopen(file_name, "a+");
+        wc = (lg->output != NULL) ? LOG_OPEN : LOG_FAIL;
+    }
+    if (wc == LOG_OPEN)
+        log_bin_restart(lg);
+#ifdef THREAD_ENABLE
+    pthread_mutex_unlock(&lg->lock);
+#endif
+    return wc;
+}
+
+/**
+ * logger_rec_init sets lg up to keep its records in a flight recorder
+ * dumped to file_name, see log_init_recorder.
+ */
+static int
+logger_rec_init(struct logger_t *lg, const char *file_name, size_t size,
+    const char *ring_path)
+{
+    struct log_rec_t *rec;
+    int wc;
+#ifdef THREAD_ENABLE
+    while(pthread_mutex_lock(&lg->lock) != 0){ usleep(1); }
+#endif
+    if (lg->output || lg->shard_fds || lg->segs || lg->rec || lg->shm)
+        wc = LOG_NO_ACTION;
+    else if ((rec = log_rec_open(file_name, size ? size : LOG_RECORDER_SIZE, ring_path)) == NULL)
+        wc = LOG_FAIL;
+    else {
+        log_bin_restart(lg);
+        __atomic_store_n(&lg->rec, rec, __ATOMIC_RELEASE);
+        wc = LOG_OPEN;
+    }
+#ifdef THREAD_ENABLE
+    pthread_mutex_unlock(&lg->lock);
+#endif
+    return wc;
+}
+
+/**
+ * logger_shm_init sets lg up to write to the ring shared by every
+ * process logging to file_name, see log_init_shared. Without shared
+ * rings lg writes file_name itself.
+ */
+static int
+logger_shm_init(struct logger_t *lg, const char *file_name, size_t size)
+{
+#ifdef LOG_HAVE_SHM
+    struct log_shm_t *shm;
+    int wc;
+
+    while(pthread_mutex_lock(&lg->lock) != 0){ usleep(1); }
+    if (lg->output || lg->shard_fds || lg->segs || lg->rec || lg->shm)
+        wc = LOG_NO_ACTION;
+    else if ((shm = log_shm_open(file_name, size ? size : LOG_SHARED_SIZE)) == NULL)
+        wc = LOG_FAIL;
+    else {
+        log_bin_restart(lg);
+        __atomic_store_n(&lg->shm, shm, __ATOMIC_RELEASE);
+        log_shm_collect(lg);
+        wc = LOG_OPEN;
+    }
+    pthread_mutex_unlock(&lg->lock);
+    return wc;
+#else
+    return logger_init(lg, file_name, LOG_SHARD_NONE, 0, 0);
+#endif
+}
+
+/**
+ * logger_rot_init opens file_name for lg and rotates it every size
+ * bytes and interval seconds, see log_init_rotating. Without threads
+ * lg writes file_name without rotating it.
+ */
+static int
+logger_rot_init(struct logger_t *lg, const char *file_name, size_t size,
+    unsigned int interval, unsigned int keep)
+{
+#ifdef THREAD_ENABLE
+    struct log_rot_t *rot;
+    struct stat st;
+    int wc;
+
+    if (size == 0 && interval == 0)
+        return logger_init(lg, file_name, LOG_SHARD_NONE, 0, 0);
+    while(pthread_mutex_lock(&lg->lock) != 0){ usleep(1); }
+    if (lg->output || lg->shard_fds || lg->segs || lg->rec || lg->shm) {
+        wc = LOG_NO_ACTION;
+    } else if ((rot = (struct log_rot_t *)calloc(1, sizeof(struct log_rot_t))) == NULL ||
+            (rot->file_name = strdup(file_name)) == NULL) {
+        perror("unable to allocation memory for log rotation");
+        free(rot);
+        wc = LOG_FAIL;
+    } else if ((lg->output = fopen(file_name, "a+")) == NULL) {
+        free(rot->file_name);
+        free(rot);
+        wc = LOG_FAIL;
+    } else {
+        rot->size = size;
+        rot->interval = interval;
+        rot->keep = keep;
+        rot->written = fstat(fileno(lg->output), &st) == 0 ? (size_t)st.st_size : 0;
+        pthread_mutex_init(&rot->lock, NULL);
+        pthread_cond_init(&rot->wake, NULL);
+        pthread_cond_init(&rot->work, NULL);
+        pthread_cond_init(&rot->resume, NULL);
+        lg->rot = rot;
+        if (log_rot_start(lg) != 0) {
+            perror("unable to start log rotation");
+            lg->rot = NULL;
+            log_rot_free(rot);
+            fclose(lg->output);
+            lg->output = NULL;
+            wc = LOG_FAIL;
+        } else {
+            log_bin_restart(lg);
+            wc = LOG_OPEN;
+        }
+    }
+    pthread_mutex_unlock(&lg->lock);
+    return wc;
+#else
+    (void)size;
+    (void)interval;
+    (void)keep;
+    return logger_init(lg, file_name, LOG_SHARD_NONE, 0, 0);
+#endif
+}
+
+/**
+ * logger_blk_init opens file_name for lg to be written as blocks of
+ * block_size bytes of records, see log_init_blocks.
+ */
+static int
+logger_blk_init(struct logger_t *lg, const char *file_name, size_t block_size)
+{
+    struct log_blk_t *bk;
+    int fd, wc;
+#ifdef THREAD_ENABLE
+    while(pthread_mutex_lock(&lg->lock) != 0){ usleep(1); }
+#endif
+    if (lg->output || lg->shard_fds || lg->segs || lg->rec || lg->shm)
+        wc = LOG_NO_ACTION;
+    else if (lg->serializer == LOG_SERIALIZE_BINARY) {
+        errno = EINVAL;
+        wc = LOG_FAIL;
+    } else if ((fd = open(file_name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+        wc = LOG_FAIL;
+    else if ((bk = log_blk_open(file_name, fd, block_size ? block_size : LOG_BLOCK_SIZE)) == NULL) {
+        close(fd);
+        wc = LOG_FAIL;
+    } else if ((lg->output = fdopen(fd, "a+")) == NULL) {
+        log_blk_free(bk);
+        close(fd);
+        wc = LOG_FAIL;
+    } else {
+        lg->blk = bk;
+        wc = LOG_OPEN;
+    }
+#ifdef THREAD_ENABLE
+    pthread_mutex_unlock(&lg->lock);
+#endif
+    return wc;
+}
+
+/**
+ * logger_shutdown flushes whatever lg and its sinks still have queued
+ * or batched, syncs it if a durability mode is set and closes its
+ * file and sinks.
+ */
+static int
+logger_shutdown(struct logger_t *lg)
+{
+    int wc;
+#ifdef THREAD_ENABLE
+    struct log_sink_t *s = __atomic_exchange_n(&lg->sinks, NULL, __ATOMIC_SEQ_CST);
+    /* writers that still see the sinks are done with them once this drops to 0 */
+    while (s != NULL && __atomic_load_n(&lg->sinks_active, __ATOMIC_SEQ_CST) != 0)
+        sched_yield();
+    while (s != NULL) {
+        struct log_sink_t *next = s->next;
+        logger_shutdown(&s->out);
+        free(s->out.batch.iov);
+        free(s->out.batch.spare);
+        free(s);
+        s = next;
+    }
+    log_async_stop(lg);
+    log_rot_stop(lg);
+    while(pthread_mutex_lock(&lg->lock) != 0){ usleep(1); }
+    while (lg->batch.writing || lg->batch.count) {
+        if (!lg->batch.writing)
+            log_batch_flush_locked(lg);
+        else
+            pthread_cond_wait(&lg->batch.done, &lg->lock);
+    }
+#endif
+    if (lg->shard_fds) {
+        wc = LOG_CLOSE;
+        for (unsigned int i = 0; i < lg->shard_count; i++) {
+            if (lg->shard_fds[i] < 0)
+                continue;
+            if (lg->sync.mode != LOG_SYNC_NONE)
+                LOG_FDATASYNC(lg->shard_fds[i]);
+            if (close(lg->shard_fds[i]) != 0)
+                wc = LOG_FAIL;
+        }
+        free(lg->shard_fds);
+        free(lg->shard_base);
+        lg->shard_fds = NULL;
+        lg->shard_base = NULL;
+    }
+    else if (lg->rec) {
+        struct log_rec_t *rec = lg->rec;
+        __atomic_store_n(&lg->rec, NULL, __ATOMIC_RELEASE);
+        log_rec_close(rec);
+        wc = LOG_CLOSE;
+    }
+#ifdef LOG_HAVE_SHM
+    else if (lg->shm)
+        wc = log_shm_close(lg);
+#endif
+    else if (lg->segs) {
+        struct log_seg_t *seg = lg->seg_cur;
+        /* reserve the rest so no writer can start on it any more */
+        __atomic_store_n(&lg->seg_cur, NULL, __ATOMIC_RELEASE);
+        size_t off = __atomic_fetch_add(&seg->pos, seg->size + 1, __ATOMIC_RELAXED);
+        if (off <= seg->size)
+            __atomic_store_n(&seg->end, off, __ATOMIC_RELEASE);
+        log_seg_seal(lg, seg);
+        while (lg->segs != NULL) {
+            seg = lg->segs->next;
+            free(lg->segs);
+            lg->segs = seg;
+        }
+        free(lg->seg_base);
+        lg->seg_base = NULL;
+        lg->seg_size = 0;
+        wc = LOG_CLOSE;
+    }
+    else if(lg->output){
+        if (lg->blk != NULL) {
+            log_blk_seal(lg->blk, fileno(lg->output));
+            log_blk_free(lg->blk);
+            lg->blk = NULL;
+        }
+        if (lg->sync.mode != LOG_SYNC_NONE && lg->sync.unsynced) {
+            LOG_FDATASYNC(fileno(lg->output));
+            lg->sync.unsynced = 0;
+        }
+        int close_con = fclose(lg->output);
+        wc = (close_con == 0) ? LOG_CLOSE : LOG_FAIL;
+        lg->output = NULL;
+#ifdef THREAD_ENABLE
+        if (lg->rot != NULL) {
+            log_rot_free(lg->rot);
+            lg->rot = NULL;
+        }
+#endif
+    }
+    else
+        wc = LOG_NO_ACTION;
+#ifdef THREAD_ENABLE
+    pthread_mutex_unlock(&lg->lock);
+#endif
+    return wc;
+}
+
+/**
+ * logger_open creates a logger writing to cfg->file_name with the
+ * settings in cfg. Returns NULL if the file can't be opened, or can't
+ * be written as cfg asks. A logger without a file name only writes to
+ * the sinks added to it.
+ */
+struct logger_t *
+logger_open(const struct logger_cfg_t *cfg)
+{
+    struct logger_t init = LOGGER_INIT;
+    struct logger_t *lg = (struct logger_t *)malloc(sizeof(struct logger_t));
+
+    if (lg == NULL) {
+        perror("unable to allocation memory for logger");
+        return NULL;
+    }
+    *lg = init;
+    lg->serializer = cfg->serializer;
+    if (cfg->file_name != NULL && (cfg->recorder_size ?
+            logger_rec_init(lg, cfg->file_name, cfg->recorder_size, cfg->recorder_path) :
+            cfg->shared_size ?
+            logger_shm_init(lg, cfg->file_name, cfg->shared_size) :
+            cfg->block_size && cfg->shard == LOG_SHARD_NONE && !cfg->segment_size ?
+            logger_blk_init(lg, cfg->file_name, cfg->block_size) :
+            (cfg->rotate_size || cfg->rotate_interval) && cfg->shard == LOG_SHARD_NONE &&
+            !cfg->segment_size ?
+            logger_rot_init(lg, cfg->file_name, cfg->rotate_size, cfg->rotate_interval,
+                cfg->rotate_keep) :
+            logger_init(lg, cfg->file_name, cfg->shard, cfg->shard_count,
+                cfg->segment_size)) != LOG_OPEN) {
+        free(lg);
+        return NULL;
+    }
+    lg->io_backend = cfg->io_backend;
+    logger_set_durability(lg, cfg->durability, cfg->sync_interval_ms,
+        cfg->sync_interval_bytes);
+#ifdef THREAD_ENABLE
+    if (cfg->async_capacity && lg->shard_fds == NULL && lg->segs == NULL && lg->rec == NULL &&
+            lg->shm == NULL &&
+            logger_async_start(lg, cfg->async_capacity, cfg->async_policy) != LOG_OPEN) {
+        logger_shutdown(lg);
+        free(lg);
+        return NULL;
+    }
+    pthread_mutex_lock(&lock_loggers);
+#endif
+    lg->next = log_loggers;
+    log_loggers = lg;
+#ifdef THREAD_ENABLE
+    pthread_mutex_unlock(&lock_loggers);
+#endif
+    return lg;
+}
+
+/**
+ * logger_close flushes and closes a logger from logger_open and frees
+ * it. No other thread may be logging to it.
+ */
+int
+logger_close(struct logger_t *lg)
+{
+    struct logger_t **p;
+    int wc;
+
+#ifdef THREAD_ENABLE
+    pthread_mutex_lock(&lock_loggers);
+#endif
+    for (p = &log_loggers; *p != NULL && *p != lg; p = &(*p)->next)
+        ;
+    if (*p != NULL)
+        *p = lg->next;
+#ifdef THREAD_ENABLE
+    pthread_mutex_unlock(&lock_loggers);
+#endif
+    wc = logger_shutdown(lg);
+#ifdef THREAD_ENABLE
+    free(lg->batch.iov);
+    free(lg->batch.spare);
+#endif
+    free(lg);
+    return wc;
+}
+
+#ifdef THREAD_ENABLE
+/**
+ * log_sink_open opens the destination of a new sink. Socket sinks
+ * whose reader isn't up yet start out disconnected and connect once it
+ * is. Returns NULL on failure.
+ */
+static FILE *
+log_sink_open(struct log_sink_t *s, const struct log_sink_cfg_t *cfg)
+{
+    int fd = -1;
+
+    switch (cfg->type) {
+        case LOG_OUT_FILE:
+            return fopen(cfg->path, "a");
+        case LOG_OUT_STDOUT:
+        case LOG_OUT_STDERR:
+            fd = dup(cfg->type == LOG_OUT_STDOUT ? STDOUT_FILENO : STDERR_FILENO);
+            break;
+        case LOG_OUT_UNIX_STREAM:
+        case LOG_OUT_UNIX_DGRAM:
+            if (strlen(cfg->path) >= sizeof(s->addr.sun_path)) {
+                errno = ENAMETOOLONG;
+                return NULL;
+            }
+            s->addr.sun_family = AF_UNIX;
+            strcpy(s->addr.sun_path, cfg->path);
+            if ((fd = log_sink_connect(s)) < 0) {
+                fd = socket(AF_UNIX, (cfg->type == LOG_OUT_UNIX_DGRAM ?
+                    SOCK_DGRAM : SOCK_STREAM) | SOCK_CLOEXEC, 0);
+                s->broken = 1;
+            }
+            break;
+        default:
+            errno = EINVAL;
+            return NULL;
+    }
+    return fd < 0 ? NULL : fdopen(fd, "w");
+}
+
+/**
+ * logger_add_sink adds a destination every record written to lg is
+ * copied to, with its own ring and writer thread. Records already in
+ * flight when the sink is added may miss it. Returns NULL on failure.
+ */
+struct log_sink_t *
+logger_add_sink(struct logger_t *lg, const struct log_sink_cfg_t *cfg)
+{
+    struct logger_t init = LOGGER_INIT;
+    struct log_sink_t *s = (struct log_sink_t *)calloc(1, sizeof(struct log_sink_t));
+    int policy = cfg->drop_oldest ? LOG_ASYNC_DROP_OLDEST : LOG_ASYNC_DROP_NEWEST;
+
+    if (s == NULL) {
+        perror("unable to allocation memory for sink");
+        return NULL;
+    }
+    s->out = init;
+    s->out.out_type = cfg->type;
+    s->out.sink = s;
+    if ((s->out.output = log_sink_open(s, cfg)) == NULL) {
+        perror("unable to open log sink");
+        free(s);
+        return NULL;
+    }
+    if (logger_async_start(&s->out, cfg->capacity ? cfg->capacity : 4096, policy) != LOG_OPEN) {
+        fclose(s->out.output);
+        free(s);
+        return NULL;
+    }
+    s->next = __atomic_load_n(&lg->sinks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&lg->sinks, &s->next, s, 1,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    return s;
+}
+
+struct log_sink_t *
+log_add_sink(const struct log_sink_cfg_t *cfg)
+{
+    return logger_add_sink(&log_default, cfg);
+}
+
+/**
+ * log_sink_stats returns the sink's drop counters: records thrown away
+ * because its ring was full and records it failed to write.
+ */
+struct log_async_stats_t
+log_sink_stats(struct log_sink_t *sink)
+{
+    return logger_async_stats(&sink->out);
+}
+#endif
+
+/**
+ * log_init initializes the logger and sets up
+ * where the logger writes to.
+ */
+int
+log_init(const char* file_name)
+{
+    return logger_init(&log_default, file_name, LOG_SHARD_NONE, 0, 0);
+}
+
+/**
+ * log_init_shards is log_init for a default logger writing count
+ * shards per thread or per CPU, see log_shard_types.
+ */
+int
+log_init_shards(const char* file_name, int shard, unsigned int count)
+{
+    return logger_init(&log_default, file_name, shard, count, 0);
+}
+
+/**
+ * log_init_segments is log_init for a default logger writing memory
+ * mapped segment files of size bytes, LOG_SEGMENT_SIZE if 0. Each is
+ * preallocated and mapped up front, records are copied straight into
+ * the mapping, and once full it is sealed: flushed, synced if a
+ * durability mode is set, which only happens then, and cut down to the
+ * bytes written. Until a segment is sealed it is padded with zero
+ * bytes; after a crash it may also have zeroed gaps where a record was
+ * not finished. cat file.* puts the segments back in order.
+ */
+int
+log_init_segments(const char* file_name, size_t size)
+{
+    return logger_init(&log_default, file_name, LOG_SHARD_NONE, 0,
+        size ? size : LOG_SEGMENT_SIZE);
+}
+
+/**
+ * log_init_recorder makes the logger a flight recorder: it keeps the
+ * most recent size bytes of records (LOG_RECORDER_SIZE if 0) in a ring
+ * in memory, with no I/O, and they only reach file_name when the ring
+ * is dumped: by log_dump, by a LOG_LEVEL_FATAL record or on the
+ * signals set up by log_recorder_signals. With ring_path, typically
+ * under /dev/shm, the ring is a file that outlives a crash; without,
+ * it is anonymous memory that ends up in core dumps. logflight gets
+ * the records out of either. Binary records lose their key
+ * definitions as the ring wraps, so use a text serializer.
+ */
+int
+log_init_recorder(const char* file_name, size_t size, const char *ring_path)
+{
+    return logger_rec_init(&log_default, file_name, size, ring_path);
+}
+
+/**
+ * log_init_shared is log_init for processes that share file_name, such
+ * as the workers of a pre-forked pool, whether they inherit the logger
+ * from the process that forked them or call log_init_shared
+ * themselves. Records go into a ring of size bytes (LOG_SHARED_SIZE if
+ * 0) in shared memory, named after the file, and one collector thread,
+ * in the first process to get there, writes them all, so records from
+ * different processes never interleave however long they are. If the
+ * collector's process closes its logger or dies, the next process to
+ * log takes the role over, within LOG_SHM_WAIT_MS. A writer that dies
+ * halfway through a record loses that record and holds the ring up for
+ * LOG_SHM_STALL_MS. When the ring is full, writers wait up to
+ * LOG_SHM_WAIT_MS for room and then drop their record. Durability
+ * settings apply to the collector's writes, and the collector's logger
+ * can't go async. Without shared memory support this is log_init.
+ */
+int
+log_init_shared(const char* file_name, size_t size)
+{
+    return logger_shm_init(&log_default, file_name, size);
+}
+
+/**
+ * log_init_rotating is log_init with the file rotated once it holds
+ * size bytes and at every multiple of interval seconds since the
+ * epoch, either being 0 to not rotate on it. The file is sealed under
+ * its name with the UTC time appended, file.YYYYmmdd-HHMMSS, and a new
+ * one opened in its place by a background thread, so writers never
+ * wait on the rename or the open: the new file is swapped in between
+ * two writes. With LOG_SERIALIZE_BINARY, records pause during the
+ * swap, until the ones built for the sealed file have reached it, so
+ * that every file decodes on its own. Built with HAVE_ZLIB, sealed
+ * files are then gzipped at a low priority. Only the keep most recent
+ * sealed files are kept, all of them if keep is 0. Without threads the
+ * file is never rotated.
+ */
+int
+log_init_rotating(const char* file_name, size_t size, unsigned int interval,
+    unsigned int keep)
+{
+    return logger_rot_init(&log_default, file_name, size, interval, keep);
+}
+
+/**
+ * log_init_blocks is log_init with the file written as independent
+ * blocks of block_size bytes of records (LOG_BLOCK_SIZE if 0), each
+ * compressed by the writer before it goes out when built with
+ * HAVE_ZLIB, and stored as is otherwise. file.idx gets the offset,
+ * record count and time range of every block written, so logblock can
+ * read back a time range without inflating the rest of the file, and
+ * inflate blocks in parallel. A block is written once it is full, when
+ * the durability mode syncs the file, once it is LOG_BLOCK_MS old and
+ * on close, so records still in the current block are lost if the
+ * process dies. Without async mode the age is only looked at when
+ * records are written. Appending to an existing block file carries on
+ * after its last block. Binary frames depend on the frames before them,
+ * so with LOG_SERIALIZE_BINARY it fails with errno set to EINVAL.
+ */
+int
+log_init_blocks(const char* file_name, size_t block_size)
+{
+    return logger_blk_init(&log_default, file_name, block_size);
+}
+
+/**
+ * logger_dump writes the records in lg's flight recorder to path, or
+ * to the file it was set up with if path is NULL, replacing what was
+ * there. Returns the number of records written or -1.
+ */
+long
+logger_dump(struct logger_t *lg, const char *path)
+{
+    struct log_rec_t *rec = __atomic_load_n(&lg->rec, __ATOMIC_ACQUIRE);
+
+    if (rec == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return log_rec_dump(rec, path != NULL ? path : rec->dump_path);
+}
+
+long
+log_dump(const char *path)
+{
+    return logger_dump(&log_default, path);
+}
+
+static void
+log_recorder_signal(int sig)
+{
+    int saved = errno;
+
+    log_recorders_dump();
+    if (sig != SIGUSR1)
+        raise(sig);
+    errno = saved;
+}
+
+/**
+ * log_recorder_signals makes SIGUSR1 dump every flight recorder to its
+ * file. With fatal set, SIGSEGV, SIGBUS, SIGILL, SIGFPE and SIGABRT
+ * dump them as well, then take their default action. Returns -1 if a
+ * handler could not be installed.
+ */
+int
+log_recorder_signals(int fatal)
+{
+    static const int fatal_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+    struct sigaction sa;
+    int wc = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = log_recorder_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR1, &sa, NULL) != 0)
+        wc = -1;
+    if (fatal) {
+        sa.sa_flags = SA_RESETHAND;
+        for (size_t i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); i++)
+            if (sigaction(fatal_signals[i], &sa, NULL) != 0)
+                wc = -1;
+    }
+    return wc;
+}
+
+void
+log_site_report();
+
+int
+log_close()
+{
+    log_site_report();
+    return logger_shutdown(&log_default);
+}
+
+static struct log_module_t *log_modules = NULL;
+
+#ifdef THREAD_ENABLE
+static pthread_mutex_t lock_modules = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * log_module_find looks a module up by name, creating it if asked to.
+ * lock_modules must be held.
+ */
+static struct log_module_t *
+log_module_find(const char *name, int create)
+{
+    struct log_module_t *m;
+
+    for (m = log_modules; m != NULL; m = m->next) {
+        if (strcmp(m->name, name) == 0)
+            return m;
+    }
+    if (!create)
+        return NULL;
+    m = (struct log_module_t *)calloc(1, sizeof(struct log_module_t));
+    if (m == NULL || (m->name = strdup(name)) == NULL) {
+        perror("unable to allocation memory for log module");
+        free(m);
+        return NULL;
+    }
+    m->level = log_level;
+    m->next = log_modules;
+    log_modules = m;
+    return m;
+}
+
+/**
+ * log_module_get returns the module called name, registering it on
+ * first use. Modules live until the process exits.
+ */
+struct log_module_t *
+log_module_get(const char *name)
+{
+    struct log_module_t *m;
+
+#ifdef THREAD_ENABLE
+    pthread_mutex_lock(&lock_modules);
+#endif
+    m = log_module_find(name, 1);
+#ifdef THREAD_ENABLE
+    pthread_mutex_unlock(&lock_modules);
+#endif
+    return m;
+}
+
+/**
+ * log_set_level sets the runtime threshold of every module that has no
+ * threshold of its own.
+ */
+void
+log_set_level(int level)
+{
+#ifdef THREAD_ENABLE
+    pthread_mutex_lock(&lock_modules);
+#endif
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+    for (struct log_module_t *m = log_modules; m != NULL; m = m->next) {
+        if (!m->explicit_level)
+            __atomic_store_n(&m->level, level, __ATOMIC_RELAXED);
+    }
+#ifdef THREAD_ENABLE
+    pthread_mutex_unlock(&lock_modules);
+#endif
+}
+
+/**
+ * log_set_module_level gives one module its own runtime threshold.
+ * LOG_LEVEL_NONE makes it follow log_set_level again.
+ */
+int
+log_set_module_level(const char *name, int level)
+{
+    struct log_module_t *m;
+
+#ifdef THREAD_ENABLE
+    pthread_mutex_lock(&lock_modules);
+#endif
+    if ((m = log_module_find(name, 1)) != NULL) {
+        m->explicit_level = (level != LOG_LEVEL_NONE);
+        __atomic_store_n(&m->level, m->explicit_level ? level : log_level,
+            __ATOMIC_RELAXED);
+    }
+#ifdef THREAD_ENABLE
+    pthread_mutex_unlock(&lock_modules);
+#endif
+    return m ? 0 : -1;
+}
+
+/**
+ * log_fatal_exit runs after a LOG_LEVEL_FATAL record has been written. It
+ * dumps the flight recorders, flushes and shuts down every logger and
+ * terminates the process. The handles are left allocated, since other
+ * threads may still be logging through them until exit.
+ */
+static void
+log_fatal_exit()
+{
+    log_recorders_dump();
+#ifdef THREAD_ENABLE
+    pthread_mutex_lock(&lock_loggers);
+#endif
+    for (struct logger_t *lg = log_loggers; lg != NULL; lg = lg->next)
+        logger_shutdown(lg);
+#ifdef THREAD_ENABLE
+    pthread_mutex_unlock(&lock_loggers);
+#endif
+    log_close();
+    exit(1);
+}
+
+#ifndef STACK_FIELDS_ENABLE
+/**
+ * object_field_new allocates memory for a new log field,
+ * sets the memory to 0, and returns a pointer to it.
+ */
+static struct object_field_t*
+object_field_new(const char *key)
+{
+    struct object_field_t *field = 
+        (struct object_field_t *)calloc(1, sizeof(object_field_t));
+    if (field == NULL) {
+        perror("unable to allocation memory for new field");
+        return NULL;
+    }
+    memset(field, 0, sizeof(object_field_t));
+    field->key = (char *)calloc(1, strlen(key)+1);
+    strcpy(field->key, key);
+    return field;
+}
+
+static struct array_field_t*
+array_field_new()
+{
+    struct array_field_t *field = 
+        (struct array_field_t *)calloc(1, sizeof(array_field_t));
+    if (field == NULL) {
+        perror("unable to allocation memory for new field");
+        return NULL;
+    }
+    memset(field, 0, sizeof(array_field_t));\
+    return field;
+}
+#endif
+
+/**
+ * object_field_free frees the memory used by the object_field_t.
+ * struct.
+ */
+static void
+object_field_free(struct object_field_t *sf)
+{
+    if (sf != NULL) {
+        if (sf->key != NULL) {
+            free(sf->key);
+        }
+        // if ((sf->type == LOG_STRING) && (sf->char_value != NULL)) {
+        //     free(sf->char_value);
+        // }
+        free(sf);
+    }
+}
+
+static void
+array_field_free(struct array_field_t *sf)
+{
+    if (sf != NULL) {
+        // if ((sf->type == LOG_STRING) && (sf->char_value != NULL)) {
+        //     free(sf->char_value);
+        // }
+        free(sf);
+    }
+}
+#ifndef STACK_FIELDS_ENABLE
+/**
+ * object_int is used to add an integer value
+ * to the log entry.
+ */
+struct object_field_t*
+object_int(const char *key, const int value)
+{
+    struct object_field_t *field = object_field_new(key);
+    field->type = LOG_INT;
+    field->value.i = value;
+    return field;
+}
+
+/**
+ * object_double is used to add a double to the
+ * log entry.
+ */
+struct object_field_t*
+object_double(const char *key, const double value)
+{
+    struct object_field_t *field = object_field_new(key);
+    field->type = LOG_REAL;
+    field->value.r = value;
+    return field;
+}
+
+/**
+ * object_string is used to add a string to the
+ * log entry.
+ */
+struct object_field_t*
+object_string(const char *key, const char *value)
+{
+    struct object_field_t *field = object_field_new(key);
+    field->type = LOG_STRING;
+    field->value.s = value;
+    return field;
+}
+
+/**
+ * object_array is used to add a array to the
+ * log entry.
+ */
+struct object_field_t*
+object_array(const char *key, JSON_STRUCT array)
+{
+    struct object_field_t *field = object_field_new(key);
+    field->type = LOG_ARRAY;
+    field->json_any = array;
+    return field;
+}
+
+/**
+ * object_object is used to json object a array to the
+ * log entry.
+ */
+struct object_field_t*
+object_object(const char *key, JSON_STRUCT object)
+{
+    struct object_field_t *field = object_field_new(key);
+    field->type = LOG_OBJECT;
+    field->json_any = object;
+    return field;
+}
+
+/**
+ * object_any_json is used to json object a array to the
+ * log entry.
+ */
+struct object_field_t*
+object_any_json(const char *key, JSON_STRUCT object)
+{
+    switch(check_json_type(object)){
+        case LOG_ARRAY:
+            return object_array(key, object);
+        case LOG_OBJECT:
+            return object_object(key, object);
+        default:
+            return NULL;
+    }
+}
+
+#else
+/**
+ * With STACK_FIELDS_ENABLE the field constructors return descriptors
+ * by value. log_object/object collect them into an array on the
+ * caller's stack and the key is borrowed, so nothing is allocated
+ * until serialization starts.
+ */
+static inline struct object_field_t
+object_field_make(const char *key, uint8_t type, JSON_STRUCT json_any)
+{
+    struct object_field_t field;
+    field.type = type;
+    field.key = (char *)key;
+    field.json_any = json_any;
+    field.value.s = NULL;
+    return field;
+}
+
+static inline struct object_field_t
+object_int(const char *key, const int value)
+{
+    struct object_field_t field = object_field_make(key, LOG_INT, NULL);
+    field.value.i = value;
+    return field;
+}
+
+static inline struct object_field_t
+object_double(const char *key, const double value)
+{
+    struct object_field_t field = object_field_make(key, LOG_REAL, NULL);
+    field.value.r = value;
+    return field;
+}
+
+static inline struct object_field_t
+object_string(const char *key, const char *value)
+{
+    struct object_field_t field = object_field_make(key, LOG_STRING, NULL);
+    field.value.s = value;
+    return field;
+}
+
+static inline struct object_field_t
+object_array(const char *key, JSON_STRUCT array)
+{
+    return object_field_make(key, LOG_ARRAY, array);
+}
+
+static inline struct object_field_t
+object_object(const char *key, JSON_STRUCT object)
+{
+    return object_field_make(key, LOG_OBJECT, object);
+}
+
+/**
+ * object_any_json yields a LOG_OTHER descriptor, which the serializers
+ * skip, for anything that is not an array or an object.
+ */
+static inline struct object_field_t
+object_any_json(const char *key, JSON_STRUCT object)
+{
+    switch(check_json_type(object)){
+        case LOG_ARRAY:
+            return object_array(key, object);
+        case LOG_OBJECT:
+            return object_object(key, object);
+        default:
+            return object_field_make(key, LOG_OTHER, NULL);
+    }
+}
+#endif
+
+/**
+ * object_array is used to add a array to the
+ * log entry.
+ */
+
+#define object_any(key, x) _Generic((x),  \
+        int: object_int(key, x),              \
+        double: object_double(key, x),              \
+        char *: object_string(key, x),        \
+        JSON_STRUCT: object_any_json(key, x),        \
+        default: object_any_json(key, NULL))
+
+
+// array_func
+
+#ifndef STACK_FIELDS_ENABLE
+/**
+ * array_int is used to add an integer value
+ * to the log entry.
+ */
+struct array_field_t*
+array_int(const int value)
+{
+    struct array_field_t *field = array_field_new();
+    field->type = LOG_INT;
+    field->value.i = value;
+    return field;
+}
+
+/**
+ * array_double is used to add a double to the
+ * log entry.
+ */
+struct array_field_t*
+array_double(const double value)
+{
+    struct array_field_t *field = array_field_new();
+    field->type = LOG_REAL;
+    field->value.r = value;
+    return field;
+}
+
+/**
+ * array_string is used to add a string to the
+ * log entry.
+ */
+struct array_field_t*
+array_string(const char *value)
+{
+    struct array_field_t *field = array_field_new();
+    field->type = LOG_STRING;
+    field->value.s = value;
+    return field;
+}
+
+/**
+ * array_array is used to add a array to the
+ * log entry.
+ */
+struct array_field_t*
+array_array(JSON_STRUCT array)
+{
+    struct array_field_t *field = array_field_new();
+    field->type = LOG_ARRAY;
+    field->json_any = array;
+    return field;
+}
+
+/**
+ * array_object is used to json object a array to the
+ * log entry.
+ */
+struct array_field_t*
+array_object(JSON_STRUCT object)
+{
+    struct array_field_t *field = array_field_new();
+    field->type = LOG_OBJECT;
+    field->json_any = object;
+    return field;
+}
+
+/**
+ * array_any is used to json object a array to the
  * log entry.
  */
-struct array_field_t*
-array_string(const char *value)
+struct array_field_t*
+array_any_json(JSON_STRUCT object)
+{
+    switch(check_json_type(object)){
+        case LOG_ARRAY:
+            return array_array(object);
+        case LOG_OBJECT:
+            return array_object(object);
+        default:
+            return NULL;
+    }
+}
+
+#else
+static inline struct array_field_t
+array_field_make(uint8_t type, JSON_STRUCT json_any)
+{
+    struct array_field_t field;
+    field.type = type;
+    field.json_any = json_any;
+    field.value.s = NULL;
+    return field;
+}
+
+static inline struct array_field_t
+array_int(const int value)
+{
+    struct array_field_t field = array_field_make(LOG_INT, NULL);
+    field.value.i = value;
+    return field;
+}
+
+static inline struct array_field_t
+array_double(const double value)
+{
+    struct array_field_t field = array_field_make(LOG_REAL, NULL);
+    field.value.r = value;
+    return field;
+}
+
+static inline struct array_field_t
+array_string(const char *value)
+{
+    struct array_field_t field = array_field_make(LOG_STRING, NULL);
+    field.value.s = value;
+    return field;
+}
+
+static inline struct array_field_t
+array_array(JSON_STRUCT array)
+{
+    return array_field_make(LOG_ARRAY, array);
+}
+
+static inline struct array_field_t
+array_object(JSON_STRUCT object)
+{
+    return array_field_make(LOG_OBJECT, object);
+}
+
+static inline struct array_field_t
+array_any_json(JSON_STRUCT object)
+{
+    switch(check_json_type(object)){
+        case LOG_ARRAY:
+            return array_array(object);
+        case LOG_OBJECT:
+            return array_object(object);
+        default:
+            return array_field_make(LOG_OTHER, NULL);
+    }
+}
+#endif
+
+#define array_any(x) _Generic((x),  \
+        int: array_int(x),              \
+        double: array_double(x),              \
+        char *: array_string(x),        \
+        JSON_STRUCT: array_any_json(x),        \
+        default: array_any_json(NULL))
+
+/**
+ * log_timestamp_types selects how the timestamp field is written:
+ * integer seconds, milliseconds, microseconds or nanoseconds since the
+ * epoch, or an RFC 3339 UTC string with microseconds.
+ */
+static enum {
+    LOG_TS_SEC,
+    LOG_TS_MSEC,
+    LOG_TS_USEC,
+    LOG_TS_NSEC,
+    LOG_TS_RFC3339
+} log_timestamp_types __attribute__((unused));
+
+/**
+ * log_clock_types selects the clock behind the timestamp.
+ * LOG_CLOCK_COARSE reads CLOCK_REALTIME_COARSE where it exists, which
+ * is much cheaper but only advances once per scheduler tick.
+ */
+static enum {
+    LOG_CLOCK_PRECISE,
+    LOG_CLOCK_COARSE
+} log_clock_types __attribute__((unused));
+
+static int log_ts_format = LOG_TS_SEC;
+static clockid_t log_ts_clock = CLOCK_REALTIME;
+
+/**
+ * log_set_timestamp selects the format (log_timestamp_types) and the
+ * clock (log_clock_types) of the timestamp field.
+ */
+void
+log_set_timestamp(int format, int clock)
+{
+    log_ts_format = format;
+#ifdef CLOCK_REALTIME_COARSE
+    log_ts_clock = (clock == LOG_CLOCK_COARSE) ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME;
+#else
+    log_ts_clock = CLOCK_REALTIME;
+#endif
+}
+
+/**
+ * log_tls_time_t caches, per thread, what does not change from one
+ * record to the next: the RFC 3339 text of the current second and the
+ * rendered thread id.
+ */
+struct log_tls_time_t {
+    time_t sec;
+    char prefix[32];
+    size_t prefix_len;
+    int have_tid;
+    unsigned long tid;
+    char tid_text[48];
+    size_t tid_len;
+};
+
+static __thread struct log_tls_time_t log_tls_time = { (time_t)-1 };
+
+static inline void
+log_clock_now(struct timespec *ts)
+{
+    clock_gettime(log_ts_clock, ts);
+}
+
+/**
+ * log_timestamp_int returns ts in the configured integer unit.
+ */
+static inline long long
+log_timestamp_int(const struct timespec *ts)
+{
+    switch (log_ts_format) {
+        case LOG_TS_MSEC:
+            return (long long)ts->tv_sec * 1000LL + ts->tv_nsec / 1000000L;
+        case LOG_TS_USEC:
+            return (long long)ts->tv_sec * 1000000LL + ts->tv_nsec / 1000L;
+        case LOG_TS_NSEC:
+            return (long long)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+        default:
+            return (long long)ts->tv_sec;
+    }
+}
+
+/**
+ * log_timestamp_rfc3339 writes ts as YYYY-MM-DDTHH:MM:SS.uuuuuuZ into
+ * out, which must hold at least 32 bytes, and returns the length. The
+ * date and time part is only reformatted when the second rolls over.
+ */
+static size_t
+log_timestamp_rfc3339(const struct timespec *ts, char *out)
+{
+    struct log_tls_time_t *c = &log_tls_time;
+    long usec = ts->tv_nsec / 1000L;
+    char *p;
+
+    if (ts->tv_sec != c->sec) {
+        struct tm tm;
+        gmtime_r(&ts->tv_sec, &tm);
+        c->prefix_len = strftime(c->prefix, sizeof(c->prefix), "%Y-%m-%dT%H:%M:%S", &tm);
+        c->sec = ts->tv_sec;
+    }
+    memcpy(out, c->prefix, c->prefix_len);
+    p = out + c->prefix_len;
+    *p++ = '.';
+    for (int i = 5; i >= 0; i--) {
+        p[i] = (char)('0' + usec % 10);
+        usec /= 10;
+    }
+    p += 6;
+    *p++ = 'Z';
+    return (size_t)(p - out);
+}
+
+#ifdef THREAD_ENABLE
+/**
+ * log_thread_cache returns the calling thread's cache with its id
+ * filled in and rendered as a ", \"thread_id\": N" fragment.
+ */
+static inline struct log_tls_time_t *
+log_thread_cache()
+{
+    struct log_tls_time_t *c = &log_tls_time;
+
+    if (!c->have_tid) {
+        c->tid = (unsigned long)pthread_self();
+        c->tid_len = (size_t)snprintf(c->tid_text, sizeof(c->tid_text),
+            ", \"thread_id\": %lld", (long long)c->tid);
+        c->have_tid = 1;
+    }
+    return c;
+}
+#endif
+
+/**
+ * log_timestamp_json returns the timestamp field value for the DOM path.
+ */
+static JSON_STRUCT
+log_timestamp_json(const struct timespec *ts)
+{
+    if (log_ts_format == LOG_TS_RFC3339) {
+        char tmp[40];
+        tmp[log_timestamp_rfc3339(ts, tmp)] = '\0';
+        return JSON_STRING(tmp);
+    }
+    return JSON_INTEGER(log_timestamp_int(ts));
+}
+
+/**
+ * log_value_json returns the jansson value for a field. Scalars are
+ * built from their raw value, nested json is handed over, copied or
+ * shared according to behave_type.
+ */
+static JSON_STRUCT
+log_value_json(uint8_t type, const union log_value_t *value,
+    JSON_STRUCT json_any, int behave_type)
+{
+    switch (type) {
+        case LOG_INT:
+            return JSON_INTEGER(value->i);
+        case LOG_REAL:
+            return JSON_REAL(value->r);
+        case LOG_STRING:
+            if (value->s == NULL)
+                return NULL;
+            return log_utf8_check ? JSON_STRING(value->s) : JSON_STRING_NOCHECK(value->s);
+        default:
+            break;
+    }
+    switch (behave_type) {
+        case LOG_KEEP:
+            return json_any;
+        case LOG_COPY:
+            return JSON_COPY(json_any);
+        case LOG_SHARE:
+            return JSON_INCREF(json_any);
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * log_record_behave is the behave_type a DOM record is built with. The
+ * tree is dumped and released before the log call returns, so LOG_COPY
+ * values can be shared with it rather than copied.
+ */
+static inline int
+log_record_behave(int behave_type)
+{
+    return LOG_COPY_SHARES && behave_type == LOG_COPY ? LOG_SHARE : behave_type;
+}
+
+/**
+ * log_buf_t is a growable byte buffer the streaming serializer writes
+ * a record into. One lives in each thread and is reused across calls.
+ */
+struct log_buf_t {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;
+};
+
+static __thread struct log_buf_t log_tls_buf;
+
+/**
+ * log_buf_reserve makes room for n more bytes. On allocation failure
+ * the buffer is marked failed and the record gets dropped.
+ */
+static int
+log_buf_reserve(struct log_buf_t *b, size_t n)
+{
+    if (b->len + n <= b->cap)
+        return 1;
+    if (b->failed)
+        return 0;
+
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->len + n)
+        cap <<= 1;
+    char *data = (char *)realloc(b->data, cap);
+    if (data == NULL) {
+        perror("unable to allocation memory for record buffer");
+        b->failed = 1;
+        return 0;
+    }
+    b->data = data;
+    b->cap = cap;
+    return 1;
+}
+
+static inline void
+log_buf_put(struct log_buf_t *b, const char *s, size_t n)
+{
+    if (log_buf_reserve(b, n)) {
+        memcpy(b->data + b->len, s, n);
+        b->len += n;
+    }
+}
+
+static inline void
+log_buf_putc(struct log_buf_t *b, char c)
+{
+    if (log_buf_reserve(b, 1))
+        b->data[b->len++] = c;
+}
+
+#define log_buf_puts(b, s) log_buf_put(b, s, sizeof(s) - 1)
+
+/**
+ * log_utf8_len returns the length of the valid UTF-8 sequence starting
+ * at s, or 0 if it is malformed. n is the number of bytes available.
+ */
+static size_t
+log_utf8_len(const unsigned char *s, size_t n)
+{
+    unsigned char c = s[0];
+    size_t len;
+    uint32_t cp;
+
+    if (c >= 0xC2 && c <= 0xDF) {
+        len = 2;
+        cp = c & 0x1F;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        len = 3;
+        cp = c & 0x0F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        len = 4;
+        cp = c & 0x07;
+    } else {
+        return 0;
+    }
+    if (len > n)
+        return 0;
+    for (size_t i = 1; i < len; i++) {
+        if ((s[i] & 0xC0) != 0x80)
+            return 0;
+        cp = (cp << 6) | (s[i] & 0x3F);
+    }
+    if ((len == 3 && cp < 0x800) || (len == 4 && (cp < 0x10000 || cp > 0x10FFFF)) ||
+            (cp >= 0xD800 && cp <= 0xDFFF))
+        return 0;
+    return len;
+}
+
+/**
+ * log_escape_scan returns the offset of the first byte in p[i..n) that
+ * log_buf_put_string has to look at: a quote, a backslash, a control
+ * character or, if utf8 is set, a byte of a multibyte sequence. Returns
+ * n if there is none. The SIMD versions test 16 or 32 bytes at a time.
+ */
+static inline size_t
+log_escape_scan_scalar(const unsigned char *p, size_t i, size_t n, int utf8)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    unsigned int limit = utf8 ? 0x80 : 0x100;
+
+    /* eight bytes at a time: a byte of the word is < 0x20, '"' or '\\' */
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v, q, bs, m;
+        memcpy(&v, p + i, 8);
+        q = v ^ (ones * '"');
+        bs = v ^ (ones * '\\');
+        m = ((v - ones * 0x20) & ~v) | ((q - ones) & ~q) | ((bs - ones) & ~bs);
+        if (utf8)
+            m |= v;
+        if (m & (ones * 0x80))
+            break;
+    }
+    for (; i < n; i++) {
+        unsigned int c = p[i];
+        if (c < 0x20 || c >= limit || c == '"' || c == '\\')
+            break;
+    }
+    return i;
+}
+
+#ifdef LOG_HAVE_AVX2
+__attribute__((target("avx2"))) static size_t
+log_escape_scan_avx2(const unsigned char *p, size_t i, size_t n, int utf8)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i ctl = _mm256_set1_epi8(0x1F);
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+            _mm256_cmpeq_epi8(v, bslash));
+        /* a signed compare also catches every byte >= 0x80 */
+        m = _mm256_or_si256(m, utf8 ? _mm256_cmpgt_epi8(space, v) :
+            _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctl), ctl));
+        unsigned int bits = (unsigned int)_mm256_movemask_epi8(m);
+        if (bits)
+            return i + (size_t)__builtin_ctz(bits);
+    }
+    return log_escape_scan_scalar(p, i, n, utf8);
+}
+#endif
+
+static inline size_t
+log_escape_scan(const unsigned char *p, size_t i, size_t n, int utf8)
+{
+#if !defined(SIMD_DISABLE) && defined(__SSE2__)
+#ifdef LOG_HAVE_AVX2
+    if (n - i >= 64 && __builtin_cpu_supports("avx2"))
+        return log_escape_scan_avx2(p, i, n, utf8);
+#endif
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i ctl = _mm_set1_epi8(0x1F);
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash));
+        m = _mm_or_si128(m, utf8 ? _mm_cmplt_epi8(v, space) :
+            _mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl));
+        int bits = _mm_movemask_epi8(m);
+        if (bits)
+            return i + (size_t)__builtin_ctz((unsigned int)bits);
+    }
+#endif
+    return log_escape_scan_scalar(p, i, n, utf8);
+}
+
+/**
+ * log_buf_put_string writes s as a quoted JSON string, escaping it the
+ * way jansson does. Clean runs are found with log_escape_scan and
+ * copied in one go. Returns 0 if s is not valid UTF-8, unless
+ * log_set_utf8_check turned the check off.
+ */
+static int
+log_buf_put_string(struct log_buf_t *b, const char *s, size_t n)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    const unsigned char *p = (const unsigned char *)s;
+    int utf8 = log_utf8_check;
+    size_t run = 0;
+
+    log_buf_reserve(b, n + 2);
+    log_buf_putc(b, '"');
+    for (size_t i = 0; (i = log_escape_scan(p, i, n, utf8)) < n; i++) {
+        unsigned char c = p[i];
+        if (c >= 0x80) {
+            size_t len = log_utf8_len(p + i, n - i);
+            if (len == 0)
+                return 0;
+            i += len - 1;
+            continue;
+        }
+        log_buf_put(b, s + run, i - run);
+        run = i + 1;
+        switch (c) {
+            case '"':  log_buf_puts(b, "\\\""); break;
+            case '\\': log_buf_puts(b, "\\\\"); break;
+            case '\b': log_buf_puts(b, "\\b"); break;
+            case '\f': log_buf_puts(b, "\\f"); break;
+            case '\n': log_buf_puts(b, "\\n"); break;
+            case '\r': log_buf_puts(b, "\\r"); break;
+            case '\t': log_buf_puts(b, "\\t"); break;
+            default: {
+                char u[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+                log_buf_put(b, u, sizeof(u));
+            }
+        }
+    }
+    log_buf_put(b, s + run, n - run);
+    log_buf_putc(b, '"');
+    return 1;
+}
+
+/**
+ * log_digit_pairs holds "00" to "99" so integers can be written two
+ * digits per division.
+ */
+static const char log_digit_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/**
+ * log_fmt_uint writes v in decimal so that it ends just before end and
+ * returns where it starts.
+ */
+static inline char *
+log_fmt_uint(char *end, uint64_t v)
+{
+    while (v >= 100) {
+        unsigned int r = (unsigned int)(v % 100);
+        v /= 100;
+        end -= 2;
+        memcpy(end, log_digit_pairs + r * 2, 2);
+    }
+    if (v >= 10) {
+        end -= 2;
+        memcpy(end, log_digit_pairs + v * 2, 2);
+    } else {
+        *--end = (char)('0' + v);
+    }
+    return end;
+}
+
+/**
+ * log_buf_put_int writes v in decimal.
+ */
+static void
+log_buf_put_int(struct log_buf_t *b, long long v)
+{
+    char tmp[24];
+    char *end = tmp + sizeof(tmp);
+    char *p = log_fmt_uint(end, v < 0 ? 0 - (uint64_t)v : (uint64_t)v);
+
+    if (v < 0)
+        *--p = '-';
+    log_buf_put(b, p, (size_t)(end - p));
+}
+
+/**
+ * log_diyfp_t is a floating point number f * 2^e with a 64 bit
+ * significand, the working type of Grisu2.
+ */
+struct log_diyfp_t {
+    uint64_t f;
+    int e;
+};
+
+static const uint64_t log_pow10_u64[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+/**
+ * log_grisu_pow_f/log_grisu_pow_e are the normalized powers of ten
+ * 10^-348, 10^-340, ... 10^340, rounded to 64 bits.
+ */
+static const uint64_t log_grisu_pow_f[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+    0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+    0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+    0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+    0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+    0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+    0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+    0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+    0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+    0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+    0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+    0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+    0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+    0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+    0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+
+static const int16_t log_grisu_pow_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static inline struct log_diyfp_t
+log_diyfp_mul(struct log_diyfp_t a, struct log_diyfp_t b)
+{
+    struct log_diyfp_t r;
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 p = (unsigned __int128)a.f * b.f;
+    r.f = (uint64_t)(p >> 64) + (((uint64_t)p >> 63) & 1);
+#else
+    uint64_t a_hi = a.f >> 32, a_lo = a.f & 0xFFFFFFFFULL;
+    uint64_t b_hi = b.f >> 32, b_lo = b.f & 0xFFFFFFFFULL;
+    uint64_t hl = a_hi * b_lo, lh = a_lo * b_hi;
+    uint64_t mid = ((a_lo * b_lo) >> 32) + (hl & 0xFFFFFFFFULL) + (lh & 0xFFFFFFFFULL);
+    mid += 1ULL << 31;
+    r.f = a_hi * b_hi + (hl >> 32) + (lh >> 32) + (mid >> 32);
+#endif
+    r.e = a.e + b.e + 64;
+    return r;
+}
+
+/**
+ * log_grisu_round nudges the last digit down while that brings the
+ * result closer to the exact value and keeps it inside the rounding
+ * interval.
+ */
+static inline void
+log_grisu_round(char *buf, int len, uint64_t delta, uint64_t rest,
+    uint64_t ten_kappa, uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+            (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buf[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+/**
+ * log_grisu2 writes the shortest digits that read back as v, a finite
+ * positive double, to buf (at most 17) and returns how many there are;
+ * *k receives the decimal exponent of the last one.
+ */
+static int
+log_grisu2(double v, char *buf, int *k)
+{
+    struct log_diyfp_t w, plus, minus, c, one, wp_w;
+    uint64_t bits, delta, p2;
+    uint32_t p1;
+    int len = 0, kappa, index;
+
+    memcpy(&bits, &v, sizeof(bits));
+    w.f = bits & 0x000FFFFFFFFFFFFFULL;
+    w.e = (int)(bits >> 52);
+    if (w.e) {
+        w.f += 0x0010000000000000ULL;
+        w.e -= 1075;
+    } else {
+        w.e = -1074;
+    }
+
+    /* the boundaries halfway to the neighbouring doubles */
+    plus.f = (w.f << 1) + 1;
+    plus.e = w.e - 1;
+    while (!(plus.f & (0x0010000000000000ULL << 1))) {
+        plus.f <<= 1;
+        plus.e--;
+    }
+    plus.f <<= 10;
+    plus.e -= 10;
+    if (w.f == 0x0010000000000000ULL) {
+        minus.f = (w.f << 2) - 1;
+        minus.e = w.e - 2;
+    } else {
+        minus.f = (w.f << 1) - 1;
+        minus.e = w.e - 1;
+    }
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    /* scale by a cached power of ten so the product lands in [2^-60, 2^-32) */
+    double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+    int ck = (int)dk;
+    if (dk - ck > 0.0)
+        ck++;
+    index = (ck >> 3) + 1;
+    *k = -(-348 + index * 8);
+    c.f = log_grisu_pow_f[index];
+    c.e = log_grisu_pow_e[index];
+
+    int s = __builtin_clzll(w.f);
+    w.f <<= s;
+    w.e -= s;
+    w = log_diyfp_mul(w, c);
+    plus = log_diyfp_mul(plus, c);
+    minus = log_diyfp_mul(minus, c);
+    minus.f++;
+    plus.f--;
+
+    /* generate digits of plus until they are inside the interval */
+    delta = plus.f - minus.f;
+    one.f = 1ULL << -plus.e;
+    one.e = plus.e;
+    wp_w.f = plus.f - w.f;
+    p1 = (uint32_t)(plus.f >> -one.e);
+    p2 = plus.f & (one.f - 1);
+    for (kappa = 1; kappa < 10 && p1 >= log_pow10_u64[kappa]; kappa++)
+        ;
+    while (kappa > 0) {
+        uint32_t d = (uint32_t)(p1 / log_pow10_u64[kappa - 1]);
+        p1 %= (uint32_t)log_pow10_u64[kappa - 1];
+        if (d || len)
+            buf[len++] = (char)('0' + d);
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if (rest <= delta) {
+            *k += kappa;
+            log_grisu_round(buf, len, delta, rest,
+                log_pow10_u64[kappa] << -one.e, wp_w.f);
+            return len;
+        }
+    }
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        char d = (char)(p2 >> -one.e);
+        if (d || len)
+            buf[len++] = (char)('0' + d);
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *k += kappa;
+            index = -kappa;
+            log_grisu_round(buf, len, delta, p2, one.f,
+                wp_w.f * (index < 20 ? log_pow10_u64[index] : 0));
+            return len;
+        }
+    }
+}
+
+/**
+ * log_buf_put_double writes v with the fewest digits that read back as
+ * the same double, as a JSON real: plain notation from 1e-5 up to 1e17
+ * (integral values get a ".0"), exponent notation outside that, e.g.
+ * 2.2, 100.0, 0.001, 1.5e-7, 1e300. Returns 0 for NaN and infinities,
+ * which JSON cannot express.
+ */
+static int
+log_buf_put_double(struct log_buf_t *b, double v)
+{
+    char digits[20], tmp[40];
+    int n = 0, len, k, point;
+
+    if (v != v || v - v != 0)
+        return 0;
+    if (signbit(v)) {
+        tmp[n++] = '-';
+        v = -v;
+    }
+    if (v == 0) {
+        memcpy(tmp + n, "0.0", 3);
+        log_buf_put(b, tmp, (size_t)n + 3);
+        return 1;
+    }
+
+    len = log_grisu2(v, digits, &k);
+    point = len + k; /* v = 0.digits * 10^point */
+    if (k >= 0 && point <= 17) {
+        memcpy(tmp + n, digits, (size_t)len);
+        n += len;
+        memset(tmp + n, '0', (size_t)k);
+        n += k;
+        tmp[n++] = '.';
+        tmp[n++] = '0';
+    } else if (point > 0 && point <= 17) {
+        memcpy(tmp + n, digits, (size_t)point);
+        n += point;
+        tmp[n++] = '.';
+        memcpy(tmp + n, digits + point, (size_t)(len - point));
+        n += len - point;
+    } else if (point > -5 && point <= 0) {
+        tmp[n++] = '0';
+        tmp[n++] = '.';
+        memset(tmp + n, '0', (size_t)-point);
+        n += -point;
+        memcpy(tmp + n, digits, (size_t)len);
+        n += len;
+    } else {
+        int exp = point - 1;
+        tmp[n++] = digits[0];
+        if (len > 1) {
+            tmp[n++] = '.';
+            memcpy(tmp + n, digits + 1, (size_t)len - 1);
+            n += len - 1;
+        }
+        tmp[n++] = 'e';
+        if (exp < 0) {
+            tmp[n++] = '-';
+            exp = -exp;
+        }
+        char *end = tmp + sizeof(tmp);
+        char *p = log_fmt_uint(end, (uint64_t)exp);
+        memcpy(tmp + n, p, (size_t)(end - p));
+        n += (int)(end - p);
+    }
+    log_buf_put(b, tmp, (size_t)n);
+    return 1;
+}
+
+static int
+log_buf_dump_cb(const char *buffer, size_t size, void *data)
+{
+    struct log_buf_t *b = (struct log_buf_t *)data;
+    log_buf_put(b, buffer, size);
+    return b->failed ? -1 : 0;
+}
+
+/**
+ * log_buf_put_value writes a field value. Nested json is dumped in
+ * place, never copied, and released if the logger owns it (LOG_KEEP).
+ * Returns 0 if the value cannot be represented, in which case the
+ * caller rewinds the buffer and skips the field like the DOM path does.
+ */
+static int
+log_buf_put_value(struct log_buf_t *b, uint8_t type,
+    const union log_value_t *value, JSON_STRUCT json_any, int behave_type)
+{
+    int ok;
+
+    switch (type) {
+        case LOG_INT:
+            log_buf_put_int(b, value->i);
+            return 1;
+        case LOG_REAL:
+            return log_buf_put_double(b, value->r);
+        case LOG_STRING:
+            return value->s && log_buf_put_string(b, value->s, strlen(value->s));
+        default:
+            break;
+    }
+    if (json_any == NULL || (behave_type != LOG_KEEP && behave_type != LOG_COPY &&
+            behave_type != LOG_SHARE))
+        return 0;
+    ok = JSON_DUMP_CALLBACK(json_any, log_buf_dump_cb, b) == 0;
+    if (behave_type == LOG_KEEP)
+        JSON_DECREF(json_any);
+    return ok;
+}
+
+/**
+ * log_stream_object_begin starts a log_object record in b with the
+ * fields the logger adds on its own.
+ */
+static void
+log_stream_object_begin(struct log_buf_t *b, const struct timespec *now, int level)
+{
+    b->len = 0;
+    b->failed = 0;
+    log_buf_puts(b, "{\"timestamp\": ");
+    if (log_ts_format == LOG_TS_RFC3339) {
+        char tmp[40];
+        size_t n = log_timestamp_rfc3339(now, tmp);
+        log_buf_putc(b, '"');
+        log_buf_put(b, tmp, n);
+        log_buf_putc(b, '"');
+    } else {
+        log_buf_put_int(b, log_timestamp_int(now));
+    }
+#ifdef THREAD_ENABLE
+    struct log_tls_time_t *c = log_thread_cache();
+    log_buf_put(b, c->tid_text, c->tid_len);
+#endif
+    if (level > LOG_LEVEL_NONE && level <= LOG_LEVEL_FATAL) {
+        log_buf_puts(b, ", \"level\": \"");
+        log_buf_put(b, log_level_names[level], strlen(log_level_names[level]));
+        log_buf_putc(b, '"');
+    }
+}
+
+/**
+ * log_stream_object_field appends one field to a log_object record.
+ * Unlike the DOM path, duplicate keys are written as is.
+ */
+static void
+log_stream_object_field(struct log_buf_t *b, struct object_field_t *arg,
+    int behave_type)
+{
+    size_t mark = b->len;
+
+    log_buf_puts(b, ", ");
+    if (!log_buf_put_string(b, arg->key, strlen(arg->key))) {
+        /* the field is skipped, but nested json is still ours to release */
+        if (arg->type != LOG_INT && arg->type != LOG_REAL && arg->type != LOG_STRING &&
+                arg->json_any != NULL && behave_type == LOG_KEEP)
+            JSON_DECREF(arg->json_any);
+        b->len = mark;
+        return;
+    }
+    log_buf_puts(b, ": ");
+    if (!log_buf_put_value(b, arg->type, &arg->value, arg->json_any, behave_type))
+        b->len = mark;
+}
+
+static void
+log_stream_array_begin(struct log_buf_t *b)
+{
+    b->len = 0;
+    b->failed = 0;
+    log_buf_putc(b, '[');
+}
+
+/**
+ * log_stream_array_field appends one element to a log_array record.
+ * first tracks whether a separator is needed.
+ */
+static void
+log_stream_array_field(struct log_buf_t *b, struct array_field_t *arg,
+    int behave_type, int *first)
+{
+    size_t mark = b->len;
+
+    if (!*first)
+        log_buf_puts(b, ", ");
+    if (log_buf_put_value(b, arg->type, &arg->value, arg->json_any, behave_type))
+        *first = 0;
+    else
+        b->len = mark;
+}
+
+/**
+ * log_stream_end closes the record in b with c and writes it to lg.
+ */
+static int
+log_stream_end(struct logger_t *lg, struct log_buf_t *b, char c)
+{
+    log_buf_putc(b, c);
+    log_buf_putc(b, '\n');
+    if (b->failed) {
+        log_stats_end(0);
+        return LOG_NO_ACTION;
+    }
+    return log_write_line(lg, b->data, b->len, 1);
+}
+
+/**
+ * log_bin_tags are the tags of the LOG_SERIALIZE_BINARY encoding. A
+ * record is one frame: LOG_BIN_OBJECT or LOG_BIN_ARRAY, the varint
+ * length of the rest, the varint id of the writer and a byte of
+ * log_bin_flags. An object frame goes on with the timestamp as varint
+ * seconds (zigzag) and nanoseconds, then the thread id and the level
+ * byte if the flags say so, then its fields as key and value pairs up
+ * to a 0 key. An array frame holds values up to LOG_BIN_END.
+ *
+ * A value is a tag and its body. LOG_BIN_INT, LOG_BIN_REAL and
+ * LOG_BIN_STRING are the scalars of object_int, object_real and
+ * object_string, the other tags nested json values. Integers are
+ * zigzag varints, reals the 8 little endian bytes of the double and
+ * strings a varint length and the bytes. LOG_BIN_JSON_OBJECT holds key
+ * and value pairs up to a 0 key, LOG_BIN_JSON_ARRAY values up to
+ * LOG_BIN_END.
+ *
+ * A key is a varint k followed, if k is odd, by the key as a string.
+ * k >> 1 is the key's id in the writer's dictionary: an odd k defines
+ * it, an even one refers to it. Id 0 is a key that is not kept.
+ */
+static enum {
+    LOG_BIN_END,
+    LOG_BIN_INT,
+    LOG_BIN_REAL,
+    LOG_BIN_STRING,
+    LOG_BIN_JSON_INT,
+    LOG_BIN_JSON_REAL,
+    LOG_BIN_JSON_STRING,
+    LOG_BIN_TRUE,
+    LOG_BIN_FALSE,
+    LOG_BIN_NULL,
+    LOG_BIN_JSON_OBJECT,
+    LOG_BIN_JSON_ARRAY
+} log_bin_tags __attribute__((unused));
+
+/**
+ * log_bin_flags describe what an object frame carries. The low bits
+ * are the log_timestamp_types value it was logged with. LOG_BIN_RESET
+ * says the writer started a new dictionary with this frame.
+ */
+static enum {
+    LOG_BIN_TS_MASK = 0x07,
+    LOG_BIN_THREAD = 0x08,
+    LOG_BIN_LEVEL = 0x10,
+    LOG_BIN_RESET = 0x20
+} log_bin_flags __attribute__((unused));
+
+#define LOG_BIN_OBJECT 'O'
+#define LOG_BIN_ARRAY  'A'
+
+/**
+ * LOG_BIN_HEAD is the room left in front of a frame for its kind and
+ * length, which are only known once the frame is complete.
+ */
+#define LOG_BIN_HEAD 6
+
+/**
+ * LOG_BIN_KEYS bounds the keys a writer's dictionary holds. Keys
+ * beyond it are written out in every record.
+ */
+#ifndef LOG_BIN_KEYS
+#define LOG_BIN_KEYS 1024
+#endif
+
+struct log_bin_key_t {
+    uint32_t hash;
+    uint32_t len;
+    int valid;
+    char *key;
+};
+
+/**
+ * log_bin_dict_t is the key dictionary of one thread. It belongs to
+ * the logger it was last used with and starts over when the thread
+ * logs to another one, when that logger is opened again or after a
+ * fork. A frame that defined keys and was not written clears it, so
+ * no key is referred to before its definition reached the file.
+ */
+struct log_bin_dict_t {
+    const struct logger_t *lg;
+    unsigned int epoch;
+    unsigned int forks;
+    uint64_t writer;
+    int reset;
+    int defined;
+    uint32_t count;
+    uint32_t slots[2 * LOG_BIN_KEYS];
+    struct log_bin_key_t keys[LOG_BIN_KEYS];
+};
+
+static __thread struct log_bin_dict_t *log_tls_bin;
+
+static unsigned int log_bin_forks;
+
+static void
+log_bin_dict_clear(struct log_bin_dict_t *d)
+{
+    for (uint32_t i = 0; i < d->count; i++)
+        free(d->keys[i].key);
+    memset(d->slots, 0, sizeof(d->slots));
+    d->count = 0;
+    d->reset = 1;
+}
+
+#ifdef THREAD_ENABLE
+static pthread_once_t log_bin_once = PTHREAD_ONCE_INIT;
+
+static pthread_key_t log_bin_key_exit;
+
+static void
+log_bin_atfork_child()
+{
+    log_bin_forks++;
+}
+
+/**
+ * log_bin_thread_exit frees the dictionary of a thread that exits.
+ */
+static void
+log_bin_thread_exit(void *arg)
+{
+    struct log_bin_dict_t *d = (struct log_bin_dict_t *)arg;
+
+    log_bin_dict_clear(d);
+    free(d);
+    log_tls_bin = NULL;
+}
+
+static void
+log_bin_once_init()
+{
+    pthread_atfork(NULL, NULL, log_bin_atfork_child);
+    pthread_key_create(&log_bin_key_exit, log_bin_thread_exit);
+}
+#endif
+
+/**
+ * log_bin_writer returns the id frames of the calling thread carry. It
+ * is the kernel thread id where there is one, so that writers stay
+ * apart when several processes write the same file.
+ */
+static uint64_t
+log_bin_writer()
+{
+#ifdef __linux__
+    return (uint64_t)syscall(SYS_gettid);
+#else
+    static unsigned int next;
+    return ((uint64_t)getpid() << 16) |
+        (__atomic_add_fetch(&next, 1, __ATOMIC_RELAXED) & 0xFFFF);
+#endif
+}
+
+/**
+ * log_bin_dict returns the calling thread's dictionary for lg, or NULL
+ * if it cannot be allocated, in which case keys are written out.
+ */
+static struct log_bin_dict_t *
+log_bin_dict(const struct logger_t *lg)
+{
+    struct log_bin_dict_t *d = log_tls_bin;
+    unsigned int epoch;
+
+    if (d == NULL) {
+#ifdef THREAD_ENABLE
+        pthread_once(&log_bin_once, log_bin_once_init);
+#endif
+        if ((d = (struct log_bin_dict_t *)calloc(1, sizeof(*d))) == NULL) {
+            perror("unable to allocation memory for key dictionary");
+            return NULL;
+        }
+#ifdef THREAD_ENABLE
+        pthread_setspecific(log_bin_key_exit, d);
+#endif
+        d->forks = log_bin_forks;
+        d->writer = log_bin_writer();
+        log_tls_bin = d;
+        d->reset = 1;
+    } else if (d->forks != log_bin_forks) {
+        d->forks = log_bin_forks;
+        d->writer = log_bin_writer();
+        log_bin_dict_clear(d);
+    }
+    epoch = __atomic_load_n(&lg->bin_epoch, __ATOMIC_RELAXED);
+    if (d->lg != lg || d->epoch != epoch) {
+        log_bin_dict_clear(d);
+        d->lg = lg;
+        d->epoch = epoch;
+    }
+    return d;
+}
+
+static inline void
+log_bin_varint(struct log_buf_t *b, uint64_t v)
+{
+    char tmp[10];
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        tmp[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    tmp[n++] = (char)v;
+    log_buf_put(b, tmp, n);
+}
+
+static inline uint64_t
+log_bin_zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline void
+log_bin_double(struct log_buf_t *b, double v)
+{
+    uint64_t u;
+    char tmp[8];
+
+    memcpy(&u, &v, sizeof(u));
+    for (int i = 0; i < 8; i++)
+        tmp[i] = (char)(u >> (8 * i));
+    log_buf_put(b, tmp, sizeof(tmp));
+}
+
+static inline void
+log_bin_string(struct log_buf_t *b, const char *s, size_t n)
+{
+    log_bin_varint(b, n);
+    log_buf_put(b, s, n);
+}
+
+/**
+ * log_utf8_valid says whether the n bytes at s are valid UTF-8.
+ */
+static int
+log_utf8_valid(const char *s, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)s;
+
+    for (size_t i = 0; (i = log_escape_scan(p, i, n, 1)) < n; i++) {
+        if (p[i] >= 0x80) {
+            size_t len = log_utf8_len(p + i, n - i);
+            if (len == 0)
+                return 0;
+            i += len - 1;
+        }
+    }
+    return 1;
+}
+
+static inline uint32_t
+log_bin_hash(const char *s, size_t n)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+/**
+ * log_bin_key writes key, by reference if the dictionary d has it and
+ * as a definition the first time. Returns 0, writing nothing, if check
+ * is set and key is not valid UTF-8.
+ */
+static int
+log_bin_key(struct log_buf_t *b, struct log_bin_dict_t *d, const char *key,
+    int check)
+{
+    const uint32_t mask = 2 * LOG_BIN_KEYS - 1;
+    size_t len = strlen(key);
+    struct log_bin_key_t *k;
+    uint32_t h, i;
+    int valid;
+
+    if (d == NULL) {
+        if (check && !log_utf8_valid(key, len))
+            return 0;
+        log_bin_varint(b, 1);
+        log_bin_string(b, key, len);
+        return 1;
+    }
+    h = log_bin_hash(key, len);
+    for (i = h & mask; d->slots[i] != 0; i = (i + 1) & mask) {
+        k = &d->keys[d->slots[i] - 1];
+        if (k->hash == h && k->len == len && memcmp(k->key, key, len) == 0) {
+            if (check && !k->valid)
+                return 0;
+            log_bin_varint(b, (uint64_t)d->slots[i] << 1);
+            return 1;
+        }
+    }
+
+    valid = log_utf8_valid(key, len);
+    if (check && !valid)
+        return 0;
+    k = &d->keys[d->count];
+    if (d->count == LOG_BIN_KEYS || (k->key = (char *)malloc(len)) == NULL) {
+        log_bin_varint(b, 1);
+        log_bin_string(b, key, len);
+        return 1;
+    }
+    memcpy(k->key, key, len);
+    k->hash = h;
+    k->len = (uint32_t)len;
+    k->valid = valid;
+    d->slots[i] = ++d->count;
+    d->defined++;
+    log_bin_varint(b, ((uint64_t)d->count << 1) | 1);
+    log_bin_string(b, key, len);
+    return 1;
+}
+
+/**
+ * log_bin_json writes a nested json value as it is, members in the
+ * order json_dump_callback writes them.
+ */
+static void
+log_bin_json(struct log_buf_t *b, struct log_bin_dict_t *d, JSON_STRUCT v)
+{
+    const char *key;
+    JSON_STRUCT m;
+    size_t i;
+
+    switch (json_typeof(v)) {
+        case JSON_OBJECT:
+            log_buf_putc(b, LOG_BIN_JSON_OBJECT);
+            json_object_foreach(v, key, m) {
+                log_bin_key(b, d, key, 0);
+                log_bin_json(b, d, m);
+            }
+            log_buf_putc(b, 0);
+            break;
+        case JSON_ARRAY:
+            log_buf_putc(b, LOG_BIN_JSON_ARRAY);
+            json_array_foreach(v, i, m)
+                log_bin_json(b, d, m);
+            log_buf_putc(b, LOG_BIN_END);
+            break;
+        case JSON_STRING:
+            log_buf_putc(b, LOG_BIN_JSON_STRING);
+            log_bin_string(b, json_string_value(v), json_string_length(v));
+            break;
+        case JSON_INTEGER:
+            log_buf_putc(b, LOG_BIN_JSON_INT);
+            log_bin_varint(b, log_bin_zigzag(json_integer_value(v)));
+            break;
+        case JSON_REAL:
+            log_buf_putc(b, LOG_BIN_JSON_REAL);
+            log_bin_double(b, json_real_value(v));
+            break;
+        case JSON_TRUE:
+            log_buf_putc(b, LOG_BIN_TRUE);
+            break;
+        case JSON_FALSE:
+            log_buf_putc(b, LOG_BIN_FALSE);
+            break;
+        default:
+            log_buf_putc(b, LOG_BIN_NULL);
+            break;
+    }
+}
+
+/**
+ * log_bin_value_ok says whether a field value gets written, by the
+ * same rules as log_buf_put_value, so that the decoded record is the
+ * one the stream path writes.
+ */
+static int
+log_bin_value_ok(uint8_t type, const union log_value_t *value,
+    JSON_STRUCT json_any, int behave_type)
+{
+    switch (type) {
+        case LOG_INT:
+            return 1;
+        case LOG_REAL:
+            return value->r == value->r && value->r - value->r == 0;
+        case LOG_STRING:
+            return value->s != NULL &&
+                (!log_utf8_check || log_utf8_valid(value->s, strlen(value->s)));
+        default:
+            return json_any != NULL && (behave_type == LOG_KEEP ||
+                behave_type == LOG_COPY || behave_type == LOG_SHARE);
+    }
+}
+
+static void
+log_bin_value(struct log_buf_t *b, struct log_bin_dict_t *d, uint8_t type,
+    const union log_value_t *value, JSON_STRUCT json_any)
+{
+    switch (type) {
+        case LOG_INT:
+            log_buf_putc(b, LOG_BIN_INT);
+            log_bin_varint(b, log_bin_zigzag(value->i));
+            break;
+        case LOG_REAL:
+            log_buf_putc(b, LOG_BIN_REAL);
+            log_bin_double(b, value->r);
+            break;
+        case LOG_STRING:
+            log_buf_putc(b, LOG_BIN_STRING);
+            log_bin_string(b, value->s, strlen(value->s));
+            break;
+        default:
+            log_bin_json(b, d, json_any);
+            break;
+    }
+}
+
+static inline void
+log_bin_release(uint8_t type, JSON_STRUCT json_any, int behave_type)
+{
+    if (type != LOG_INT && type != LOG_REAL && type != LOG_STRING &&
+            json_any != NULL && behave_type == LOG_KEEP)
+        JSON_DECREF(json_any);
+}
+
+/**
+ * log_bin_begin starts a frame in b, leaving LOG_BIN_HEAD bytes for
+ * log_bin_end, and returns the dictionary its keys go through.
+ */
+static struct log_bin_dict_t *
+log_bin_begin(struct logger_t *lg, struct log_buf_t *b, int flags)
+{
+    struct log_bin_dict_t *d;
+
+    log_bin_enter(lg);
+    d = log_bin_dict(lg);
+    b->len = 0;
+    b->failed = 0;
+    if (log_buf_reserve(b, LOG_BIN_HEAD))
+        b->len = LOG_BIN_HEAD;
+    if (d == NULL) {
+        b->failed = 1;
+        return NULL;
+    }
+    d->defined = 0;
+    log_bin_varint(b, d->writer);
+    log_buf_putc(b, (char)(flags | (d->reset ? LOG_BIN_RESET : 0)));
+    return d;
+}
+
+/**
+ * log_bin_object_begin starts a log_object frame in b with what the
+ * logger adds on its own, raw: the decoder formats it.
+ */
+static struct log_bin_dict_t *
+log_bin_object_begin(struct logger_t *lg, struct log_buf_t *b,
+    const struct timespec *now, int level)
+{
+    int with_level = level > LOG_LEVEL_NONE && level <= LOG_LEVEL_FATAL;
+    int flags = log_ts_format | (with_level ? LOG_BIN_LEVEL : 0);
+    struct log_bin_dict_t *d;
+
+#ifdef THREAD_ENABLE
+    flags |= LOG_BIN_THREAD;
+#endif
+    d = log_bin_begin(lg, b, flags);
+    log_bin_varint(b, log_bin_zigzag(now->tv_sec));
+    log_bin_varint(b, (uint64_t)now->tv_nsec);
+#ifdef THREAD_ENABLE
+    log_bin_varint(b, log_thread_cache()->tid);
+#endif
+    if (with_level)
+        log_buf_putc(b, (char)level);
+    return d;
+}
+
+/**
+ * log_bin_object_field appends one field to a log_object frame, or
+ * skips it where log_stream_object_field would.
+ */
+static void
+log_bin_object_field(struct log_buf_t *b, struct log_bin_dict_t *d,
+    struct object_field_t *arg, int behave_type)
+{
+    if (log_bin_value_ok(arg->type, &arg->value, arg->json_any, behave_type) &&
+            log_bin_key(b, d, arg->key, log_utf8_check))
+        log_bin_value(b, d, arg->type, &arg->value, arg->json_any);
+    log_bin_release(arg->type, arg->json_any, behave_type);
+}
+
+static void
+log_bin_array_field(struct log_buf_t *b, struct log_bin_dict_t *d,
+    struct array_field_t *arg, int behave_type)
+{
+    if (log_bin_value_ok(arg->type, &arg->value, arg->json_any, behave_type))
+        log_bin_value(b, d, arg->type, &arg->value, arg->json_any);
+    log_bin_release(arg->type, arg->json_any, behave_type);
+}
+
+/**
+ * log_bin_end closes the frame in b, puts its kind and length in front
+ * of it and writes it to lg.
+ */
+static int
+log_bin_end(struct logger_t *lg, struct log_buf_t *b,
+    struct log_bin_dict_t *d, char kind)
+{
+    char head[LOG_BIN_HEAD];
+    size_t n, len, off;
+    int wc;
+
+    log_buf_putc(b, 0);
+    if (b->failed) {
+        if (d != NULL && d->defined)
+            log_bin_dict_clear(d);
+        log_bin_leave(lg);
+        log_stats_end(0);
+        return LOG_NO_ACTION;
+    }
+
+    len = b->len - LOG_BIN_HEAD;
+    n = 1;
+    head[0] = kind;
+    for (; len >= 0x80; len >>= 7)
+        head[n++] = (char)(len | 0x80);
+    head[n++] = (char)len;
+    off = LOG_BIN_HEAD - n;
+    memcpy(b->data + off, head, n);
+
+    wc = log_write_line(lg, b->data + off, b->len - off, 1);
+    if (wc == (int)(b->len - off))
+        d->reset = 0;
+    else if (d->defined)
+        log_bin_dict_clear(d);
+    log_bin_leave(lg);
+    return wc;
+}
+
+/**
+ * log_schema_key_t is one field of a schema: its type and its key as
+ * the ", \"key\": " text that precedes the value.
+ */
+struct log_schema_key_t {
+    int type;
+    size_t len;
+    const char *frag;
+};
+
+struct log_schema_t {
+    size_t n;
+    size_t frag_total;
+    struct log_schema_key_t keys[];
+};
+
+/**
+ * log_schema_new registers a schema of n fields. The keys are escaped
+ * once here and copied, so fields may go away afterwards. Returns NULL
+ * for a key that is not valid UTF-8 or a type a schema can't hold.
+ */
+struct log_schema_t *
+log_schema_new(const struct log_schema_field_t *fields, size_t n)
+{
+    struct log_buf_t text = { NULL, 0, 0, 0 };
+    struct log_schema_t *sch = NULL;
+    size_t *ends = (size_t *)malloc((n + 1) * sizeof(size_t));
+
+    if (ends == NULL)
+        goto fail;
+    for (size_t i = 0; i < n; i++) {
+        switch (fields[i].type) {
+            case LOG_INT:
+            case LOG_REAL:
+            case LOG_STRING:
+            case LOG_BOOLEAN:
+                break;
+            default:
+                goto fail;
+        }
+        log_buf_puts(&text, ", ");
+        if (!log_buf_put_string(&text, fields[i].key, strlen(fields[i].key)))
+            goto fail;
+        log_buf_puts(&text, ": ");
+        ends[i] = text.len;
+    }
+    if (text.failed)
+        goto fail;
+
+    sch = (struct log_schema_t *)malloc(sizeof(struct log_schema_t) +
+        n * sizeof(struct log_schema_key_t) + text.len);
+    if (sch == NULL) {
+        perror("unable to allocation memory for schema");
+        goto fail;
+    }
+    char *frags = (char *)&sch->keys[n];
+    if (text.len)
+        memcpy(frags, text.data, text.len);
+    sch->n = n;
+    sch->frag_total = text.len;
+    for (size_t i = 0, start = 0; i < n; start = ends[i++]) {
+        sch->keys[i].type = fields[i].type;
+        sch->keys[i].frag = frags + start;
+        sch->keys[i].len = ends[i] - start;
+    }
+    free(ends);
+    free(text.data);
+    return sch;
+fail:
+    free(ends);
+    free(text.data);
+    return NULL;
+}
+
+void
+log_schema_free(struct log_schema_t *sch)
+{
+    free(sch);
+}
+
+/**
+ * reallogger_schema writes a record laid out by sch to lg from its n
+ * values. It always uses the streaming serializer: the cached key
+ * fragments are copied in and only the values are formatted. Like
+ * log_object, a NULL string, a value JSON can't hold or a value of the
+ * wrong type drops just that field.
+ */
+int
+reallogger_schema(struct logger_t *lg, int level, const struct log_schema_t *sch,
+    const struct log_schema_value_t *values, size_t n)
+{
+    struct log_buf_t *b = &log_tls_buf;
+    struct timespec now;
+    int wc;
+
+    log_stats_begin();
+    log_clock_now(&now);
+    log_stream_object_begin(b, &now, level);
+    log_buf_reserve(b, sch->frag_total + sch->n * 24 + 2);
+
+    if (n > sch->n)
+        n = sch->n;
+    for (size_t i = 0; i < n; i++) {
+        const struct log_schema_key_t *k = &sch->keys[i];
+        const struct log_schema_value_t *v = &values[i];
+        size_t mark = b->len;
+        int ok;
+
+        log_buf_put(b, k->frag, k->len);
+        switch (k->type) {
+            case LOG_INT:
+                if ((ok = v->type == LOG_INT))
+                    log_buf_put_int(b, v->u.i);
+                break;
+            case LOG_REAL:
+                if (v->type == LOG_INT)
+                    ok = log_buf_put_double(b, (double)v->u.i);
+                else
+                    ok = v->type == LOG_REAL && log_buf_put_double(b, v->u.d);
+                break;
+            case LOG_STRING:
+                ok = v->type == LOG_STRING && v->u.s != NULL &&
+                    log_buf_put_string(b, v->u.s, strlen(v->u.s));
+                break;
+            default:
+                if (!(ok = v->type == LOG_BOOLEAN || v->type == LOG_INT))
+                    break;
+                if (v->u.i)
+                    log_buf_puts(b, "true");
+                else
+                    log_buf_puts(b, "false");
+                break;
+        }
+        if (!ok)
+            b->len = mark;
+    }
+    wc = log_stream_end(lg, b, '}');
+
+    if (level == LOG_LEVEL_FATAL)
+        log_fatal_exit();
+    return wc;
+}
+
+/**
+ * log_prep_t keeps its serialized form in text: the value of a leaf,
+ * or the whole {...} or [...] of a container. Setting a leaf marks the
+ * path up to the root dirty; a clean container is copied from text as
+ * is. key is the member's pre-escaped "\"key\": " text in an object.
+ * A prepared record may be used by one thread at a time.
+ */
+struct log_prep_t {
+    int type;
+    int dirty;
+    int present;
+    char *key;
+    size_t key_len;
+    struct log_buf_t text;
+    struct log_prep_t *parent;
+    struct log_prep_t *first;
+    struct log_prep_t *last;
+    struct log_prep_t *next;
+};
+
+static struct log_prep_t *
+log_prep_new(int type)
+{
+    struct log_prep_t *node = (struct log_prep_t *)calloc(1, sizeof(struct log_prep_t));
+
+    if (node == NULL) {
+        perror("unable to allocation memory for prepared record");
+        return NULL;
+    }
+    node->type = type;
+    node->present = (type == LOG_OBJECT || type == LOG_ARRAY);
+    node->dirty = node->present;
+    return node;
+}
+
+/**
+ * log_prep_object/log_prep_array create the root of a prepared record
+ * or a container to add to one. Only objects can be logged as records.
+ */
+struct log_prep_t *
+log_prep_object()
+{
+    return log_prep_new(LOG_OBJECT);
+}
+
+struct log_prep_t *
+log_prep_array()
+{
+    return log_prep_new(LOG_ARRAY);
+}
+
+/**
+ * log_prep_add appends a child of type LOG_INT, LOG_REAL, LOG_STRING,
+ * LOG_BOOLEAN, LOG_OBJECT or LOG_ARRAY to parent and returns it. key
+ * names the member in an object and is ignored in an array. Leaves
+ * are left out of the output until they are given a value.
+ */
+struct log_prep_t *
+log_prep_add(struct log_prep_t *parent, const char *key, int type)
+{
+    struct log_prep_t *node;
+
+    if (parent == NULL || (parent->type != LOG_OBJECT && parent->type != LOG_ARRAY))
+        return NULL;
+    switch (type) {
+        case LOG_INT:
+        case LOG_REAL:
+        case LOG_STRING:
+        case LOG_BOOLEAN:
+        case LOG_OBJECT:
+        case LOG_ARRAY:
+            break;
+        default:
+            return NULL;
+    }
+    if ((node = log_prep_new(type)) == NULL)
+        return NULL;
+    if (parent->type == LOG_OBJECT) {
+        struct log_buf_t k = { NULL, 0, 0, 0 };
+        if (key == NULL || !log_buf_put_string(&k, key, strlen(key))) {
+            free(k.data);
+            free(node);
+            return NULL;
+        }
+        log_buf_puts(&k, ": ");
+        if (k.failed) {
+            free(k.data);
+            free(node);
+            return NULL;
+        }
+        node->key = k.data;
+        node->key_len = k.len;
+    }
+    node->parent = parent;
+    if (parent->last != NULL)
+        parent->last->next = node;
+    else
+        parent->first = node;
+    parent->last = node;
+    for (; parent != NULL && !parent->dirty; parent = parent->parent)
+        parent->dirty = 1;
+    return node;
+}
+
+/**
+ * log_prep_touch marks the path from a changed leaf up to the root
+ * dirty. Everything above a dirty node already is.
+ */
+static void
+log_prep_touch(struct log_prep_t *leaf, int present)
+{
+    struct log_prep_t *p;
+
+    leaf->present = present && !leaf->text.failed;
+    for (p = leaf->parent; p != NULL && !p->dirty; p = p->parent)
+        p->dirty = 1;
+}
+
+/**
+ * The log_prep_set_ functions give a leaf of the matching type a new
+ * value, formatted right away. They return 0 for a leaf of another
+ * type; a value JSON can't hold leaves the field out until it is set
+ * again.
+ */
+int
+log_prep_set_int(struct log_prep_t *leaf, int value)
+{
+    if (leaf == NULL || leaf->type != LOG_INT)
+        return 0;
+    leaf->text.len = 0;
+    leaf->text.failed = 0;
+    log_buf_put_int(&leaf->text, value);
+    log_prep_touch(leaf, 1);
+    return leaf->present;
+}
+
+int
+log_prep_set_real(struct log_prep_t *leaf, double value)
+{
+    if (leaf == NULL || leaf->type != LOG_REAL)
+        return 0;
+    leaf->text.len = 0;
+    leaf->text.failed = 0;
+    log_prep_touch(leaf, log_buf_put_double(&leaf->text, value));
+    return leaf->present;
+}
+
+int
+log_prep_set_string(struct log_prep_t *leaf, const char *value)
+{
+    if (leaf == NULL || leaf->type != LOG_STRING)
+        return 0;
+    leaf->text.len = 0;
+    leaf->text.failed = 0;
+    log_prep_touch(leaf, value != NULL &&
+        log_buf_put_string(&leaf->text, value, strlen(value)));
+    return leaf->present;
+}
+
+int
+log_prep_set_bool(struct log_prep_t *leaf, int value)
+{
+    if (leaf == NULL || leaf->type != LOG_BOOLEAN)
+        return 0;
+    leaf->text.len = 0;
+    leaf->text.failed = 0;
+    if (value)
+        log_buf_puts(&leaf->text, "true");
+    else
+        log_buf_puts(&leaf->text, "false");
+    log_prep_touch(leaf, 1);
+    return leaf->present;
+}
+
+/**
+ * log_prep_free releases node and everything below it. node must be a
+ * root or its parent must be freed along with it.
+ */
+void
+log_prep_free(struct log_prep_t *node)
+{
+    struct log_prep_t *c, *next;
+
+    if (node == NULL)
+        return;
+    for (c = node->first; c != NULL; c = next) {
+        next = c->next;
+        log_prep_free(c);
+    }
+    free(node->key);
+    free(node->text.data);
+    free(node);
+}
+
+/**
+ * log_prep_render brings the text of a dirty container up to date,
+ * reusing the text of every clean child.
+ */
+static void
+log_prep_render(struct log_prep_t *node)
+{
+    struct log_buf_t *t = &node->text;
+    struct log_prep_t *c;
+    int first = 1;
+
+    if (!node->dirty)
+        return;
+    t->len = 0;
+    t->failed = 0;
+    log_buf_putc(t, node->type == LOG_OBJECT ? '{' : '[');
+    for (c = node->first; c != NULL; c = c->next) {
+        log_prep_render(c);
+        if (!c->present)
+            continue;
+        if (!first)
+            log_buf_puts(t, ", ");
+        if (c->key != NULL)
+            log_buf_put(t, c->key, c->key_len);
+        log_buf_put(t, c->text.data, c->text.len);
+        first = 0;
+    }
+    log_buf_putc(t, node->type == LOG_OBJECT ? '}' : ']');
+    node->dirty = t->failed;
+}
+
+/**
+ * reallogger_prepared writes the prepared object root as a record to
+ * lg, with the timestamp and other fields the logger adds in front.
+ * It always uses the streaming serializer.
+ */
+int
+reallogger_prepared(struct logger_t *lg, int level, struct log_prep_t *root)
+{
+    struct log_buf_t *b = &log_tls_buf;
+    struct timespec now;
+    int wc;
+
+    if (root == NULL || root->type != LOG_OBJECT)
+        return LOG_NO_ACTION;
+    log_stats_begin();
+    log_clock_now(&now);
+    log_prep_render(root);
+    log_stream_object_begin(b, &now, level);
+    if (root->text.failed) {
+        b->failed = 1;
+    } else if (root->text.len > 2) {
+        /* splice the members in after the logger's own fields */
+        log_buf_puts(b, ", ");
+        log_buf_put(b, root->text.data + 1, root->text.len - 2);
+    }
+    wc = log_stream_end(lg, b, '}');
+
+    if (level == LOG_LEVEL_FATAL)
+        log_fatal_exit();
+    return wc;
+}
+
+/**
+ * log_dom_object_begin creates the root of a log_object record with
+ * the fields the logger adds on its own.
+ */
+static JSON_STRUCT
+log_dom_object_begin(const struct timespec *now, int level)
+{
+    JSON_STRUCT root = JSON_OBJECT();
+    JSON_OBJECT_ADD("timestamp", log_timestamp_json(now));
+
+#ifdef THREAD_ENABLE
+    JSON_OBJECT_ADD("thread_id", JSON_INTEGER(log_thread_cache()->tid));
+#endif
+    if (level > LOG_LEVEL_NONE && level <= LOG_LEVEL_FATAL)
+        JSON_OBJECT_ADD("level", JSON_STRING(log_level_names[level]));
+    return root;
+}
+
+/**
+ * log_dom_end dumps a finished record, writes it to lg and releases
+ * the tree.
+ */
+static int
+log_dom_end(struct logger_t *lg, JSON_STRUCT root)
+{
+    char* json_2_str = JSON_DUMPS(root);
+    size_t len = 0;
+
+    if (json_2_str != NULL) {
+        len = strlen(json_2_str);
+        json_2_str[len++] = '\n'; // the terminator slot carries the newline
+    }
+    int wc = log_write_line(lg, json_2_str, len, 0);
+
+    JSON_DECREF(root); // decrement the count on the JSON object
+
+    return wc;
+}
+
+/**
+ * log_track_t is a tracked collection. For an array, emitted counts
+ * the elements already written and only those past it are written
+ * next; elements are taken to be append-only, so an element edited in
+ * place after it was written is not picked up. For an object, seen
+ * holds a copy of every member as last written, and members are
+ * compared against it. A write that fails makes the next record a
+ * full reset.
+ */
+struct log_track_t {
+    char *stream;
+    JSON_STRUCT json;
+    JSON_STRUCT seen;
+    size_t emitted;
+    uint64_t seq;
+    int resync;
+#ifdef THREAD_ENABLE
+    pthread_mutex_t lock;
+#endif
+};
+
+/**
+ * log_track_new starts tracking collection, an array or object, under
+ * the stream id stream. The tracker holds a reference to collection
+ * until log_track_free. The first record of a stream is always a full
+ * reset.
+ */
+struct log_track_t *
+log_track_new(const char *stream, JSON_STRUCT collection)
+{
+    struct log_track_t *t;
+
+    if (stream == NULL || !(JSON_IS_ARRAY(collection) || JSON_IS_OBJECT(collection)))
+        return NULL;
+    t = (struct log_track_t *)calloc(1, sizeof(struct log_track_t));
+    if (t == NULL)
+        return NULL;
+    if ((t->stream = strdup(stream)) == NULL) {
+        free(t);
+        return NULL;
+    }
+    t->json = json_incref(collection);
+    t->resync = 1;
+#ifdef THREAD_ENABLE
+    pthread_mutex_init(&t->lock, NULL);
+#endif
+    return t;
+}
+
+void
+log_track_free(struct log_track_t *t)
+{
+    if (t == NULL)
+        return;
+    JSON_DECREF(t->json);
+    if (t->seen != NULL)
+        JSON_DECREF(t->seen);
+#ifdef THREAD_ENABLE
+    pthread_mutex_destroy(&t->lock);
+#endif
+    free(t->stream);
+    free(t);
+}
+
+/**
+ * log_track_array collects the elements of t's array not written yet
+ * into *items, or all of them for a reset. Returns the record's op, or
+ * NULL when nothing changed.
+ */
+static const char *
+log_track_array(struct log_track_t *t, JSON_STRUCT *items)
+{
+    size_t n = JSON_ARRAY_SIZE(t->json), i = t->emitted;
+    const char *op = "append";
+
+    if (n < t->emitted || t->resync) {
+        op = "reset";
+        i = 0;
+    } else if (n == t->emitted) {
+        return NULL;
+    }
+    *items = JSON_ARRAY();
+    for (; i < n; i++)
+        json_array_append(*items, json_array_get(t->json, i));
+    t->emitted = n;
+    return op;
+}
+
+/**
+ * log_track_object collects the members of t's object that are new or
+ * differ from what was last written into *set and the keys that went
+ * away into *del, or the whole object into *set for a reset. Returns
+ * the record's op, or NULL when nothing changed.
+ */
+static const char *
+log_track_object(struct log_track_t *t, JSON_STRUCT *set, JSON_STRUCT *del)
 {
-    struct array_field_t *field = array_field_new();
-    field->type = LOG_STRING;
-    field->json_any = JSON_STRING(value);
-    return field;
+    const char *key;
+    JSON_STRUCT v;
+
+    if (t->resync) {
+        if (t->seen != NULL)
+            JSON_DECREF(t->seen);
+        t->seen = JSON_COPY(t->json);
+        *set = json_incref(t->json);
+        return "reset";
+    }
+
+    *set = JSON_OBJECT();
+    *del = JSON_ARRAY();
+    json_object_foreach(t->json, key, v) {
+        JSON_STRUCT old = json_object_get(t->seen, key);
+        if (old == NULL || !json_equal(old, v)) {
+            json_object_set(*set, key, v);
+            json_object_set_new(t->seen, key, JSON_COPY(v));
+        }
+    }
+    json_object_foreach(t->seen, key, v) {
+        if (json_object_get(t->json, key) == NULL)
+            json_array_append_new(*del, JSON_STRING(key));
+    }
+    for (size_t i = 0; i < JSON_ARRAY_SIZE(*del); i++)
+        json_object_del(t->seen, json_string_value(json_array_get(*del, i)));
+
+    if (json_object_size(*set) == 0 && JSON_ARRAY_SIZE(*del) == 0) {
+        JSON_DECREF(*set);
+        JSON_DECREF(*del);
+        return NULL;
+    }
+    return "update";
 }
 
 /**
- * array_array is used to add a array to the
- * log entry.
+ * reallogger_track writes the changes to t's collection since the last
+ * record of its stream as one record tagged with the stream id and a
+ * sequence number that goes up by one per record, so a reader can
+ * apply them in order and notice a missing one:
+ *
+ *   {"stream": "s", "seq": 0, "op": "reset", "items": [...]}
+ *   {"stream": "s", "seq": 1, "op": "append", "items": [...]}
+ *   {"stream": "o", "seq": 4, "op": "update", "set": {...}, "del": [...]}
+ *
+ * An array that got shorter is written again in full as a reset.
+ * Returns LOG_NO_ACTION without writing when nothing changed.
  */
-struct array_field_t*
-array_array(JSON_STRUCT array)
+int
+reallogger_track(struct logger_t *lg, int level, struct log_track_t *t)
 {
-    struct array_field_t *field = array_field_new();
-    field->type = LOG_ARRAY;
-    field->json_any = array;
-    return field;
+    JSON_STRUCT root;
+    JSON_STRUCT items = NULL;
+    JSON_STRUCT del = NULL;
+    struct timespec now;
+    const char *op;
+    int wc = LOG_NO_ACTION;
+
+    if (t == NULL)
+        return LOG_NO_ACTION;
+#ifdef THREAD_ENABLE
+    pthread_mutex_lock(&t->lock); /* keeps seq in file order */
+#endif
+    if (JSON_IS_ARRAY(t->json))
+        op = log_track_array(t, &items);
+    else
+        op = log_track_object(t, &items, &del);
+
+    if (op != NULL) {
+        log_stats_begin();
+        log_clock_now(&now);
+        root = log_dom_object_begin(&now, level);
+        JSON_OBJECT_ADD("stream", JSON_STRING(t->stream));
+        JSON_OBJECT_ADD("seq", JSON_INTEGER((json_int_t)t->seq++));
+        JSON_OBJECT_ADD("op", JSON_STRING(op));
+        if (JSON_IS_ARRAY(t->json)) {
+            JSON_OBJECT_ADD("items", items);
+        } else {
+            if (json_object_size(items) > 0)
+                JSON_OBJECT_ADD("set", items);
+            else
+                JSON_DECREF(items);
+            if (del != NULL && JSON_ARRAY_SIZE(del) > 0)
+                JSON_OBJECT_ADD("del", del);
+            else if (del != NULL)
+                JSON_DECREF(del);
+        }
+        wc = log_dom_end(lg, root);
+        t->resync = wc <= 0;
+    }
+#ifdef THREAD_ENABLE
+    pthread_mutex_unlock(&t->lock);
+#endif
+
+    if (level == LOG_LEVEL_FATAL)
+        log_fatal_exit();
+    return wc;
 }
 
+static struct log_site_t *log_sites = NULL;
+
+static uint64_t log_site_interval_ns = 60000000000ULL;
+
+static uint64_t log_site_next_ns = 0;
+
+static int log_site_reporting = 0;
+
 /**
- * array_object is used to json object a array to the
- * log entry.
+ * log_set_suppressed_interval sets how often the summary of suppressed
+ * records is written. 0 leaves it to log_site_report and log_close.
  */
-struct array_field_t*
-array_object(JSON_STRUCT object)
+void
+log_set_suppressed_interval(unsigned int interval_ms)
 {
-    struct array_field_t *field = array_field_new();
-    field->type = LOG_OBJECT;
-    field->json_any = object;
-    return field;
+    __atomic_store_n(&log_site_interval_ns,
+        (uint64_t)interval_ms * 1000000ULL, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t
+log_site_clock_ns()
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
 }
 
 /**
- * array_any is used to json object a array to the
- * log entry.
+ * log_site_register pushes site onto log_sites the first time it is
+ * used. The list only grows, so readers need no lock.
  */
-struct array_field_t*
-array_any_json(JSON_STRUCT object)
+static void
+log_site_register(struct log_site_t *site)
 {
-    switch(check_json_type(object)){
-        case LOG_ARRAY:
-            return array_array(object);
-        case LOG_OBJECT:
-            return array_object(object);
-        default:
-            return NULL;
+    int expected = 0;
+    if (!__atomic_compare_exchange_n(&site->registered, &expected, 1, 0,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+    struct log_site_t *head = __atomic_load_n(&log_sites, __ATOMIC_RELAXED);
+    do {
+        site->next = head;
+    } while (!__atomic_compare_exchange_n(&log_sites, &head, site, 1,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * log_site_report writes one record listing, per call site, how many
+ * records were suppressed since the previous report:
+ * {"suppressed": [{"file": .., "line": .., "count": ..}, ..]}.
+ * Nothing is written when no site suppressed anything.
+ */
+void
+log_site_report()
+{
+    if (__atomic_exchange_n(&log_site_reporting, 1, __ATOMIC_ACQUIRE))
+        return;
+
+    JSON_STRUCT list = NULL;
+    struct log_site_t *s = __atomic_load_n(&log_sites, __ATOMIC_ACQUIRE);
+    for (; s != NULL; s = s->next) {
+        uint64_t count = __atomic_load_n(&s->suppressed, __ATOMIC_RELAXED);
+        if (count == s->reported)
+            continue;
+        JSON_STRUCT root = JSON_OBJECT();
+        JSON_OBJECT_ADD("file", JSON_STRING(s->file));
+        JSON_OBJECT_ADD("line", JSON_INTEGER(s->line));
+        JSON_OBJECT_ADD("count", JSON_INTEGER(count - s->reported));
+        s->reported = count;
+        if (list == NULL)
+            list = JSON_ARRAY();
+        json_array_append_new(list, root);
+    }
+
+    if (list != NULL) {
+        struct timespec now;
+        log_clock_now(&now);
+        JSON_STRUCT root = log_dom_object_begin(&now, LOG_LEVEL_NONE);
+        JSON_OBJECT_ADD("suppressed", list);
+        log_dom_end(&log_default, root);
     }
+    __atomic_store_n(&log_site_reporting, 0, __ATOMIC_RELEASE);
 }
 
-#define array_any(x) _Generic((x),  \
-        int: array_int(x),              \
-        double: array_double(x),              \
-        char *: array_string(x),        \
-        JSON_STRUCT: array_any_json(x),        \
-        default: NULL)
+/**
+ * log_stats returns the totals of all threads' counters. Shards are
+ * read without stopping their owners, so a snapshot taken under load
+ * may be a few updates behind.
+ */
+struct log_stats_t
+log_stats()
+{
+    struct log_stats_t st;
+    struct log_stats_shard_t *s;
 
-int
-reallogobject(int behave_type, ...)
+    memset(&st, 0, sizeof(st));
+    for (s = __atomic_load_n(&log_stats_shards, __ATOMIC_ACQUIRE); s != NULL; s = s->next) {
+        st.records += log_stat_load(s->st.records);
+        st.bytes += log_stat_load(s->st.bytes);
+        st.dropped += log_stat_load(s->st.dropped);
+        st.writes += log_stat_load(s->st.writes);
+        st.syncs += log_stat_load(s->st.syncs);
+        log_hist_merge(&st.lock_wait, &s->st.lock_wait);
+        log_hist_merge(&st.queue_wait, &s->st.queue_wait);
+        log_hist_merge(&st.serialize, &s->st.serialize);
+        log_hist_merge(&st.flush, &s->st.flush);
+    }
+#ifdef THREAD_ENABLE
+    struct log_async_stats_t as = log_async_stats();
+    st.dropped += as.dropped_newest + as.dropped_oldest;
+#endif
+    return st;
+}
+
+/**
+ * log_set_stats_interval makes the logger write a stats record every
+ * interval_ms while records are being logged. 0 turns it off.
+ */
+void
+log_set_stats_interval(unsigned int interval_ms)
 {
-    va_list ap;
-    int wc;
-    unsigned long now = (unsigned long)time(NULL); // UNIX timestamp format
+    __atomic_store_n(&log_stats_next_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&log_stats_interval_ns,
+        (uint64_t)interval_ms * 1000000ULL, __ATOMIC_RELAXED);
+}
 
+static JSON_STRUCT
+log_hist_json(const struct log_hist_t *h)
+{
     JSON_STRUCT root = JSON_OBJECT();
-    JSON_OBJECT_ADD("timestamp", JSON_INTEGER(now));
+    JSON_OBJECT_ADD("count", JSON_INTEGER(h->count));
+    JSON_OBJECT_ADD("total_ns", JSON_INTEGER(h->total_ns));
+    JSON_OBJECT_ADD("p50_ns", JSON_INTEGER(log_hist_percentile(h, 50.0)));
+    JSON_OBJECT_ADD("p99_ns", JSON_INTEGER(log_hist_percentile(h, 99.0)));
+    JSON_OBJECT_ADD("p999_ns", JSON_INTEGER(log_hist_percentile(h, 99.9)));
+    JSON_OBJECT_ADD("max_ns", JSON_INTEGER(h->max_ns));
+    return root;
+}
 
-#ifdef THREAD_ENABLE
-    JSON_OBJECT_ADD("thread_id", JSON_INTEGER(pthread_self()));
-#endif
+/**
+ * log_stats_report writes the current log_stats as a record:
+ * {"logger_stats": {"records": .., .., "flush": {"count": .., "p50_ns": ..}}}.
+ * Counters are totals since the process started.
+ */
+void
+log_stats_report()
+{
+    struct log_stats_t st = log_stats();
+    struct timespec now;
+    JSON_STRUCT stats;
+    JSON_STRUCT root = JSON_OBJECT();
 
-    va_start(ap, behave_type);
+    JSON_OBJECT_ADD("interval_ms", JSON_INTEGER(
+        __atomic_load_n(&log_stats_interval_ns, __ATOMIC_RELAXED) / 1000000ULL));
+    JSON_OBJECT_ADD("records", JSON_INTEGER(st.records));
+    JSON_OBJECT_ADD("bytes", JSON_INTEGER(st.bytes));
+    JSON_OBJECT_ADD("dropped", JSON_INTEGER(st.dropped));
+    JSON_OBJECT_ADD("writes", JSON_INTEGER(st.writes));
+    JSON_OBJECT_ADD("syncs", JSON_INTEGER(st.syncs));
+    JSON_OBJECT_ADD("lock_wait", log_hist_json(&st.lock_wait));
+    JSON_OBJECT_ADD("queue_wait", log_hist_json(&st.queue_wait));
+    JSON_OBJECT_ADD("serialize", log_hist_json(&st.serialize));
+    JSON_OBJECT_ADD("flush", log_hist_json(&st.flush));
+    stats = root;
 
-    for (int i = 1;; i++) {
-        struct object_field_t *arg = va_arg(ap, struct object_field_t*);
-        if (arg == NULL) {
-            break;
-        }
-        switch(behave_type){
-            case LOG_KEEP:
-                JSON_OBJECT_ADD(arg->key, arg->json_any);
-            break;
-            case LOG_COPY:
-                JSON_OBJECT_ADD(arg->key, JSON_COPY(arg->json_any));
-            break;
-            default:
-            break;
-        }   
-        object_field_free(arg);
-        continue;
-    }
+    log_clock_now(&now);
+    root = log_dom_object_begin(&now, LOG_LEVEL_NONE);
+    JSON_OBJECT_ADD("logger_stats", stats);
+    log_dom_end(&log_default, root);
+}
 
-    va_end(ap); 
+/**
+ * log_site_suppress counts a suppressed record and writes the summary
+ * when the interval has run out. Only the thread that moves
+ * log_site_next_ns forward writes it.
+ */
+static void
+log_site_suppress(struct log_site_t *site)
+{
+    __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
 
-    char* json_2_str = JSON_DUMPS(root);
+    uint64_t interval = __atomic_load_n(&log_site_interval_ns, __ATOMIC_RELAXED);
+    if (interval == 0)
+        return;
+    uint64_t now = log_site_clock_ns();
+    uint64_t next = __atomic_load_n(&log_site_next_ns, __ATOMIC_RELAXED);
+    if (next == 0) {
+        __atomic_compare_exchange_n(&log_site_next_ns, &next, now + interval,
+            0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        return;
+    }
+    if (now >= next && __atomic_compare_exchange_n(&log_site_next_ns, &next,
+            now + interval, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        log_site_report();
+}
 
-#ifdef THREAD_ENABLE
-    while(pthread_mutex_lock(&lock_edit_log) != 0){ usleep(1); }
-#endif
-    if(log_output){
-        fflush(log_output);
-        wc = fprintf(log_output, "%s\n", json_2_str);
+/**
+ * log_site_sample lets the first of every n records through.
+ */
+static inline int
+log_site_sample(struct log_site_t *site, unsigned int n)
+{
+    if (__builtin_expect(!__atomic_load_n(&site->registered, __ATOMIC_RELAXED), 0))
+        log_site_register(site);
+    if (n <= 1 || __atomic_fetch_add(&site->seen, 1, __ATOMIC_RELAXED) % n == 0)
+        return 1;
+    log_site_suppress(site);
+    return 0;
+}
+
+/**
+ * log_site_limit is a token bucket kept as a single theoretical arrival
+ * time (GCRA): a record passes when it would not push site->tat more
+ * than burst intervals past now.
+ */
+static inline int
+log_site_limit(struct log_site_t *site, unsigned int rate, unsigned int burst)
+{
+    if (__builtin_expect(!__atomic_load_n(&site->registered, __ATOMIC_RELAXED), 0))
+        log_site_register(site);
+    if (rate == 0) {
+        log_site_suppress(site);
+        return 0;
     }
-    else
-        wc = LOG_NO_ACTION;
-#ifdef THREAD_ENABLE
-    pthread_mutex_unlock(&lock_edit_log);
-#endif
 
-    free(json_2_str);
-    
-    JSON_DECREF(root); // decrement the count on the JSON object
+    uint64_t interval = 1000000000ULL / rate;
+    uint64_t limit = interval * (burst ? burst : 1);
+    uint64_t now = log_monotonic_ns();
+    uint64_t tat = __atomic_load_n(&site->tat, __ATOMIC_RELAXED);
+    uint64_t next;
+    do {
+        next = (tat > now ? tat : now) + interval;
+        if (next - now > limit) {
+            log_site_suppress(site);
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&site->tat, &tat, next, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/**
+ * vreallogobject is the body of reallogobject and reallogger_object.
+ * level is one of the LOG_LEVEL_ values or LOG_LEVEL_NONE.
+ */
+static int
+vreallogobject(struct logger_t *lg, int level, int behave_type, va_list ap)
+{
+    int wc;
+    struct timespec now;
+
+    log_stats_begin();
+    log_clock_now(&now);
+
+    if (lg->serializer == LOG_SERIALIZE_BINARY) {
+        struct log_buf_t *b = &log_tls_buf;
+        struct log_bin_dict_t *d = log_bin_object_begin(lg, b, &now, level);
+        for (;;) {
+            struct object_field_t *arg = va_arg(ap, struct object_field_t*);
+            if (arg == NULL) {
+                break;
+            }
+            log_bin_object_field(b, d, arg, behave_type);
+            object_field_free(arg);
+        }
+        wc = log_bin_end(lg, b, d, LOG_BIN_OBJECT);
+    } else if (lg->serializer == LOG_SERIALIZE_STREAM) {
+        struct log_buf_t *b = &log_tls_buf;
+        log_stream_object_begin(b, &now, level);
+        for (;;) {
+            struct object_field_t *arg = va_arg(ap, struct object_field_t*);
+            if (arg == NULL) {
+                break;
+            }
+            log_stream_object_field(b, arg, behave_type);
+            object_field_free(arg);
+        }
+        wc = log_stream_end(lg, b, '}');
+    } else {
+        JSON_STRUCT root = log_dom_object_begin(&now, level);
+
+        behave_type = log_record_behave(behave_type);
+        for (int i = 1;; i++) {
+            struct object_field_t *arg = va_arg(ap, struct object_field_t*);
+            if (arg == NULL) {
+                break;
+            }
+            JSON_OBJECT_ADD(arg->key,
+                log_value_json(arg->type, &arg->value, arg->json_any, behave_type));
+            object_field_free(arg);
+            continue;
+        }
 
-    // if (strcmp(l, LOG_FATAL) == 0) {
-    //     exit(1);
-    // }
+        wc = log_dom_end(lg, root);
+    }
+
+    if (level == LOG_LEVEL_FATAL)
+        log_fatal_exit();
 
     return wc;
 }
 
-int
-reallogarray(int behave_type, ...)
+static int
+vreallogarray(struct logger_t *lg, int level, int behave_type, va_list ap)
 {
-    va_list ap;
     int wc;
-    JSON_STRUCT root = JSON_ARRAY();
 
-    va_start(ap, behave_type);
+    log_stats_begin();
+    if (lg->serializer == LOG_SERIALIZE_BINARY) {
+        struct log_buf_t *b = &log_tls_buf;
+        struct log_bin_dict_t *d = log_bin_begin(lg, b, 0);
+        for (;;) {
+            struct array_field_t *arg = va_arg(ap, struct array_field_t*);
+            if (arg == NULL) {
+                break;
+            }
+            log_bin_array_field(b, d, arg, behave_type);
+            array_field_free(arg);
+        }
+        wc = log_bin_end(lg, b, d, LOG_BIN_ARRAY);
+    } else if (lg->serializer == LOG_SERIALIZE_STREAM) {
+        struct log_buf_t *b = &log_tls_buf;
+        int first = 1;
+        log_stream_array_begin(b);
+        for (;;) {
+            struct array_field_t *arg = va_arg(ap, struct array_field_t*);
+            if (arg == NULL) {
+                break;
+            }
+            log_stream_array_field(b, arg, behave_type, &first);
+            array_field_free(arg);
+        }
+        wc = log_stream_end(lg, b, ']');
+    } else {
+        JSON_STRUCT root = JSON_ARRAY();
 
-    for (int i = 1;; i++) {
-        struct array_field_t *arg = va_arg(ap, struct array_field_t*);
-        if (arg == NULL) {
-            break;
+        behave_type = log_record_behave(behave_type);
+        for (int i = 1;; i++) {
+            struct array_field_t *arg = va_arg(ap, struct array_field_t*);
+            if (arg == NULL) {
+                break;
+            }
+            JSON_ARRAY_ADD(
+                log_value_json(arg->type, &arg->value, arg->json_any, behave_type));
+            array_field_free(arg);
+            continue;
         }
-        switch(behave_type){
-            case LOG_KEEP:
-                JSON_ARRAY_ADD(arg->json_any);
-            break;
-            case LOG_COPY:
-                JSON_ARRAY_ADD(JSON_COPY(arg->json_any));
-            break;
-            default:
-            break;
-        }  
-        array_field_free(arg);
-        continue;
+
+        wc = log_dom_end(lg, root);
     }
 
-    va_end(ap); 
+    if (level == LOG_LEVEL_FATAL)
+        log_fatal_exit();
 
-    char* json_2_str = JSON_DUMPS(root);
+    return wc;
+}
 
-#ifdef THREAD_ENABLE
-    while(pthread_mutex_lock(&lock_edit_log) != 0){ usleep(1); }
-#endif
-    if(log_output){
-        fflush(log_output);
-        wc = fprintf(log_output, "%s\n", json_2_str);
-    }
-    else
-        wc = LOG_NO_ACTION;
-#ifdef THREAD_ENABLE
-    pthread_mutex_unlock(&lock_edit_log);
-#endif
+int
+reallogobject(int behave_type, ...)
+{
+    va_list ap;
+    int wc;
 
-    free(json_2_str);
+    va_start(ap, behave_type);
+    wc = vreallogobject(&log_default, LOG_LEVEL_NONE, behave_type, ap);
+    va_end(ap);
+    return wc;
+}
 
-    JSON_DECREF(root); // decrement the count on the JSON object
+int
+reallogarray(int behave_type, ...)
+{
+    va_list ap;
+    int wc;
+
+    va_start(ap, behave_type);
+    wc = vreallogarray(&log_default, LOG_LEVEL_NONE, behave_type, ap);
+    va_end(ap);
+    return wc;
+}
+
+/**
+ * reallogger_object is reallogobject for logger lg and a record with a
+ * level. The level is added to the record as the "level" field.
+ */
+int
+reallogger_object(struct logger_t *lg, int level, int behave_type, ...)
+{
+    va_list ap;
+    int wc;
 
-    // if (strcmp(l, LOG_FATAL) == 0) {
-    //     exit(1);
-    // }
+    va_start(ap, behave_type);
+    wc = vreallogobject(lg, level, behave_type, ap);
+    va_end(ap);
+    return wc;
+}
+
+int
+reallogger_array(struct logger_t *lg, int level, int behave_type, ...)
+{
+    va_list ap;
+    int wc;
 
+    va_start(ap, behave_type);
+    wc = vreallogarray(lg, level, behave_type, ap);
+    va_end(ap);
     return wc;
 }
 
@@ -600,16 +8832,8 @@ reallobject(int behave_type, ...)
         if (arg == NULL) {
             break;
         }
-        switch(behave_type){
-            case LOG_KEEP:
-                JSON_OBJECT_ADD(arg->key, arg->json_any);
-            break;
-            case LOG_COPY:
-                JSON_OBJECT_ADD(arg->key, JSON_COPY(arg->json_any));
-            break;
-            default:
-            break;
-        }   
+        JSON_OBJECT_ADD(arg->key,
+            log_value_json(arg->type, &arg->value, arg->json_any, behave_type));
         object_field_free(arg);
         continue;
     }
@@ -633,16 +8857,8 @@ reallarray(int behave_type, ...)
         if (arg == NULL) {
             break;
         }
-        switch(behave_type){
-            case LOG_KEEP:
-                JSON_ARRAY_ADD(arg->json_any);
-            break;
-            case LOG_COPY:
-                JSON_ARRAY_ADD(JSON_COPY(arg->json_any));
-            break;
-            default:
-            break;
-        }  
+        JSON_ARRAY_ADD(
+            log_value_json(arg->type, &arg->value, arg->json_any, behave_type));
         array_field_free(arg);
         continue;
     }
@@ -652,6 +8868,101 @@ reallarray(int behave_type, ...)
     return root;
 }
 
+/**
+ * reallogobject_fields is reallogger_object for a counted array of
+ * field descriptors owned by the caller, as the STACK_FIELDS_ENABLE
+ * macros build them. Nothing is freed.
+ */
+int
+reallogobject_fields(struct logger_t *lg, int level, int behave_type,
+    struct object_field_t *fields, size_t n)
+{
+    struct timespec now;
+    int wc;
+
+    log_stats_begin();
+    log_clock_now(&now);
+
+    if (lg->serializer == LOG_SERIALIZE_BINARY) {
+        struct log_buf_t *b = &log_tls_buf;
+        struct log_bin_dict_t *d = log_bin_object_begin(lg, b, &now, level);
+        for (size_t i = 0; i < n; i++)
+            log_bin_object_field(b, d, &fields[i], behave_type);
+        wc = log_bin_end(lg, b, d, LOG_BIN_OBJECT);
+    } else if (lg->serializer == LOG_SERIALIZE_STREAM) {
+        struct log_buf_t *b = &log_tls_buf;
+        log_stream_object_begin(b, &now, level);
+        for (size_t i = 0; i < n; i++)
+            log_stream_object_field(b, &fields[i], behave_type);
+        wc = log_stream_end(lg, b, '}');
+    } else {
+        JSON_STRUCT root = log_dom_object_begin(&now, level);
+        behave_type = log_record_behave(behave_type);
+        for (size_t i = 0; i < n; i++)
+            JSON_OBJECT_ADD(fields[i].key, log_value_json(fields[i].type,
+                &fields[i].value, fields[i].json_any, behave_type));
+        wc = log_dom_end(lg, root);
+    }
+
+    if (level == LOG_LEVEL_FATAL)
+        log_fatal_exit();
+    return wc;
+}
+
+int
+reallogarray_fields(struct logger_t *lg, int level, int behave_type,
+    struct array_field_t *fields, size_t n)
+{
+    int wc;
+
+    log_stats_begin();
+    if (lg->serializer == LOG_SERIALIZE_BINARY) {
+        struct log_buf_t *b = &log_tls_buf;
+        struct log_bin_dict_t *d = log_bin_begin(lg, b, 0);
+        for (size_t i = 0; i < n; i++)
+            log_bin_array_field(b, d, &fields[i], behave_type);
+        wc = log_bin_end(lg, b, d, LOG_BIN_ARRAY);
+    } else if (lg->serializer == LOG_SERIALIZE_STREAM) {
+        struct log_buf_t *b = &log_tls_buf;
+        int first = 1;
+        log_stream_array_begin(b);
+        for (size_t i = 0; i < n; i++)
+            log_stream_array_field(b, &fields[i], behave_type, &first);
+        wc = log_stream_end(lg, b, ']');
+    } else {
+        JSON_STRUCT root = JSON_ARRAY();
+        behave_type = log_record_behave(behave_type);
+        for (size_t i = 0; i < n; i++)
+            JSON_ARRAY_ADD(log_value_json(fields[i].type, &fields[i].value,
+                fields[i].json_any, behave_type));
+        wc = log_dom_end(lg, root);
+    }
+
+    if (level == LOG_LEVEL_FATAL)
+        log_fatal_exit();
+    return wc;
+}
+
+JSON_STRUCT
+reallobject_fields(int behave_type, struct object_field_t *fields, size_t n)
+{
+    JSON_STRUCT root = JSON_OBJECT();
+    for (size_t i = 0; i < n; i++)
+        JSON_OBJECT_ADD(fields[i].key, log_value_json(fields[i].type,
+            &fields[i].value, fields[i].json_any, behave_type));
+    return root;
+}
+
+JSON_STRUCT
+reallarray_fields(int behave_type, struct array_field_t *fields, size_t n)
+{
+    JSON_STRUCT root = JSON_ARRAY();
+    for (size_t i = 0; i < n; i++)
+        JSON_ARRAY_ADD(log_value_json(fields[i].type, &fields[i].value,
+            fields[i].json_any, behave_type));
+    return root;
+}
+
 int 
 check_json_type(JSON_STRUCT root){
     if(JSON_IS_ARRAY(root))
@@ -0,0 +1,188 @@
+/*
+ * logmerge merges shard files written by a sharded logger back into one
+ * stream ordered by the records' timestamp field.
+ *
+ *   ./logmerge [-o output] shard...
+ *
+ * e.g. ./logmerge app.log.* > app.log
+ *
+ * Each shard is taken to be in timestamp order, so this is a k-way
+ * merge that holds one line per shard in memory and never reorders
+ * lines within a shard. A shard written by a single thread is in
+ * order; a per-CPU shard, or a thread shard shared by more threads
+ * than there are shards, can be slightly out of order where writers
+ * raced, and stays that way. Records with equal
+ * timestamps keep the order of the shards on the command line, and
+ * records without a timestamp, such as log_array ones, stay behind the
+ * record before them in their shard. Integer timestamps compare as
+ * numbers and RFC 3339 ones as strings; shards should not mix the two.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/types.h>
+
+#define MERGE_TS_MAX 40
+
+struct merge_key_t {
+    int is_str;
+    long long num;
+    char str[MERGE_TS_MAX];
+};
+
+struct merge_src_t {
+    FILE *in;
+    const char *name;
+    char *line;
+    size_t cap;
+    ssize_t len;
+    struct merge_key_t key;
+};
+
+/**
+ * merge_parse_key reads the timestamp field of line into key. A line
+ * without one leaves key as it was.
+ */
+static void
+merge_parse_key(const char *line, struct merge_key_t *key)
+{
+    const char *p = strstr(line, "\"timestamp\"");
+    size_t n = 0;
+
+    if (p == NULL)
+        return;
+    p += sizeof("\"timestamp\"") - 1;
+    while (*p == ' ' || *p == ':')
+        p++;
+    if (*p != '"') {
+        key->is_str = 0;
+        key->num = strtoll(p, NULL, 10);
+        return;
+    }
+    for (p++; *p != '"' && *p != '\0' && n < MERGE_TS_MAX - 1; p++)
+        key->str[n++] = *p;
+    key->str[n] = '\0';
+    key->is_str = 1;
+}
+
+static int
+merge_key_cmp(const struct merge_key_t *a, const struct merge_key_t *b)
+{
+    if (a->is_str != b->is_str)
+        return a->is_str - b->is_str;
+    if (a->is_str)
+        return strcmp(a->str, b->str);
+    return (a->num > b->num) - (a->num < b->num);
+}
+
+/**
+ * merge_before orders shards by their current key, then by position on
+ * the command line so equal timestamps come out stable.
+ */
+static int
+merge_before(struct merge_src_t *src, int a, int b)
+{
+    int c = merge_key_cmp(&src[a].key, &src[b].key);
+    return c < 0 || (c == 0 && a < b);
+}
+
+static int
+merge_next(struct merge_src_t *s)
+{
+    if ((s->len = getline(&s->line, &s->cap, s->in)) <= 0)
+        return 0;
+    merge_parse_key(s->line, &s->key);
+    return 1;
+}
+
+static void
+merge_sift_down(struct merge_src_t *src, int *heap, int n, int i)
+{
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < n && merge_before(src, heap[l], heap[m]))
+            m = l;
+        if (r < n && merge_before(src, heap[r], heap[m]))
+            m = r;
+        if (m == i)
+            return;
+        int t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: logmerge [-o output] shard...\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct merge_src_t *src;
+    FILE *out = stdout;
+    int *heap, n = 0, nsrc, opt;
+
+    while ((opt = getopt(argc, argv, "o:h")) != -1) {
+        switch (opt) {
+            case 'o':
+                if ((out = fopen(optarg, "w")) == NULL) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    nsrc = argc - optind;
+    if (nsrc <= 0)
+        usage();
+
+    src = (struct merge_src_t *)calloc((size_t)nsrc, sizeof(struct merge_src_t));
+    heap = (int *)calloc((size_t)nsrc, sizeof(int));
+    if (src == NULL || heap == NULL) {
+        perror("logmerge");
+        return 1;
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+    for (int i = 0; i < nsrc; i++) {
+        src[i].name = argv[optind + i];
+        if ((src[i].in = fopen(src[i].name, "r")) == NULL) {
+            perror(src[i].name);
+            return 1;
+        }
+        if (merge_next(&src[i]))
+            heap[n++] = i;
+    }
+    for (int i = n / 2 - 1; i >= 0; i--)
+        merge_sift_down(src, heap, n, i);
+
+    while (n > 0) {
+        struct merge_src_t *s = &src[heap[0]];
+        fwrite(s->line, 1, (size_t)s->len, out);
+        if (s->line[s->len - 1] != '\n')
+            fputc('\n', out);
+        if (!merge_next(s))
+            heap[0] = heap[--n];
+        merge_sift_down(src, heap, n, 0);
+    }
+
+    for (int i = 0; i < nsrc; i++) {
+        fclose(src[i].in);
+        free(src[i].line);
+    }
+    free(src);
+    free(heap);
+    if (fclose(out) != 0) {
+        perror("logmerge");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * test_blocks checks that logblock reads back what a logger set up
+ * with log_init_blocks wrote.
+ *
+ *   ./test_blocks [logblock]
+ *
+ * A block file must refuse the binary serializer. Then three runs of
+ * numbered records, a little more than LOG_BLOCK_MS apart, go into a
+ * block file in a temporary directory, without async mode. Before the
+ * logger is closed, logblock (./logblock by default) must already give
+ * back the first two runs, which only went out for their age. Once it
+ * is closed it must give back every record in order, and exactly the
+ * second run for the times around it. Run by make test.
+ */
+#define LOG_BLOCK_MS 20
+
+#include <stdio.h>
+
+#include "logger.h"
+
+#define RUN 500
+
+static const char *logblock = "./logblock";
+static char path[64];
+
+static int64_t
+now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+write_run(int first)
+{
+    for (int i = first; i < first + RUN; i++)
+        log_object(LOG_KEEP, object_int("i", i), object_string("pad", "0123456789abcdef"));
+}
+
+/**
+ * read_back runs logblock with args on the file and checks that the
+ * records it gives are numbered first, first + 1 and so on. Returns
+ * how many it gave, or -1.
+ */
+static long
+read_back(const char *args, int first)
+{
+    char cmd[256], line[256];
+    long n = 0;
+    FILE *in;
+
+    snprintf(cmd, sizeof(cmd), "%s %s %s", logblock, args, path);
+    if ((in = popen(cmd, "r")) == NULL) {
+        perror(cmd);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), in) != NULL) {
+        const char *p = strstr(line, "\"i\": ");
+        if (p == NULL || atoi(p + 5) != first + n) {
+            fprintf(stderr, "test_blocks: %s: record %ld is %s", cmd, n, line);
+            n = -1;
+            break;
+        }
+        n++;
+    }
+    if (pclose(in) != 0 && n >= 0) {
+        fprintf(stderr, "test_blocks: %s failed\n", cmd);
+        n = -1;
+    }
+    return n;
+}
+
+int
+main(int argc, char **argv)
+{
+    char dir[] = "/tmp/test_blocksXXXXXX", args[64], idx[sizeof(path) + 4];
+    int64_t from, to;
+    long n;
+    int failed = 0;
+
+    if (argc > 1)
+        logblock = argv[1];
+    if (mkdtemp(dir) == NULL) {
+        perror("test_blocks");
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/blocks.log", dir);
+    log_set_timestamp(LOG_TS_NSEC, LOG_CLOCK_PRECISE);
+    log_set_serializer(LOG_SERIALIZE_BINARY);
+    if (log_init_blocks(path, 0) != LOG_FAIL) {
+        fprintf(stderr, "test_blocks: a block file took binary records\n");
+        return 1;
+    }
+    log_set_serializer(LOG_SERIALIZE_STREAM);
+    if (log_init_blocks(path, 0) != LOG_OPEN) {
+        perror(path);
+        return 1;
+    }
+
+    write_run(0);
+    usleep(2 * LOG_BLOCK_MS * 1000);
+    from = now_ns();
+    write_run(RUN);
+    usleep(2 * LOG_BLOCK_MS * 1000);
+    to = now_ns();
+    write_run(2 * RUN);
+
+    if ((n = read_back("", 0)) < 2 * RUN) {
+        fprintf(stderr, "test_blocks: %ld records out before close, not %d\n", n, 2 * RUN);
+        failed++;
+    }
+    log_close();
+    if ((n = read_back("", 0)) != 3 * RUN) {
+        fprintf(stderr, "test_blocks: %ld records read back, not %d\n", n, 3 * RUN);
+        failed++;
+    }
+    snprintf(args, sizeof(args), "-f %lld -t %lld", (long long)from, (long long)to);
+    if ((n = read_back(args, RUN)) != RUN) {
+        fprintf(stderr, "test_blocks: %ld records in range, not %d\n", n, RUN);
+        failed++;
+    }
+
+    if (failed) {
+        fprintf(stderr, "test_blocks: %d failures, files left in %s\n", failed, dir);
+        return 1;
+    }
+    snprintf(idx, sizeof(idx), "%s.idx", path);
+    unlink(idx);
+    unlink(path);
+    rmdir(dir);
+    printf("test_blocks: %d records in 3 runs ok\n", 3 * RUN);
+    return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * test_double checks the double formatting of the streaming serializer,
+ * log_buf_put_double, against strtod.
+ *
+ *   ./test_double [count]
+ *
+ * A table of values must come out exactly as listed, and count doubles
+ * (1000000 by default) drawn from every bit pattern, with a fixed seed,
+ * must read back through strtod as the same double. NaN and the
+ * infinities must be refused. Run by make test.
+ */
+#include <stdio.h>
+#include <float.h>
+
+#include "logger.h"
+
+static const struct {
+    double v;
+    const char *text;
+} cases[] = {
+    { 0.0, "0.0" },
+    { -0.0, "-0.0" },
+    { 1.0, "1.0" },
+    { -1.0, "-1.0" },
+    { 2.2, "2.2" },
+    { 100.0, "100.0" },
+    { 0.1, "0.1" },
+    { 0.3, "0.3" },
+    { 0.001, "0.001" },
+    { 1e-5, "0.00001" },
+    { 2.5e-5, "0.000025" },
+    { 1.5e-7, "1.5e-7" },
+    { 123456.789, "123456.789" },
+    { 1.0 / 3, "0.3333333333333333" },
+    { 1e16, "10000000000000000.0" },
+    { 1e17, "1e17" },
+    { 9007199254740993.0, "9007199254740992.0" },
+    { 1e22, "1e22" },
+    { 1e300, "1e300" },
+    { 5e-324, "5e-324" },
+    { DBL_MIN, "2.2250738585072014e-308" },
+    { DBL_MAX, "1.7976931348623157e308" }
+};
+
+static int
+format(double v, char *out, size_t size)
+{
+    struct log_buf_t b = { NULL, 0, 0, 0 };
+    int ok = log_buf_put_double(&b, v);
+
+    snprintf(out, size, "%.*s", (int)b.len, b.data ? b.data : "");
+    free(b.data);
+    return ok;
+}
+
+/**
+ * roundtrip formats v and reads it back, returning 0 if that gives the
+ * same bits and the text is a JSON number.
+ */
+static int
+roundtrip(double v, char *out, size_t size)
+{
+    char *end;
+    double back;
+
+    if (!format(v, out, size) || strspn(out, "-0123456789.e") != strlen(out) ||
+            (strchr(out, '.') == NULL && strchr(out, 'e') == NULL))
+        return -1;
+    back = strtod(out, &end);
+    return *end == '\0' && memcmp(&back, &v, sizeof(v)) == 0 ? 0 : -1;
+}
+
+int
+main(int argc, char **argv)
+{
+    long count = argc > 1 ? atol(argv[1]) : 1000000;
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    char out[64];
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (!format(cases[i].v, out, sizeof(out)) || strcmp(out, cases[i].text) != 0) {
+            fprintf(stderr, "test_double: %.17g gave %s, not %s\n", cases[i].v, out, cases[i].text);
+            failed++;
+        }
+    }
+    if (format(NAN, out, sizeof(out)) || format(INFINITY, out, sizeof(out)) ||
+            format(-INFINITY, out, sizeof(out))) {
+        fprintf(stderr, "test_double: NaN or infinity was written\n");
+        failed++;
+    }
+
+    for (long i = 0; i < count; i++) {
+        double v;
+        /* xorshift64, so runs are repeatable */
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        memcpy(&v, &x, sizeof(v));
+        if (v != v || v - v != 0)
+            continue;
+        if (roundtrip(v, out, sizeof(out)) != 0) {
+            fprintf(stderr, "test_double: %.17g gave %s\n", v, out);
+            if (++failed > 20)
+                break;
+        }
+    }
+    for (int e = -1074; e <= 1023; e++) {
+        double v = ldexp(1.0, e);
+        if (roundtrip(v, out, sizeof(out)) != 0 || roundtrip(nextafter(v, 0), out, sizeof(out)) != 0) {
+            fprintf(stderr, "test_double: 2^%d or the double below it gave %s\n", e, out);
+            failed++;
+        }
+    }
+
+    if (failed) {
+        fprintf(stderr, "test_double: %d failures\n", failed);
+        return 1;
+    }
+    printf("test_double: %zu cases and %ld random doubles ok\n",
+        sizeof(cases) / sizeof(cases[0]), count);
+    return 0;
+}